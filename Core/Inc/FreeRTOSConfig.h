@@ -63,11 +63,12 @@
 #define configCPU_CLOCK_HZ                       ( SystemCoreClock )
 #define configTICK_RATE_HZ                       ((TickType_t)1000)
 #define configMAX_PRIORITIES                     ( 7 )
-#define configMINIMAL_STACK_SIZE                 ((uint16_t)1024)
+#define configMINIMAL_STACK_SIZE                 ((uint16_t)256)
 #define configMAX_TASK_NAME_LEN                  ( 16 )
 #define configUSE_16_BIT_TICKS                   0
 #define configUSE_MUTEXES                        1
 #define configQUEUE_REGISTRY_SIZE                8
+#define configCHECK_FOR_STACK_OVERFLOW           2
 #define configUSE_PORT_OPTIMISED_TASK_SELECTION  1
 /* USER CODE BEGIN MESSAGE_BUFFER_LENGTH_TYPE */
 /* Defaults to size_t for backward compatibility, but can be changed
@@ -79,6 +80,12 @@
 #define configUSE_CO_ROUTINES                    0
 #define configMAX_CO_ROUTINE_PRIORITIES          ( 2 )
 
+/* Software timer definitions. */
+#define configUSE_TIMERS                         1
+#define configTIMER_TASK_PRIORITY                ( 6 )
+#define configTIMER_QUEUE_LENGTH                 10
+#define configTIMER_TASK_STACK_DEPTH             320
+
 /* Set the following definitions to 1 to include the API function, or zero
 to exclude the API function. */
 #define INCLUDE_vTaskPrioritySet             1
@@ -133,6 +140,18 @@ standard names. */
 
 /* USER CODE BEGIN Defines */
 /* Section where parameter definitions can be added (for instance, to override default ones in FreeRTOS.h) */
+/* Run time stats use the DWT cycle counter (SYSCLK) as the timebase, see trace.c */
+#if defined(__ICCARM__) || defined(__CC_ARM) || defined(__GNUC__)
+  extern void trace_init(void);
+  extern void trace_task_switched_in(uint32_t task_number);
+#endif
+#define configUSE_TRACE_FACILITY                 1
+#define configGENERATE_RUN_TIME_STATS            1
+#define INCLUDE_xTaskGetIdleTaskHandle           1
+#define portCONFIGURE_TIMER_FOR_RUN_TIME_STATS() trace_init()
+#define portGET_RUN_TIME_COUNTER_VALUE()         (*(volatile uint32_t *)0xE0001004UL)
+/* Counts context switches per task, uxTCBNumber is there because of configUSE_TRACE_FACILITY */
+#define traceTASK_SWITCHED_IN()                  trace_task_switched_in(pxCurrentTCB->uxTCBNumber)
 /* USER CODE END Defines */
 
 #endif /* FREERTOS_CONFIG_H */
@@ -0,0 +1,64 @@
+// config_journal.h
+
+
+#ifndef CONFIG_JOURNAL_H
+#define CONFIG_JOURNAL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "main.h"
+
+// the last six flash sectors are kept out of the linker script FLASH region
+// and each journal uses two of them in turn, as a log of fixed size records.
+// Every save goes in the next empty record of one sector. Once that is full
+// the next save goes in the other sector, and the full one is only erased
+// after that record is complete, so there is always a good record in flash.
+// The erase holds up anything running from flash for a second or two, so it
+// is left for journal_erase_spares() while the outputs are stopped
+#define JOURNAL_SECTOR_SIZE (256 * 1024)
+#define CONFIG_JOURNAL_SECTOR FLASH_SECTOR_10   // and FLASH_SECTOR_11
+#define CONFIG_JOURNAL_START 0x08180000UL
+#define PRESET_JOURNAL_SECTOR FLASH_SECTOR_8    // and FLASH_SECTOR_9
+#define PRESET_JOURNAL_START 0x08100000UL
+#define DAC_CAL_JOURNAL_SECTOR FLASH_SECTOR_6   // and FLASH_SECTOR_7
+#define DAC_CAL_JOURNAL_START 0x08080000UL
+
+// records are a sequence number, data_size bytes of data and a check word.
+// The sequence counts up with every save and is all ones if the record is
+// empty, the check is a hash of the sequence and data and is written last
+#define JOURNAL_RECORD_SIZE(data_size) ((data_size) + 2 * sizeof(uint32_t))
+
+// the state of the sector that is not being written
+typedef enum
+{
+	SPARE_UNKNOWN,  // not checked since reset
+	SPARE_ERASED,
+	SPARE_DIRTY     // holds old records, has to be erased before it is used
+} SPARE_STATE_t;
+
+typedef struct JOURNAL_s
+{
+	uint32_t start;      // of the first sector, the second one follows it
+	uint32_t size;       // of each sector
+	uint32_t sector;     // the first sector, the second one is sector + 1
+	uint32_t data_size;  // a multiple of 4
+
+	// found by the first load or save, so the sectors are only searched once
+	bool scanned;
+	uint8_t half;        // the sector saves go in, 0 or 1
+	SPARE_STATE_t spare_state;
+	uint32_t next_record;
+	uint32_t next_sequence;
+	const uint8_t* last_data; // the newest good record in flash, NULL if none
+	struct JOURNAL_s* next_journal; // every scanned journal, for journal_erase_spares()
+} JOURNAL_t;
+
+#define JOURNAL_INIT(start_, sector_, data_size_) \
+	{ .start = (start_), .size = JOURNAL_SECTOR_SIZE, .sector = (sector_), .data_size = (data_size_) }
+
+const void* journal_latest(JOURNAL_t* journal);
+bool journal_load(JOURNAL_t* journal, void* data);
+bool journal_save(JOURNAL_t* journal, const void* data);
+bool journal_erase_spares(void);
+
+#endif // CONFIG_JOURNAL_H
@@ -0,0 +1,66 @@
+// dac_cal.h
+
+
+#ifndef DAC_CAL_H
+#define DAC_CAL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "serial.h"
+
+// output 4 is set by the DAC through a different MOSFET for each polarity, so
+// each has its own calibration: up to DAC_CAL_MAX_POINTS bias voltages, as
+// magnitudes in mV going up, and the DAC code measured to give each one.
+// Between the points the code is interpolated, outside them it is held at
+// the end point, so the points also set how far the bias can go
+#define DAC_CAL_MAX_POINTS 16
+#define DAC_CAL_MAX_mV 3300   // the Bias V setting goes to plus and minus this
+#define DAC_CAL_MAX_CODE 4095
+#define DAC_CAL_HOLD_OFF 0xFFFF
+#define DAC_CAL_RECORD_TYPE 0xE2
+
+typedef enum
+{
+	DAC_CAL_NEG = 0,
+	DAC_CAL_POS = 1,
+	NUM_DAC_CAL_TABLES
+} DAC_CAL_POLARITY_t;
+
+typedef struct
+{
+	uint16_t mV;
+	uint16_t code;
+} DAC_CAL_POINT_t;
+
+typedef struct
+{
+	uint16_t num_points;
+	uint16_t reserved;
+	DAC_CAL_POINT_t points[DAC_CAL_MAX_POINTS];
+} DAC_CAL_TABLE_t;
+
+// both tables are one journal record, rewritten on every save
+typedef struct
+{
+	DAC_CAL_TABLE_t tables[NUM_DAC_CAL_TABLES];
+} DAC_CAL_t;
+
+// the reply to CMD_DAC_CAL_GET. All fields are little endian
+typedef struct __attribute__((packed))
+{
+	uint8_t type;               // DAC_CAL_RECORD_TYPE
+	uint8_t polarity;           // DAC_CAL_POLARITY_t
+	uint8_t num_points;
+	uint8_t stored;             // 0 if no calibration has been saved and the nominal one is in use
+	DAC_CAL_POINT_t points[DAC_CAL_MAX_POINTS];
+} DAC_CAL_RECORD_t;
+
+void dac_cal_init(void);
+uint16_t dac_cal_code(int32_t bias_mV, int8_t sign);
+void dac_cal_hold(uint8_t polarity, uint16_t code);
+bool dac_cal_holding(void);
+bool dac_cal_stage(uint8_t polarity, const DAC_CAL_POINT_t* points, uint8_t num_points);
+bool dac_cal_save(void);
+void send_dac_cal(SERIAL_TRANSPORT_t transport, uint8_t polarity);
+
+#endif // DAC_CAL_H
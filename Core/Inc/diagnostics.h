@@ -0,0 +1,78 @@
+// diagnostics.h
+
+
+#ifndef DIAGNOSTICS_H
+#define DIAGNOSTICS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "cmsis_os.h"
+#include "trace.h"
+#include "serial.h"
+
+#define DIAGNOSTICS_RECORD_TYPE 0xD1
+#define DIAG_WINDOW_ms 100
+#define MAX_DIAG_TASKS 8
+#define DIAG_NAME_LEN 8
+
+typedef struct
+{
+	TaskHandle_t handle;
+	char name[DIAG_NAME_LEN];
+	uint16_t cpu_permille;     // share of the last window
+	uint16_t stack_free_words; // high water mark, least free stack ever seen
+	uint32_t switches;         // context switches into the task since boot
+} DIAG_TASK_t;
+
+typedef struct
+{
+	uint8_t num_tasks;
+	uint16_t cpu_permille;     // everything but the idle task
+	DIAG_TASK_t tasks[MAX_DIAG_TASKS];
+	uint16_t isr_permille[NUM_ISR_SOURCES];
+	uint32_t isr_counts[NUM_ISR_SOURCES];
+	uint32_t isr_mean_cycles[NUM_ISR_SOURCES]; // per interrupt over the last window
+	uint32_t isr_max_cycles[NUM_ISR_SOURCES];  // longest since boot
+} DIAGNOSTICS_t;
+
+// the reply to CMD_DIAGNOSTICS, a header followed by num_tasks task entries,
+// num_isrs interrupt entries and num_boot_steps boot times. All fields are
+// little endian
+typedef struct __attribute__((packed))
+{
+	uint8_t type;              // DIAGNOSTICS_RECORD_TYPE
+	uint8_t num_tasks;
+	uint8_t num_isrs;
+	uint8_t window_10ms;
+	uint16_t cpu_permille;
+	uint8_t num_boot_steps;
+	uint32_t relay_ops;        // operations of each output voltage relay, ever
+} DIAG_RECORD_HEADER_t;
+
+typedef struct __attribute__((packed))
+{
+	char name[DIAG_NAME_LEN];
+	uint16_t cpu_permille;
+	uint16_t stack_free_words;
+	uint32_t switches;
+} DIAG_RECORD_TASK_t;
+
+typedef struct __attribute__((packed))
+{
+	uint16_t cpu_permille;
+	uint32_t count;
+	uint32_t mean_cycles;
+	uint32_t max_cycles;
+} DIAG_RECORD_ISR_t;
+
+typedef struct __attribute__((packed))
+{
+	uint32_t us;               // since reset, 0 if the step has not happened
+} DIAG_RECORD_BOOT_t;
+
+void update_diagnostics(void);
+const DIAGNOSTICS_t* get_diagnostics(void);
+uint8_t get_task_cpu_percent(TaskHandle_t handle);
+void send_diagnostics(SERIAL_TRANSPORT_t transport);
+
+#endif // DIAGNOSTICS_H
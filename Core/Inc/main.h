@@ -46,7 +46,9 @@ extern "C" {
 
 /* Exported macro ------------------------------------------------------------*/
 /* USER CODE BEGIN EM */
-
+/* anything a DMA stream reads or writes goes in SRAM2, which the MPU keeps
+   out of the D-cache. Aligned to a cache line in case that ever changes */
+#define DMA_BUFFER __attribute__((section(".dma_buffer"), aligned(32)))
 /* USER CODE END EM */
 
 void HAL_TIM_MspPostInit(TIM_HandleTypeDef *htim);
@@ -65,6 +67,8 @@ void Error_Handler(void);
 #define OUT2_GPIO_Port GPIOA
 #define OUT3_Pin GPIO_PIN_2
 #define OUT3_GPIO_Port GPIOA
+#define OUT4_SENSE_Pin GPIO_PIN_3
+#define OUT4_SENSE_GPIO_Port GPIOA
 #define SHDN_Pin GPIO_PIN_5
 #define SHDN_GPIO_Port GPIOA
 #define RST_Pin GPIO_PIN_0
@@ -8,9 +8,9 @@
 #include "outputs.h"
 #include "user_input.h"
 
-#define MAX_SETTING_NAME_SIZE 128
+#define MAX_SETTING_NAME_SIZE 16
 #define MAX_TOGGLE_SELECTION_SIZE 8
-#define NUM_SETTINGS 5
+#define NUM_SETTINGS 6
 
 #define CONVERT_TO_FLOAT(value, dec) (((float)value)/pow(10, (dec)))
 
@@ -21,29 +21,40 @@ typedef enum
 	TOGGLE = 1
 } SETTING_TYPE_t;
 
+// the parts of a setting that never change. Kept const so the table stays in
+// flash and only the values below take up RAM
 typedef struct
 {
-	char name[MAX_SETTING_NAME_SIZE]; // should include trailing spaces to make the output look good
+	const char* name; // should include trailing spaces to make the output look good
 	SETTING_TYPE_t type;
 
 	// only used if this is a continuous setting. NOTE: fixed point
-	int32_t cont_value; // fixed point base10 with decimal_loc
 	int32_t min;        // fixed point base10 with decimal_loc
 	int32_t max;        // fixed point base10 with decimal_loc
 	uint8_t decimal_loc;
 	uint8_t num_digits;
+
+	// only used if this is a toggle setting
+	const char* setting1_name;
+	const char* setting2_name;
+} SETTING_INFO_t;
+
+typedef struct
+{
+	const SETTING_INFO_t* info;
+
+	// only used if this is a continuous setting
+	int32_t cont_value; // fixed point base10 with info->decimal_loc
 	uint8_t current_digit;
 
 	// only used if this is a toggle setting
 	uint8_t toggle_value;
-	char setting1_name[MAX_TOGGLE_SELECTION_SIZE];
-	char setting2_name[MAX_TOGGLE_SELECTION_SIZE];
-
 } SETTING_t;
 
 
 // function prototypes
 void main_task(void);
+void restore_outputs(void);
 
 bool handle_input_events(INPUTS_t* events);
 
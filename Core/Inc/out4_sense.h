@@ -0,0 +1,33 @@
+// out4_sense.h
+
+
+#ifndef OUT4_SENSE_H
+#define OUT4_SENSE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// the ADC samples output 4 once per pulse into a ring, and the main task
+// averages what has come in over each block. A block ends once it is
+// OUT4_SENSE_BLOCK_ms long and has OUT4_SENSE_MIN_SAMPLES samples, which at
+// low frequencies takes longer
+#define OUT4_SENSE_RING_SIZE 256
+#define OUT4_SENSE_BLOCK_ms 250
+#define OUT4_SENSE_MIN_SAMPLES 4
+
+// time the output is left to settle after the bias changes before it is
+// measured
+#define OUT4_SENSE_SETTLE_ms 50
+
+// the trim moves the DAC by half of what the error works out to at the end
+// of every block, by at most OUT4_TRIM_MAX_STEP codes at a time and
+// OUT4_TRIM_MAX_CODES in all. Errors inside the deadband are left alone
+#define OUT4_TRIM_DEADBAND_mV 2
+#define OUT4_TRIM_MAX_STEP 16
+#define OUT4_TRIM_MAX_CODES 120
+
+void out4_sense_init(void);
+void run_out4_sense(void);
+bool get_out4_sense(int16_t* sense_mV, int16_t* trim_codes);
+
+#endif // OUT4_SENSE_H
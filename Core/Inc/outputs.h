@@ -39,13 +39,62 @@ typedef enum
 
 #define NUM_NEO_LEDS 4
 
+// a bias table is up to BIAS_TABLE_MAX_STEPS voltages, each held for a number
+// of pulses. The steps times the pulses per step can not be more than
+// BIAS_TABLE_MAX_CODES, the DMA buffer has one code per pulse
+#define BIAS_TABLE_MAX_STEPS 256
+#define BIAS_TABLE_MAX_CODES 2048
+
+// everything enable_output_waveform() works out from its arguments. A plan
+// can be stored, e.g. with a preset, and put on the outputs later without
+// redoing the math. Bump OUTPUT_PLAN_VERSION whenever the way a plan is
+// worked out changes so stored plans get redone
+#define OUTPUT_PLAN_VERSION 2
+typedef struct
+{
+	uint32_t period_100ns;
+	uint32_t out1_fall;       // edge times in timer ticks from the start of the period
+	uint32_t out2_rise;
+	uint32_t out2_fall;
+	uint32_t out3_rise;
+	uint32_t out3_fall;
+	uint32_t out4_rise;
+	uint32_t out4_fall;
+	int16_t bias_mV;          // output 4 level, turned into a DAC code through the calibration
+	int8_t bias_sign;         // 1 positive, -1 negative, 0 for no bias
+	uint8_t out_voltage;      // OUT12_VOLTAGE_t, the relay setting
+} OUTPUT_PLAN_t;
+
 OUTPUT_ERROR_t enable_output_waveform(uint32_t period_100ns,
 		                              OUTPUT_TYPE_t out_type,
 									  OUT12_VOLTAGE_t out_voltage,
-									  float target_bias_voltage_V,
+									  int16_t target_bias_mV,
 									  bool single_shot);
+OUTPUT_ERROR_t arm_output_waveform(uint32_t period_100ns,
+		                           OUTPUT_TYPE_t out_type,
+								   OUT12_VOLTAGE_t out_voltage,
+								   int16_t target_bias_mV,
+								   bool single_shot);
+OUTPUT_ERROR_t plan_output_waveform(uint32_t period_100ns,
+		                            OUTPUT_TYPE_t out_type,
+									OUT12_VOLTAGE_t out_voltage,
+									int16_t target_bias_mV,
+									bool single_shot,
+									OUTPUT_PLAN_t* plan);
+OUTPUT_ERROR_t enable_output_plan(const OUTPUT_PLAN_t* plan);
+OUTPUT_ERROR_t arm_output_plan(const OUTPUT_PLAN_t* plan);
+OUTPUT_ERROR_t start_bias_table(const int16_t* bias_mV, uint16_t num_steps,
+		                        uint16_t pulses_per_step, bool circular);
+void stop_bias_table(void);
+bool is_bias_table_running(void);
+bool get_out4_bias(int16_t* bias_mV, uint16_t* code, int32_t* trim_codes);
+bool trim_out4_bias(int32_t trim_codes);
+bool fire_output_waveform(void);
+bool is_output_armed(void);
 void disable_all_outputs();
 int8_t set_neopixel(uint8_t led_num, uint8_t red, uint8_t grn, uint8_t blu);
 void send_neo_led_sequence(void);
+void neo_period_elapsed(void);
+uint32_t get_pulses_emitted(void);
 
 #endif // #ifndef OUTPUTS_H
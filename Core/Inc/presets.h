@@ -0,0 +1,57 @@
+// presets.h
+
+
+#ifndef PRESETS_H
+#define PRESETS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "outputs.h"
+#include "serial.h"
+
+#define NUM_PRESETS 16
+#define PRESET_NAME_LEN 12
+#define PRESET_RECORD_TYPE 0xE1
+
+// one stored configuration. The settings are kept so the menu and the host
+// can show them, the plan so it can go straight onto the outputs
+typedef struct
+{
+	char name[PRESET_NAME_LEN]; // not terminated if it fills the array
+	int32_t freq;               // the settings, in the same units as settings[]
+	int16_t bias;
+	uint8_t out_mode;
+	uint8_t out_voltage;
+	OUTPUT_PLAN_t plan;
+} PRESET_t;
+
+// the whole bank is one journal record, rewritten on every save. A sector
+// holds a few hundred of them, and the journal moves to its other sector
+// when one fills so a save is never waiting on an erase of the only copy
+typedef struct
+{
+	uint16_t plan_version;      // OUTPUT_PLAN_VERSION when the plans were worked out
+	uint16_t used;              // bit n is set if preset n holds a configuration
+	PRESET_t presets[NUM_PRESETS];
+} PRESET_BANK_t;
+
+// the reply to CMD_PRESET_GET. All fields are little endian
+typedef struct __attribute__((packed))
+{
+	uint8_t type;               // PRESET_RECORD_TYPE
+	uint8_t slot;
+	uint8_t used;
+	char name[PRESET_NAME_LEN];
+	int32_t freq;
+	int16_t bias;
+	uint8_t out_mode;
+	uint8_t out_voltage;
+} PRESET_RECORD_t;
+
+const PRESET_t* get_preset(uint8_t slot);
+const OUTPUT_PLAN_t* get_preset_plan(uint8_t slot);
+int8_t next_preset(int8_t slot);
+bool save_preset(uint8_t slot, const PRESET_t* preset);
+void send_preset(SERIAL_TRANSPORT_t transport, uint8_t slot);
+
+#endif // PRESETS_H
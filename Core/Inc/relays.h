@@ -0,0 +1,21 @@
+// relays.h
+
+
+#ifndef RELAYS_H
+#define RELAYS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// time from driving the coils until the contacts have stopped bouncing. The
+// outputs are not started until this has passed after a switch
+#define RELAY_SETTLE_ms 10
+
+typedef void (*RELAY_SETTLED_t)(void);
+
+bool set_relays(bool set, RELAY_SETTLED_t settled);
+bool are_relays_settling(void);
+uint32_t get_relay_ops(void);
+void restore_relay_ops(uint32_t ops);
+
+#endif // RELAYS_H
@@ -8,8 +8,53 @@
 #ifndef INC_SERIAL_H_
 #define INC_SERIAL_H_
 
+#include <stdbool.h>
+#include <stdint.h>
+
+// single byte command frames from the host. Anything 9 bytes long is a
+// full configuration frame. A configuration frame can carry a 10th byte, a
+// sequence number, which is echoed back with the configuration once the
+// outputs have been updated so the host can match the echo to its change
+#define CONFIG_FRAME_SIZE     9
+#define CONFIG_SEQ_FRAME_SIZE 10
+
+#define CMD_QUERY_CONFIG    0xAA
+#define CMD_TELEMETRY       0xAB // followed by the rate in Hz, uint16 little endian (0 = off)
+#define CMD_TRIGGER         0xAC // starts armed outputs from the USB interrupt, must be its own USB packet
+#define CMD_ARM             0xAD // configures the outputs and waits for CMD_TRIGGER
+#define CMD_DIAGNOSTICS     0xAE // replies with the task and interrupt cpu use, see diagnostics.h
+#define CMD_PRESET_SELECT   0xAF // followed by the preset number, switches to it and replies with the configuration
+#define CMD_PRESET_SAVE     0xB0 // followed by the preset number and the name, zero padded to PRESET_NAME_LEN bytes
+#define CMD_PRESET_GET      0xB1 // followed by the preset number, replies with it, see presets.h
+#define CMD_BIAS_TABLE_LOAD  0xB2 // followed by the first step, uint16, and BIAS_TABLE_CHUNK steps in mV, int16, zero padded
+#define CMD_BIAS_TABLE_START 0xB3 // followed by the number of steps and the pulses per step, uint16 each, and 1 to repeat
+#define CMD_BIAS_TABLE_STOP  0xB4
+#define CMD_DAC_CAL_HOLD     0xB5 // followed by the polarity and a raw DAC code, uint16, for that polarity. 0xFFFF ends it
+#define CMD_DAC_CAL_LOAD     0xB6 // followed by the polarity, the number of points and DAC_CAL_MAX_POINTS mV and code pairs, uint16 each, zero padded
+#define CMD_DAC_CAL_SAVE     0xB7 // writes the loaded calibration to flash and puts it in use
+#define CMD_DAC_CAL_GET      0xB8 // followed by the polarity, replies with its calibration, see dac_cal.h
+
+// bias table steps per CMD_BIAS_TABLE_LOAD frame
+#define BIAS_TABLE_CHUNK 16
+
+// the links the protocol can run over. Each has its own parser and transmit buffers
+typedef enum
+{
+	TRANSPORT_USB = 0,
+	TRANSPORT_UART = 1,
+	NUM_TRANSPORTS
+} SERIAL_TRANSPORT_t;
+
+void startSerial();
+
+void waitSerial();
+
 void runSerial();
 
 void sendCurrentConfiguration();
 
+void sendConfigurationAck(uint8_t seq);
+
+bool sendFrame(SERIAL_TRANSPORT_t transport, const uint8_t* data, uint32_t numBytes, bool flushNow);
+
 #endif /* INC_SERIAL_H_ */
@@ -0,0 +1,47 @@
+// telemetry.h
+
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "serial.h"
+
+#define TELEMETRY_RECORD_TYPE 0xC1
+#define MAX_TELEMETRY_RATE_HZ 1000
+
+// one binary status record. These are sent as normal escaped frames, so the
+// host can tell them apart from the 9 byte configuration frames by length
+// and the leading type byte. All fields are little endian
+typedef struct __attribute__((packed))
+{
+	uint8_t type;                 // TELEMETRY_RECORD_TYPE
+	uint8_t seq;                  // increments every record so the host can spot gaps
+	uint8_t run_state;            // TELEMETRY_STATE_ bits
+	uint8_t vcom_depth;           // bytes waiting in the USB receive queue
+	uint32_t timestamp_ms;
+	uint32_t pulses;              // pulses emitted since boot
+	uint32_t period_100ns;
+	uint32_t reconfig_max_cycles; // longest enable_output_waveform()
+	uint32_t irq_off_max_cycles;  // longest interrupts disabled window
+	uint8_t cpu_load[4];          // percent: total, main task, display task, serial task
+	uint16_t reconfig_count;
+	uint16_t dropped;             // frames that did not fit in the transmit buffers
+	uint32_t trigger_last_cycles; // USB interrupt to output start for the last CMD_TRIGGER
+	int16_t out4_sense_mV;        // output 4 bias read back by the ADC, if TELEMETRY_STATE_SENSE
+	int16_t out4_trim;            // DAC codes the readback loop has moved the bias by
+} TELEMETRY_RECORD_t;
+
+#define TELEMETRY_STATE_RUNNING 0x01
+#define TELEMETRY_STATE_SHORT   0x02
+#define TELEMETRY_STATE_5V      0x04
+#define TELEMETRY_STATE_SINGLE  0x08
+#define TELEMETRY_STATE_ARMED   0x10
+#define TELEMETRY_STATE_TABLE   0x20 // a bias table is running
+#define TELEMETRY_STATE_SENSE   0x40 // out4_sense_mV is a reading of the bias on the output now
+
+void set_telemetry_rate(uint16_t rate_hz, SERIAL_TRANSPORT_t transport);
+void run_telemetry(void);
+
+#endif // TELEMETRY_H
@@ -0,0 +1,92 @@
+// trace.h
+
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include "main.h"
+
+// points in the firmware that get their latency measured with the DWT
+// cycle counter. These are reported over USB in the telemetry stream
+typedef enum
+{
+	TRACE_RECONFIG = 0,  // full run of enable_output_waveform()
+	TRACE_IRQ_OFF = 1,   // window where interrupts are disabled to start the timers
+	TRACE_TRIGGER = 2,   // USB interrupt entry to tim8 start for a CMD_TRIGGER frame
+	NUM_TRACE_POINTS
+} TRACE_POINT_t;
+
+typedef struct
+{
+	uint32_t count;
+	uint32_t last_cycles;
+	uint32_t max_cycles;
+} TRACE_STAT_t;
+
+// interrupt handlers that have their run time added up. Grouped by what
+// they serve rather than by vector
+typedef enum
+{
+	ISR_USB = 0,
+	ISR_OUTPUT_DMA = 1,  // the waveform DMA streams on TIM2 and TIM5 and the bias table stream
+	ISR_UART = 2,        // UART4 and its receive DMA
+	ISR_ENCODER = 3,
+	ISR_TICK = 4,        // the HAL timebase on TIM6
+	ISR_NEOPIXEL = 5,
+	NUM_ISR_SOURCES
+} TRACE_ISR_t;
+
+typedef struct
+{
+	uint32_t count;
+	uint32_t cycles;     // total, wraps after about 20 seconds of solid interrupts
+	uint32_t max_cycles; // longest single run since boot
+} TRACE_ISR_STAT_t;
+
+// points in the boot, stamped once in microseconds since reset. The cycle
+// counter is started by the reset handler, before the clocks are set up
+typedef enum
+{
+	BOOT_CLOCKS = 0,     // SystemClock_Config() done, up to here at the HSI speed
+	BOOT_FIRST_EDGE = 1, // the outputs were first started, from the saved configuration or by the user
+	BOOT_DISPLAY = 2,    // the OLED is initialized
+	BOOT_USB = 3,        // the USB device stack is running
+	NUM_BOOT_STEPS
+} BOOT_STEP_t;
+
+// context switches are counted per FreeRTOS task number, anything past the
+// end of the array shares the last slot
+#define MAX_TRACED_TASKS 8
+
+extern volatile TRACE_STAT_t trace_stats[NUM_TRACE_POINTS];
+extern volatile TRACE_ISR_STAT_t isr_stats[NUM_ISR_SOURCES];
+extern volatile uint32_t task_switches[MAX_TRACED_TASKS];
+extern volatile uint32_t usb_irq_cycles;
+extern volatile uint32_t boot_us[NUM_BOOT_STEPS];
+
+void trace_init(void);
+void trace_record(TRACE_POINT_t point, uint32_t start_cycles);
+void trace_task_switched_in(uint32_t task_number);
+void trace_boot_step(BOOT_STEP_t step);
+
+// trace_now
+//  current value of the free running cycle counter (SYSCLK)
+static inline uint32_t trace_now(void)
+{
+	return DWT->CYCCNT;
+}
+
+// trace_isr_exit
+//  called at the end of an interrupt handler with the cycle count from its
+//  entry. The traced interrupts share one priority and can not nest, except
+//  the tick which is lowest and can include a nested one
+static inline void trace_isr_exit(TRACE_ISR_t source, uint32_t start_cycles)
+{
+	uint32_t cycles = trace_now() - start_cycles;
+	isr_stats[source].cycles += cycles;
+	isr_stats[source].count++;
+	if (cycles > isr_stats[source].max_cycles) isr_stats[source].max_cycles = cycles;
+}
+
+#endif // TRACE_H
@@ -0,0 +1,20 @@
+/*
+ * uart_serial.h
+ *
+ *  Second transport for the serial protocol on UART4. Reception is a
+ *  circular DMA with idle line detection so frames are picked up as soon
+ *  as the line goes quiet
+ */
+
+#ifndef INC_UART_SERIAL_H_
+#define INC_UART_SERIAL_H_
+
+#include <stdint.h>
+
+void uartSerialStart();
+
+uint32_t uartSerialRead(uint8_t* data, uint32_t maxBytes);
+
+uint8_t uartSerialTransmit(uint8_t* data, uint16_t numBytes);
+
+#endif /* INC_UART_SERIAL_H_ */
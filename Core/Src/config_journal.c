@@ -0,0 +1,276 @@
+// config_journal.c
+//  keeps data in flash across resets, the last configuration so the outputs
+//  can be put back the way they were straight after a reset, the preset
+//  bank and the output 4 calibration. Records are appended to one of two
+//  sectors and a record only counts once its check word is written, so a
+//  save cut short by a power loss leaves the one before it in place. A
+//  sector is only erased once the newest record is in the other one
+
+#include "config_journal.h"
+#include <string.h>
+
+#define JOURNAL_EMPTY 0xFFFFFFFFUL
+
+// every journal that has been scanned, so the spares can be erased without
+// each owner having to ask
+static JOURNAL_t* scanned_journals = NULL;
+
+// record_size
+static uint32_t record_size(const JOURNAL_t* journal)
+{
+	return JOURNAL_RECORD_SIZE(journal->data_size);
+}
+
+// num_records
+//  in each sector
+static uint32_t num_records(const JOURNAL_t* journal)
+{
+	return journal->size / record_size(journal);
+}
+
+// half_start
+static uint32_t half_start(const JOURNAL_t* journal, uint8_t half)
+{
+	return journal->start + half * journal->size;
+}
+
+// record_address
+static const uint32_t* record_address(const JOURNAL_t* journal, uint8_t half, uint32_t index)
+{
+	return (const uint32_t*)(half_start(journal, half) + index * record_size(journal));
+}
+
+// record_check
+//  FNV-1a over the sequence and the data
+static uint32_t record_check(uint32_t sequence, const uint8_t* data, uint32_t data_size)
+{
+	uint32_t hash = 2166136261UL;
+	for (uint8_t b = 0; b < sizeof(sequence); b++)
+	{
+		hash = (hash ^ ((sequence >> (8 * b)) & 0xFF)) * 16777619UL;
+	}
+	for (uint32_t b = 0; b < data_size; b++)
+	{
+		hash = (hash ^ data[b]) * 16777619UL;
+	}
+	return hash;
+}
+
+// record_erased
+//  true if no word of the record has been programmed
+static bool record_erased(const JOURNAL_t* journal, uint8_t half, uint32_t index)
+{
+	const uint32_t* words = record_address(journal, half, index);
+	for (uint32_t w = 0; w < record_size(journal) / sizeof(uint32_t); w++)
+	{
+		if (words[w] != JOURNAL_EMPTY) return false;
+	}
+	return true;
+}
+
+// record_valid
+static bool record_valid(const JOURNAL_t* journal, uint8_t half, uint32_t index)
+{
+	const uint32_t* words = record_address(journal, half, index);
+	uint32_t check = words[1 + journal->data_size / sizeof(uint32_t)];
+	return words[0] != JOURNAL_EMPTY &&
+	       check == record_check(words[0], (const uint8_t*)(words + 1), journal->data_size);
+}
+
+// scan_half
+//  records are only ever written in order, so the used ones are all at the
+//  start of the sector and the first empty one can be found by bisection.
+//  A torn record counts as used, it can not be programmed again. Returns
+//  the number of used records and the newest good one, NULL if none
+static uint32_t scan_half(const JOURNAL_t* journal, uint8_t half, const uint32_t** newest)
+{
+	uint32_t low = 0;
+	uint32_t high = num_records(journal);
+	while (low < high)
+	{
+		uint32_t mid = low + (high - low) / 2;
+		if (record_erased(journal, half, mid)) high = mid;
+		else low = mid + 1;
+	}
+
+	*newest = NULL;
+	for (uint32_t r = low; r > 0; r--)
+	{
+		if (record_valid(journal, half, r - 1))
+		{
+			*newest = record_address(journal, half, r - 1);
+			break;
+		}
+	}
+	return low;
+}
+
+// scan_journal
+//  saves carry on in the sector with the newest good record. The other one
+//  was full before it, or is partly written if a power loss cut the first
+//  record of a new sector short, and either way only old records are lost
+//  when it is erased
+static void scan_journal(JOURNAL_t* journal)
+{
+	const uint32_t* newest[2];
+	uint32_t used[2];
+	used[0] = scan_half(journal, 0, &newest[0]);
+	used[1] = scan_half(journal, 1, &newest[1]);
+
+	uint8_t half;
+	if (newest[0] != NULL && newest[1] != NULL) half = newest[1][0] > newest[0][0];
+	else if (newest[0] != NULL) half = 0;
+	else if (newest[1] != NULL) half = 1;
+	else half = used[1] < used[0];
+
+	journal->half = half;
+	journal->next_record = used[half];
+	journal->next_sequence = newest[half] != NULL ? newest[half][0] + 1 : 0;
+	journal->last_data = newest[half] != NULL ? (const uint8_t*)(newest[half] + 1) : NULL;
+
+	// an erase cut short can leave the first record blank and words
+	// programmed further on, so only a full check says it is erased
+	journal->spare_state = used[!half] > 0 ? SPARE_DIRTY : SPARE_UNKNOWN;
+
+	journal->scanned = true;
+	journal->next_journal = scanned_journals;
+	scanned_journals = journal;
+}
+
+// check_spare
+//  reads through the whole spare sector to see if it is still erased
+static void check_spare(JOURNAL_t* journal)
+{
+	const uint32_t* words = (const uint32_t*)half_start(journal, !journal->half);
+	for (uint32_t w = 0; w < journal->size / sizeof(uint32_t); w++)
+	{
+		if (words[w] != JOURNAL_EMPTY)
+		{
+			journal->spare_state = SPARE_DIRTY;
+			return;
+		}
+	}
+	journal->spare_state = SPARE_ERASED;
+}
+
+// journal_latest
+//  the newest good record, read straight from flash, or NULL if there is
+//  none. Stays valid until the next save
+const void* journal_latest(JOURNAL_t* journal)
+{
+	if (!journal->scanned) scan_journal(journal);
+	return journal->last_data;
+}
+
+// journal_load
+//  copies the newest good record into data. Returns false if there is none,
+//  data is left alone in that case
+bool journal_load(JOURNAL_t* journal, void* data)
+{
+	const void* latest = journal_latest(journal);
+	if (latest == NULL) return false;
+
+	memcpy(data, latest, journal->data_size);
+	return true;
+}
+
+// journal_save
+//  appends data if it differs from the newest record. When the sector is
+//  full the record goes at the start of the spare one, which the old sector
+//  becomes. This never erases, so it returns false if the sector is full and
+//  journal_erase_spares() has not got to the spare yet
+bool journal_save(JOURNAL_t* journal, const void* data)
+{
+	const uint8_t* latest = journal_latest(journal);
+	if (latest != NULL && memcmp(latest, data, journal->data_size) == 0) return true;
+
+	bool switched = false;
+	if (journal->next_record >= num_records(journal))
+	{
+		if (journal->spare_state == SPARE_UNKNOWN) check_spare(journal);
+		if (journal->spare_state != SPARE_ERASED) return false;
+
+		journal->half = !journal->half;
+		journal->next_record = 0;
+		switched = true;
+	}
+
+	uint32_t sequence = journal->next_sequence;
+	uint32_t check = record_check(sequence, data, journal->data_size);
+	const uint32_t* data_words = (const uint32_t*)data;
+
+	// sequence first and check last, so the record is only valid once all
+	// of it is in flash
+	uint32_t address = (uint32_t)record_address(journal, journal->half, journal->next_record);
+	HAL_StatusTypeDef status = HAL_FLASH_Unlock();
+	if (status == HAL_OK) status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, address, sequence);
+	for (uint32_t w = 0; w < journal->data_size / sizeof(uint32_t) && status == HAL_OK; w++)
+	{
+		status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, address + (1 + w) * sizeof(uint32_t), data_words[w]);
+	}
+	if (status == HAL_OK)
+	{
+		status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, address + sizeof(uint32_t) + journal->data_size, check);
+	}
+	HAL_FLASH_Lock();
+
+	// flash reads go through the data cache, which works on whole 32 byte lines
+	uint32_t line = address & ~31UL;
+	SCB_InvalidateDCache_by_Addr((uint32_t*)line, address + record_size(journal) - line);
+
+	// a failed write still used the record up
+	journal->next_record++;
+	if (status != HAL_OK)
+	{
+		if (switched)
+		{
+			// the newest good record is still in the full sector, keep
+			// saving there until the torn one is erased
+			journal->half = !journal->half;
+			journal->next_record = num_records(journal);
+			journal->spare_state = SPARE_DIRTY;
+		}
+		return false;
+	}
+
+	// only now is the old sector safe to erase
+	if (switched) journal->spare_state = SPARE_DIRTY;
+	journal->next_sequence++;
+	journal->last_data = (const uint8_t*)(address + sizeof(uint32_t));
+	return true;
+}
+
+// journal_erase_spares
+//  erases the spare sector of one journal that needs it, so it is ready for
+//  when the sector in use fills up. Nothing runs from flash for the second
+//  or two this takes, interrupts included, so only call it with the outputs
+//  stopped. Returns true if it erased a sector
+bool journal_erase_spares(void)
+{
+	for (JOURNAL_t* journal = scanned_journals; journal != NULL; journal = journal->next_journal)
+	{
+		if (journal->spare_state == SPARE_UNKNOWN) check_spare(journal);
+		if (journal->spare_state != SPARE_DIRTY) continue;
+
+		uint8_t spare = !journal->half;
+		FLASH_EraseInitTypeDef erase = {
+			.TypeErase = FLASH_TYPEERASE_SECTORS,
+			.Banks = FLASH_BANK_1,
+			.Sector = journal->sector + spare,
+			.NbSectors = 1,
+			.VoltageRange = FLASH_VOLTAGE_RANGE_3
+		};
+		uint32_t sector_error;
+		HAL_StatusTypeDef status = HAL_FLASH_Unlock();
+		if (status == HAL_OK) status = HAL_FLASHEx_Erase(&erase, &sector_error);
+		HAL_FLASH_Lock();
+		SCB_InvalidateDCache_by_Addr((uint32_t*)half_start(journal, spare), journal->size);
+
+		// left dirty if it failed, so it is tried again next time
+		if (status == HAL_OK) journal->spare_state = SPARE_ERASED;
+		return true;
+	}
+	return false;
+}
+
+// End of config_journal.c
@@ -0,0 +1,205 @@
+// dac_cal.c
+//  the output 4 bias calibration. The measured points of each polarity are
+//  kept in the calibration journal and turned into a lookup table with one
+//  DAC code per mV at boot and after every save, so working out the code of
+//  a bias is one table read and never any floating point
+
+#include "dac_cal.h"
+#include "config_journal.h"
+#include <string.h>
+
+// until a unit has been calibrated, the straight line the bias was first
+// worked out with, 0 to 3.3V over the whole DAC range
+static const DAC_CAL_t nominal_cal = {
+	.tables = {
+		[DAC_CAL_NEG] = { .num_points = 2, .points = { { 0, 0 }, { 3300, DAC_CAL_MAX_CODE } } },
+		[DAC_CAL_POS] = { .num_points = 2, .points = { { 0, DAC_CAL_MAX_CODE }, { 3300, 0 } } },
+	}
+};
+
+static JOURNAL_t cal_journal = JOURNAL_INIT(DAC_CAL_JOURNAL_START, DAC_CAL_JOURNAL_SECTOR, sizeof(DAC_CAL_t));
+
+// the calibration in use, and the one the host is loading, which only takes
+// over once it is saved
+static DAC_CAL_t cal;
+static DAC_CAL_t staged_cal;
+static bool cal_stored = false;
+
+static uint16_t dac_lut[NUM_DAC_CAL_TABLES][DAC_CAL_MAX_mV + 1];
+
+// a raw code the host is measuring, DAC_CAL_HOLD_OFF if none. Set from the
+// serial task
+static volatile uint16_t hold_code[NUM_DAC_CAL_TABLES] = { DAC_CAL_HOLD_OFF, DAC_CAL_HOLD_OFF };
+
+static bool table_valid(const DAC_CAL_TABLE_t* table);
+static void build_lut(DAC_CAL_POLARITY_t polarity);
+
+// dac_cal_init
+//  loads the saved calibration, or the nominal one, and builds the lookup
+//  tables. Has to run before the outputs are first started
+void dac_cal_init(void)
+{
+	cal_stored = journal_load(&cal_journal, &cal) &&
+			     table_valid(&cal.tables[DAC_CAL_NEG]) && table_valid(&cal.tables[DAC_CAL_POS]);
+	if (!cal_stored) cal = nominal_cal;
+	staged_cal = cal;
+
+	build_lut(DAC_CAL_NEG);
+	build_lut(DAC_CAL_POS);
+}
+
+// dac_cal_code
+//  the DAC code that sets output 4 to the bias on the MOSFET for the sign.
+//  No bias is 0V on the positive MOSFET. Beyond the calibrated range the
+//  code of the last point is used
+uint16_t dac_cal_code(int32_t bias_mV, int8_t sign)
+{
+	DAC_CAL_POLARITY_t polarity = (sign < 0) ? DAC_CAL_NEG : DAC_CAL_POS;
+	if (hold_code[polarity] != DAC_CAL_HOLD_OFF) return hold_code[polarity];
+
+	if (bias_mV < 0) bias_mV = -bias_mV;
+	if (bias_mV > DAC_CAL_MAX_mV) bias_mV = DAC_CAL_MAX_mV;
+	return dac_lut[polarity][bias_mV];
+}
+
+// dac_cal_hold
+//  every bias of the polarity gets the raw code until it is called again
+//  with DAC_CAL_HOLD_OFF, so the host can measure what the code gives. It
+//  only reaches the output with the next output update
+void dac_cal_hold(uint8_t polarity, uint16_t code)
+{
+	if (polarity >= NUM_DAC_CAL_TABLES) return;
+	if (code != DAC_CAL_HOLD_OFF && code > DAC_CAL_MAX_CODE) code = DAC_CAL_MAX_CODE;
+	hold_code[polarity] = code;
+}
+
+// dac_cal_holding
+//  true while the host holds a raw code on either polarity
+bool dac_cal_holding(void)
+{
+	return hold_code[DAC_CAL_NEG] != DAC_CAL_HOLD_OFF || hold_code[DAC_CAL_POS] != DAC_CAL_HOLD_OFF;
+}
+
+// dac_cal_stage
+//  takes the points of one polarity for the next dac_cal_save(). No points
+//  goes back to the nominal calibration. Returns false, leaving the staged
+//  table alone, if the points are not in order or the codes do not all go
+//  the same way
+bool dac_cal_stage(uint8_t polarity, const DAC_CAL_POINT_t* points, uint8_t num_points)
+{
+	if (polarity >= NUM_DAC_CAL_TABLES || num_points > DAC_CAL_MAX_POINTS) return false;
+
+	DAC_CAL_TABLE_t table = {0};
+	if (num_points == 0)
+	{
+		table = nominal_cal.tables[polarity];
+	}
+	else
+	{
+		table.num_points = num_points;
+		memcpy(table.points, points, num_points * sizeof(DAC_CAL_POINT_t));
+	}
+	if (!table_valid(&table)) return false;
+
+	staged_cal.tables[polarity] = table;
+	return true;
+}
+
+// dac_cal_save
+//  writes the staged calibration to the journal and puts it in use. The
+//  outputs pick it up at their next update
+bool dac_cal_save(void)
+{
+	if (!journal_save(&cal_journal, &staged_cal)) return false;
+
+	cal = staged_cal;
+	cal_stored = true;
+	build_lut(DAC_CAL_NEG);
+	build_lut(DAC_CAL_POS);
+	return true;
+}
+
+// send_dac_cal
+//  answers CMD_DAC_CAL_GET with the calibration in use
+void send_dac_cal(SERIAL_TRANSPORT_t transport, uint8_t polarity)
+{
+	DAC_CAL_RECORD_t record = {0};
+	if (polarity >= NUM_DAC_CAL_TABLES) return;
+
+	const DAC_CAL_TABLE_t* table = &cal.tables[polarity];
+	record.type = DAC_CAL_RECORD_TYPE;
+	record.polarity = polarity;
+	record.num_points = table->num_points;
+	record.stored = cal_stored;
+	memcpy(record.points, table->points, sizeof(record.points));
+
+	sendFrame(transport, (const uint8_t*)&record, sizeof(record), true);
+}
+
+// table_valid
+//  2 or more points with the voltages going up, all of them in range, and
+//  the codes only ever going one way so every voltage has one code
+static bool table_valid(const DAC_CAL_TABLE_t* table)
+{
+	uint16_t n = table->num_points;
+	if (n < 2 || n > DAC_CAL_MAX_POINTS) return false;
+
+	const DAC_CAL_POINT_t* p = table->points;
+	bool rising = p[n - 1].code >= p[0].code;
+	for (uint16_t i = 0; i < n; i++)
+	{
+		if (p[i].mV > DAC_CAL_MAX_mV || p[i].code > DAC_CAL_MAX_CODE) return false;
+		if (i == 0) continue;
+		if (p[i].mV <= p[i - 1].mV) return false;
+		if (rising ? (p[i].code < p[i - 1].code) : (p[i].code > p[i - 1].code)) return false;
+	}
+	return true;
+}
+
+// build_lut
+//  interpolates the points of the polarity into its lookup table. Each
+//  segment has its slope worked out once in Q16, codes per mV, so the table
+//  is built with one multiply per entry
+static void build_lut(DAC_CAL_POLARITY_t polarity)
+{
+	const DAC_CAL_TABLE_t* table = &cal.tables[polarity];
+	const DAC_CAL_POINT_t* p = table->points;
+	uint16_t* lut = dac_lut[polarity];
+	uint16_t last = table->num_points - 1;
+	uint16_t seg = 0;
+	int32_t slope_q16 = 0;
+	bool slope_valid = false;
+
+	for (uint32_t mV = 0; mV <= DAC_CAL_MAX_mV; mV++)
+	{
+		if (mV <= p[0].mV)
+		{
+			lut[mV] = p[0].code;
+			continue;
+		}
+		if (mV >= p[last].mV)
+		{
+			lut[mV] = p[last].code;
+			continue;
+		}
+
+		while (mV > p[seg + 1].mV)
+		{
+			seg++;
+			slope_valid = false;
+		}
+		if (!slope_valid)
+		{
+			// the segment is at most DAC_CAL_MAX_CODE codes, so the slope
+			// times any mV in it stays within 28 bits
+			slope_q16 = ((int32_t)(p[seg + 1].code - p[seg].code) * 65536) / (p[seg + 1].mV - p[seg].mV);
+			slope_valid = true;
+		}
+		int32_t code = p[seg].code + ((slope_q16 * (int32_t)(mV - p[seg].mV) + 32768) >> 16);
+		if (code < 0) code = 0;
+		if (code > DAC_CAL_MAX_CODE) code = DAC_CAL_MAX_CODE;
+		lut[mV] = code;
+	}
+}
+
+// End of dac_cal.c
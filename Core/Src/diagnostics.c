@@ -0,0 +1,153 @@
+// diagnostics.c
+//  works out how the CPU time is split between the tasks and the interrupts
+//  from the FreeRTOS run time stats (counted in DWT cycles) and the interrupt
+//  times in trace.c. Updated from the serial task, read by the telemetry,
+//  the CMD_DIAGNOSTICS reply and the diagnostics page on the display
+
+#include "diagnostics.h"
+#include "relays.h"
+#include <string.h>
+
+static DIAGNOSTICS_t diagnostics = {0};
+
+// counters at the start of the current window
+static uint32_t last_total_time = 0;
+static uint32_t last_isr_cycles[NUM_ISR_SOURCES] = {0};
+static uint32_t last_isr_counts[NUM_ISR_SOURCES] = {0};
+static uint32_t last_task_time[MAX_DIAG_TASKS] = {0};
+static TaskHandle_t last_task_handle[MAX_DIAG_TASKS] = {0};
+static uint32_t last_update_tick = 0;
+
+// update_diagnostics
+//  called every pass of the serial task, only does the work once per window
+void update_diagnostics(void)
+{
+	TaskStatus_t status[MAX_DIAG_TASKS];
+	uint32_t total_time;
+
+	if (xTaskGetTickCount() - last_update_tick < DIAG_WINDOW_ms) return;
+	last_update_tick = xTaskGetTickCount();
+
+	UBaseType_t num_tasks = uxTaskGetSystemState(status, MAX_DIAG_TASKS, &total_time);
+	uint32_t window = total_time - last_total_time;
+	last_total_time = total_time;
+	if (window == 0) return;
+
+	uint32_t idle_permille = 0;
+	for (UBaseType_t t = 0; t < num_tasks; t++)
+	{
+		DIAG_TASK_t* task = diagnostics.tasks + t;
+
+		// the order from uxTaskGetSystemState can change, so the last run time
+		// only counts if it belonged to the same task
+		uint32_t task_time = 0;
+		for (UBaseType_t l = 0; l < MAX_DIAG_TASKS; l++)
+		{
+			if (last_task_handle[l] == status[t].xHandle)
+			{
+				task_time = status[t].ulRunTimeCounter - last_task_time[l];
+				break;
+			}
+		}
+
+		task->handle = status[t].xHandle;
+		strncpy(task->name, status[t].pcTaskName, DIAG_NAME_LEN);
+		task->cpu_permille = ((uint64_t)task_time * 1000) / window;
+		task->stack_free_words = status[t].usStackHighWaterMark;
+		task->switches = task_switches[(status[t].xTaskNumber < MAX_TRACED_TASKS) ?
+		                               status[t].xTaskNumber : MAX_TRACED_TASKS - 1];
+
+		if (status[t].xHandle == xTaskGetIdleTaskHandle()) idle_permille = task->cpu_permille;
+	}
+	for (UBaseType_t t = 0; t < MAX_DIAG_TASKS; t++)
+	{
+		last_task_handle[t] = (t < num_tasks) ? status[t].xHandle : NULL;
+		last_task_time[t] = (t < num_tasks) ? status[t].ulRunTimeCounter : 0;
+	}
+	diagnostics.num_tasks = num_tasks;
+	diagnostics.cpu_permille = (idle_permille > 1000) ? 0 : 1000 - idle_permille;
+
+	// interrupt time is already inside the task times above, this shows how
+	// much of it was spent in the handlers
+	for (uint8_t i = 0; i < NUM_ISR_SOURCES; i++)
+	{
+		uint32_t cycles = isr_stats[i].cycles;
+		uint32_t count = isr_stats[i].count;
+		diagnostics.isr_permille[i] = ((uint64_t)(cycles - last_isr_cycles[i]) * 1000) / window;
+		diagnostics.isr_counts[i] = count;
+		if (count != last_isr_counts[i])
+		{
+			diagnostics.isr_mean_cycles[i] = (cycles - last_isr_cycles[i]) / (count - last_isr_counts[i]);
+		}
+		diagnostics.isr_max_cycles[i] = isr_stats[i].max_cycles;
+		last_isr_cycles[i] = cycles;
+		last_isr_counts[i] = count;
+	}
+}
+
+// get_diagnostics
+//  the numbers from the last full window
+const DIAGNOSTICS_t* get_diagnostics(void)
+{
+	return &diagnostics;
+}
+
+// get_task_cpu_percent
+//  cpu use of one task over the last window, 0 if it is not known
+uint8_t get_task_cpu_percent(TaskHandle_t handle)
+{
+	for (uint8_t t = 0; t < diagnostics.num_tasks; t++)
+	{
+		if (diagnostics.tasks[t].handle == handle) return diagnostics.tasks[t].cpu_permille / 10;
+	}
+	return 0;
+}
+
+// send_diagnostics
+//  answers CMD_DIAGNOSTICS on the transport that asked
+void send_diagnostics(SERIAL_TRANSPORT_t transport)
+{
+	uint8_t record[sizeof(DIAG_RECORD_HEADER_t) + MAX_DIAG_TASKS * sizeof(DIAG_RECORD_TASK_t) +
+	               NUM_ISR_SOURCES * sizeof(DIAG_RECORD_ISR_t) + NUM_BOOT_STEPS * sizeof(DIAG_RECORD_BOOT_t)];
+	DIAG_RECORD_HEADER_t* header = (DIAG_RECORD_HEADER_t*)record;
+	uint32_t len = sizeof(DIAG_RECORD_HEADER_t);
+
+	header->type = DIAGNOSTICS_RECORD_TYPE;
+	header->num_tasks = diagnostics.num_tasks;
+	header->num_isrs = NUM_ISR_SOURCES;
+	header->window_10ms = DIAG_WINDOW_ms / 10;
+	header->cpu_permille = diagnostics.cpu_permille;
+	header->num_boot_steps = NUM_BOOT_STEPS;
+	header->relay_ops = get_relay_ops();
+
+	for (uint8_t t = 0; t < diagnostics.num_tasks; t++)
+	{
+		DIAG_RECORD_TASK_t* entry = (DIAG_RECORD_TASK_t*)(record + len);
+		memcpy(entry->name, diagnostics.tasks[t].name, DIAG_NAME_LEN);
+		entry->cpu_permille = diagnostics.tasks[t].cpu_permille;
+		entry->stack_free_words = diagnostics.tasks[t].stack_free_words;
+		entry->switches = diagnostics.tasks[t].switches;
+		len += sizeof(DIAG_RECORD_TASK_t);
+	}
+
+	for (uint8_t i = 0; i < NUM_ISR_SOURCES; i++)
+	{
+		DIAG_RECORD_ISR_t* entry = (DIAG_RECORD_ISR_t*)(record + len);
+		entry->cpu_permille = diagnostics.isr_permille[i];
+		entry->count = diagnostics.isr_counts[i];
+		entry->mean_cycles = diagnostics.isr_mean_cycles[i];
+		entry->max_cycles = diagnostics.isr_max_cycles[i];
+		len += sizeof(DIAG_RECORD_ISR_t);
+	}
+
+	for (uint8_t b = 0; b < NUM_BOOT_STEPS; b++)
+	{
+		DIAG_RECORD_BOOT_t* entry = (DIAG_RECORD_BOOT_t*)(record + len);
+		entry->us = boot_us[b];
+		len += sizeof(DIAG_RECORD_BOOT_t);
+	}
+
+	sendFrame(transport, record, len, true);
+}
+
+// End of diagnostics.c
@@ -6,21 +6,26 @@
 #include "ssd1306.h"
 #include "cmsis_os.h"
 #include "main_task.h"
+#include "diagnostics.h"
 #include "string.h"
 #include "stdio.h"
 
-#define MAX_STR_LEN 256
 #define CHARS_IN_ROW 18
+#define MAX_STR_LEN (CHARS_IN_ROW + 2)
 #define FONT_HEIGHT 10
 #define FONT_WIDTH
+#define ROW_HEIGHT 12
+#define ROWS_ON_SCREEN 5
 
 extern bool running;
 extern SETTING_t settings[NUM_SETTINGS];
 extern uint8_t selected_setting;
 extern bool selected;
 extern bool pending_change;
+extern bool show_diagnostics;
 
-static void display_setting(SETTING_t* setting, bool on_setting, bool selected);
+static void display_setting(const SETTING_t* setting, bool on_setting, bool selected);
+static void display_diagnostics(void);
 
 void display_task(void)
 {
@@ -28,32 +33,53 @@ void display_task(void)
 	SSD1306_Init();
 	SSD1306_InvertDisplay(false);
 	SSD1306_Clear();
+	trace_boot_step(BOOT_DISPLAY);
+	bool showing_diagnostics = false;
+	uint8_t first_row = 0;
 	while(1)
 	{
-		// NOTE: these are designed to only write over the same parts of the screen
-		// so we dont need to constantly clear the screen
-		// display the different settings
-		SSD1306_GotoXY(0, 0);
-		display_setting(settings, (selected_setting == 0), selected);
-
-		SSD1306_GotoXY(0, 12);
-		display_setting(settings+1, (selected_setting == 1), selected);
+		// the pages do not line up, so clear the screen when switching
+		if (show_diagnostics != showing_diagnostics)
+		{
+			showing_diagnostics = show_diagnostics;
+			SSD1306_Fill(SSD1306_COLOR_BLACK);
+		}
 
-		SSD1306_GotoXY(0, 24);
-		display_setting(settings+2, (selected_setting == 2), selected);
+		if (showing_diagnostics)
+		{
+			display_diagnostics();
+			SSD1306_UpdateScreen();
+			osDelay(1);
+			continue;
+		}
 
-		SSD1306_GotoXY(0, 36);
-		display_setting(settings+3, (selected_setting == 3), selected);
+		// there are more settings than rows, scroll so the one the user is
+		// on is always shown. The rows do not line up after a scroll so the
+		// screen is cleared then
+		uint8_t first = first_row;
+		if (selected_setting < first) first = selected_setting;
+		if (selected_setting >= first + ROWS_ON_SCREEN) first = selected_setting - ROWS_ON_SCREEN + 1;
+		if (first != first_row)
+		{
+			first_row = first;
+			SSD1306_Fill(SSD1306_COLOR_BLACK);
+		}
 
-		SSD1306_GotoXY(0, 48);
-		display_setting(settings+4, (selected_setting == 4), selected);
+		// NOTE: these are designed to only write over the same parts of the screen
+		// so we dont need to constantly clear the screen
+		// display the different settings
+		for (uint8_t row = 0; row < ROWS_ON_SCREEN && first_row + row < NUM_SETTINGS; row++)
+		{
+			SSD1306_GotoXY(0, ROW_HEIGHT * row);
+			display_setting(settings + first_row + row, (selected_setting == first_row + row), selected);
+		}
 
 		SSD1306_UpdateScreen();
 		osDelay(1);
 	}
 }
 
-static void display_setting(SETTING_t* setting, bool on_setting, bool selected)
+static void display_setting(const SETTING_t* setting, bool on_setting, bool selected)
 {
 	char str[MAX_STR_LEN];
 	char* temp_char;
@@ -61,18 +87,20 @@ static void display_setting(SETTING_t* setting, bool on_setting, bool selected)
 	uint8_t num_spaces;
 	uint16_t saved_x1;
 	uint16_t saved_x2;
-	strncpy(str, setting->name, MAX_SETTING_NAME_SIZE);
+	const SETTING_INFO_t* info = setting->info;
+	strncpy(str, info->name, sizeof(str) - 1);
+	str[sizeof(str) - 1] = '\0';
 	SSD1306_Puts(str, &Font_7x10, !(on_setting && !selected));
 	SSD1306_Putc(':', &Font_7x10, 1);
 
-	switch(setting->type)
+	switch(info->type)
 	{
 	case CONTINUOUS:
 		// put the correct number of spaces to make the value right justified
 		num_spaces = CHARS_IN_ROW;
-		num_spaces -= strnlen(setting->name, MAX_SETTING_NAME_SIZE);
-		num_spaces -= setting->num_digits + 2;
-		num_spaces -= (setting->decimal_loc != 0);
+		num_spaces -= strnlen(info->name, MAX_SETTING_NAME_SIZE);
+		num_spaces -= info->num_digits + 2;
+		num_spaces -= (info->decimal_loc != 0);
 		for (int8_t c = 0; c < num_spaces; c++)
 		{
 			SSD1306_Putc(' ', &Font_7x10, 1);
@@ -82,21 +110,21 @@ static void display_setting(SETTING_t* setting, bool on_setting, bool selected)
 		// the entire screen
 		if (setting->cont_value < 0)
 		{
-			sprintf(str, "%0*ld", setting->num_digits + 1, setting->cont_value);
+			snprintf(str, sizeof(str), "%0*ld", info->num_digits + 1, setting->cont_value);
 		}
 		else
 		{
-			sprintf(str, " %0*ld", setting->num_digits, setting->cont_value);
+			snprintf(str, sizeof(str), " %0*ld", info->num_digits, setting->cont_value);
 		}
 		temp_char = str;
-		counter = setting->num_digits; // extra because there is a space or negative in front
+		counter = info->num_digits; // extra because there is a space or negative in front
 		while (*temp_char != '\0')
 		{
 			// if this is the selected one make it a different color
 			SSD1306_Putc(*temp_char, &Font_7x10, !(on_setting && selected && counter == setting->current_digit));
 
 			// if the decimal goes here put it here
-			if (counter == setting->decimal_loc && counter != 0)
+			if (counter == info->decimal_loc && counter != 0)
 			{
 				SSD1306_Putc('.', &Font_7x10, 1);
 			}
@@ -109,9 +137,9 @@ static void display_setting(SETTING_t* setting, bool on_setting, bool selected)
 	case TOGGLE:
 		// put the correct number of spaces to make the value right justified
 		num_spaces = CHARS_IN_ROW;
-	    num_spaces -= strnlen(setting->name, MAX_SETTING_NAME_SIZE);
-	    num_spaces -= strnlen(setting->setting1_name, MAX_TOGGLE_SELECTION_SIZE);
-	    num_spaces -= strnlen(setting->setting2_name, MAX_TOGGLE_SELECTION_SIZE);
+	    num_spaces -= strnlen(info->name, MAX_SETTING_NAME_SIZE);
+	    num_spaces -= strnlen(info->setting1_name, MAX_TOGGLE_SELECTION_SIZE);
+	    num_spaces -= strnlen(info->setting2_name, MAX_TOGGLE_SELECTION_SIZE);
 	    num_spaces -= 2;
 		for (int8_t c = 0; c < num_spaces; c++)
 		{
@@ -120,16 +148,44 @@ static void display_setting(SETTING_t* setting, bool on_setting, bool selected)
 
 		// output the two setting names, also draw boxes arount the values
 		saved_x1 = SSD1306_GetX();
-		SSD1306_Puts(setting->setting1_name, &Font_7x10, !(on_setting && selected && !setting->toggle_value));
+		SSD1306_Puts((char*)info->setting1_name, &Font_7x10, !(on_setting && selected && !setting->toggle_value));
 		saved_x2 = SSD1306_GetX();
 		SSD1306_Putc(' ', &Font_7x10, 1);
 		SSD1306_DrawRectangle(saved_x1-1, SSD1306_GetY()-1, saved_x2-saved_x1+1, FONT_HEIGHT, !setting->toggle_value);
 
 		saved_x1 = SSD1306_GetX();
-		SSD1306_Puts(setting->setting2_name, &Font_7x10, !(on_setting && selected && setting->toggle_value));
+		SSD1306_Puts((char*)info->setting2_name, &Font_7x10, !(on_setting && selected && setting->toggle_value));
 		SSD1306_DrawRectangle(saved_x1-1, SSD1306_GetY()-1, SSD1306_GetX()-saved_x1+1, FONT_HEIGHT, setting->toggle_value);
 		break;
 	}
 }
 
+// display_diagnostics
+//  total and interrupt cpu use on the first line, then one line per task
+//  with its cpu use and the least free stack it has had (in words)
+static void display_diagnostics(void)
+{
+	char str[CHARS_IN_ROW + 8];
+	const DIAGNOSTICS_t* diag = get_diagnostics();
+
+	uint32_t isr_permille = 0;
+	for (uint8_t i = 0; i < NUM_ISR_SOURCES; i++) isr_permille += diag->isr_permille[i];
+
+	SSD1306_GotoXY(0, 0);
+	snprintf(str, sizeof(str), "CPU%3u.%u%% ISR%2u.%u%%",
+			 (unsigned)(diag->cpu_permille / 10), (unsigned)(diag->cpu_permille % 10),
+			 (unsigned)(isr_permille / 10), (unsigned)(isr_permille % 10));
+	SSD1306_Puts(str, &Font_7x10, 1);
+
+	for (uint8_t t = 0; t < diag->num_tasks && t < 4; t++)
+	{
+		const DIAG_TASK_t* task = diag->tasks + t;
+		SSD1306_GotoXY(0, 12 * (t + 1));
+		snprintf(str, sizeof(str), "%-6.6s%3u.%u%%%5u", task->name,
+				 (unsigned)(task->cpu_permille / 10), (unsigned)(task->cpu_permille % 10),
+				 (unsigned)task->stack_free_words);
+		SSD1306_Puts(str, &Font_7x10, 1);
+	}
+}
+
 // End of display.c
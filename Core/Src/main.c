@@ -27,6 +27,9 @@
 #include "main_task.h"
 #include "display.h"
 #include "serial.h"
+#include "trace.h"
+#include "dac_cal.h"
+#include "out4_sense.h"
 
 /* USER CODE END Includes */
 
@@ -47,6 +50,7 @@
 /* Private variables ---------------------------------------------------------*/
 
 DAC_HandleTypeDef hdac;
+DMA_HandleTypeDef hdma_dac1;
 
 I2C_HandleTypeDef hi2c1;
 
@@ -62,17 +66,19 @@ DMA_HandleTypeDef hdma_tim2_up_ch3;
 DMA_HandleTypeDef hdma_tim2_ch2_ch4;
 DMA_HandleTypeDef hdma_tim5_ch2;
 DMA_HandleTypeDef hdma_tim5_ch3_up;
+DMA_HandleTypeDef hdma_tim5_ch4_trig;
 
 UART_HandleTypeDef huart4;
+DMA_HandleTypeDef hdma_uart4_rx;
 
 osThreadId mainTaskHandle;
-uint32_t mainTaskBuffer[ 1024 ];
+uint32_t mainTaskBuffer[ 512 ];
 osStaticThreadDef_t mainTaskControlBlock;
 osThreadId displayTask_tasHandle;
-uint32_t displayTaskBuffer[ 1024 ];
+uint32_t displayTaskBuffer[ 320 ];
 osStaticThreadDef_t displayTaskControlBlock;
 osThreadId serialHandle;
-uint32_t myTask03Buffer[ 1024 ];
+uint32_t myTask03Buffer[ 512 ];
 osStaticThreadDef_t myTask03ControlBlock;
 osMessageQId vComHandle;
 uint8_t vComBuffer[ 250 * sizeof( uint8_t ) ];
@@ -83,13 +89,14 @@ osStaticMessageQDef_t vComControlBlock;
 
 /* Private function prototypes -----------------------------------------------*/
 void SystemClock_Config(void);
+static void MPU_Config(void);
 static void MX_GPIO_Init(void);
+static void MX_DMA_Init(void);
 static void MX_TIM2_Init(void);
 static void MX_SPI2_Init(void);
 static void MX_I2C1_Init(void);
 static void MX_TIM3_Init(void);
 static void MX_DAC_Init(void);
-static void MX_DMA_Init(void);
 static void MX_TIM5_Init(void);
 static void MX_TIM1_Init(void);
 static void MX_UART4_Init(void);
@@ -117,6 +124,15 @@ int main(void)
 
   /* USER CODE END 1 */
 
+  /* MPU Configuration--------------------------------------------------------*/
+  MPU_Config();
+
+  /* Enable I-Cache---------------------------------------------------------*/
+  SCB_EnableICache();
+
+  /* Enable D-Cache---------------------------------------------------------*/
+  SCB_EnableDCache();
+
   /* MCU Configuration--------------------------------------------------------*/
 
   /* Reset of all peripherals, Initializes the Flash interface and the Systick. */
@@ -130,23 +146,29 @@ int main(void)
   SystemClock_Config();
 
   /* USER CODE BEGIN SysInit */
-  MX_DMA_Init();
+  trace_boot_step(BOOT_CLOCKS);
   /* USER CODE END SysInit */
 
   /* Initialize all configured peripherals */
   MX_GPIO_Init();
+  MX_DMA_Init();
   MX_TIM2_Init();
   MX_SPI2_Init();
   MX_I2C1_Init();
   MX_TIM3_Init();
   MX_DAC_Init();
-  MX_DMA_Init();
   MX_TIM5_Init();
   MX_TIM1_Init();
   MX_UART4_Init();
   MX_TIM8_Init();
   /* USER CODE BEGIN 2 */
-
+  // put the outputs back the way they were before the reset, without
+  // waiting for the display or USB which start up in their tasks. The bias
+  // needs the calibration first, and the output 4 readback has to be
+  // ready for the first pulse
+  dac_cal_init();
+  out4_sense_init();
+  restore_outputs();
   /* USER CODE END 2 */
 
   /* USER CODE BEGIN RTOS_MUTEX */
@@ -172,15 +194,15 @@ int main(void)
 
   /* Create the thread(s) */
   /* definition and creation of mainTask */
-  osThreadStaticDef(mainTask, mainTask_entry, osPriorityNormal, 0, 1024, mainTaskBuffer, &mainTaskControlBlock);
+  osThreadStaticDef(mainTask, mainTask_entry, osPriorityNormal, 0, 512, mainTaskBuffer, &mainTaskControlBlock);
   mainTaskHandle = osThreadCreate(osThread(mainTask), NULL);
 
   /* definition and creation of displayTask_tas */
-  osThreadStaticDef(displayTask_tas, displayTask_entry, osPriorityBelowNormal, 0, 1024, displayTaskBuffer, &displayTaskControlBlock);
+  osThreadStaticDef(displayTask_tas, displayTask_entry, osPriorityBelowNormal, 0, 320, displayTaskBuffer, &displayTaskControlBlock);
   displayTask_tasHandle = osThreadCreate(osThread(displayTask_tas), NULL);
 
   /* definition and creation of serial */
-  osThreadStaticDef(serial, start_serial, osPriorityNormal, 0, 1024, myTask03Buffer, &myTask03ControlBlock);
+  osThreadStaticDef(serial, start_serial, osPriorityNormal, 0, 512, myTask03Buffer, &myTask03ControlBlock);
   serialHandle = osThreadCreate(osThread(serial), NULL);
 
   /* USER CODE BEGIN RTOS_THREADS */
@@ -283,7 +305,7 @@ static void MX_DAC_Init(void)
 
   /** DAC channel OUT1 config
   */
-  sConfig.DAC_Trigger = DAC_TRIGGER_NONE;
+  sConfig.DAC_Trigger = DAC_TRIGGER_T5_TRGO;
   sConfig.DAC_OutputBuffer = DAC_OUTPUTBUFFER_ENABLE;
   if (HAL_DAC_ConfigChannel(&hdac, &sConfig, DAC_CHANNEL_1) != HAL_OK)
   {
@@ -649,7 +671,7 @@ static void MX_TIM5_Init(void)
   {
     Error_Handler();
   }
-  sMasterConfig.MasterOutputTrigger = TIM_TRGO_ENABLE;
+  sMasterConfig.MasterOutputTrigger = TIM_TRGO_UPDATE;
   sMasterConfig.MasterSlaveMode = TIM_MASTERSLAVEMODE_ENABLE;
   if (HAL_TIMEx_MasterConfigSynchronization(&htim5, &sMasterConfig) != HAL_OK)
   {
@@ -811,9 +833,18 @@ static void MX_DMA_Init(void)
   /* DMA1_Stream1_IRQn interrupt configuration */
   HAL_NVIC_SetPriority(DMA1_Stream1_IRQn, 5, 0);
   HAL_NVIC_EnableIRQ(DMA1_Stream1_IRQn);
+  /* DMA1_Stream2_IRQn interrupt configuration */
+  HAL_NVIC_SetPriority(DMA1_Stream2_IRQn, 5, 0);
+  HAL_NVIC_EnableIRQ(DMA1_Stream2_IRQn);
+  /* DMA1_Stream3_IRQn interrupt configuration */
+  HAL_NVIC_SetPriority(DMA1_Stream3_IRQn, 5, 0);
+  HAL_NVIC_EnableIRQ(DMA1_Stream3_IRQn);
   /* DMA1_Stream4_IRQn interrupt configuration */
   HAL_NVIC_SetPriority(DMA1_Stream4_IRQn, 5, 0);
   HAL_NVIC_EnableIRQ(DMA1_Stream4_IRQn);
+  /* DMA1_Stream5_IRQn interrupt configuration */
+  HAL_NVIC_SetPriority(DMA1_Stream5_IRQn, 5, 0);
+  HAL_NVIC_EnableIRQ(DMA1_Stream5_IRQn);
   /* DMA1_Stream6_IRQn interrupt configuration */
   HAL_NVIC_SetPriority(DMA1_Stream6_IRQn, 5, 0);
   HAL_NVIC_EnableIRQ(DMA1_Stream6_IRQn);
@@ -850,6 +881,12 @@ static void MX_GPIO_Init(void)
   /*Configure GPIO pin Output Level */
   HAL_GPIO_WritePin(GPIOD, RELAY_1_Pin|RELAY_2_Pin, GPIO_PIN_RESET);
 
+  /*Configure GPIO pin : OUT4_SENSE_Pin */
+  GPIO_InitStruct.Pin = OUT4_SENSE_Pin;
+  GPIO_InitStruct.Mode = GPIO_MODE_ANALOG;
+  GPIO_InitStruct.Pull = GPIO_NOPULL;
+  HAL_GPIO_Init(OUT4_SENSE_GPIO_Port, &GPIO_InitStruct);
+
   /*Configure GPIO pin : SHDN_Pin */
   GPIO_InitStruct.Pin = SHDN_Pin;
   GPIO_InitStruct.Mode = GPIO_MODE_OUTPUT_PP;
@@ -923,6 +960,7 @@ void mainTask_entry(void const * argument)
   /* init code for USB_DEVICE */
   MX_USB_DEVICE_Init();
   /* USER CODE BEGIN 5 */
+  trace_boot_step(BOOT_USB);
   /* Infinite loop */
   for(;;)
   {
@@ -961,15 +999,45 @@ void displayTask_entry(void const * argument)
 void start_serial(void const * argument)
 {
   /* USER CODE BEGIN start_serial */
+  startSerial();
   /* Infinite loop */
   for(;;)
   {
 	  runSerial();
-    osDelay(1);
+	  waitSerial();
   }
   /* USER CODE END start_serial */
 }
 
+/* MPU Configuration */
+
+void MPU_Config(void)
+{
+  MPU_Region_InitTypeDef MPU_InitStruct = {0};
+
+  /* Disables the MPU */
+  HAL_MPU_Disable();
+
+  /** Initializes and configures the Region and the memory to be protected
+  */
+  MPU_InitStruct.Enable = MPU_REGION_ENABLE;
+  MPU_InitStruct.Number = MPU_REGION_NUMBER0;
+  MPU_InitStruct.BaseAddress = 0x2007C000;
+  MPU_InitStruct.Size = MPU_REGION_SIZE_16KB;
+  MPU_InitStruct.SubRegionDisable = 0x0;
+  MPU_InitStruct.TypeExtField = MPU_TEX_LEVEL1;
+  MPU_InitStruct.AccessPermission = MPU_REGION_FULL_ACCESS;
+  MPU_InitStruct.DisableExec = MPU_INSTRUCTION_ACCESS_DISABLE;
+  MPU_InitStruct.IsShareable = MPU_ACCESS_SHAREABLE;
+  MPU_InitStruct.IsCacheable = MPU_ACCESS_NOT_CACHEABLE;
+  MPU_InitStruct.IsBufferable = MPU_ACCESS_NOT_BUFFERABLE;
+
+  HAL_MPU_ConfigRegion(&MPU_InitStruct);
+  /* Enables the MPU */
+  HAL_MPU_Enable(MPU_PRIVILEGED_DEFAULT);
+
+}
+
 /**
   * @brief  Period elapsed callback in non blocking mode
   * @note   This function is called  when TIM6 interrupt took place, inside
@@ -987,7 +1055,9 @@ void HAL_TIM_PeriodElapsedCallback(TIM_HandleTypeDef *htim)
     HAL_IncTick();
   }
   /* USER CODE BEGIN Callback 1 */
-
+  else if (htim->Instance == TIM1) {
+    neo_period_elapsed();
+  }
   /* USER CODE END Callback 1 */
 }
 
@@ -8,6 +8,12 @@
 #include "user_input.h"
 #include "display.h"
 #include "serial.h"
+#include "config_journal.h"
+#include "relays.h"
+#include "presets.h"
+#include "dac_cal.h"
+#include "out4_sense.h"
+#include <stdio.h>
 #include <math.h>
 #include <string.h>
 
@@ -17,12 +23,59 @@
 #define GET_G(c) (((c) >> 8) & 0xFF)
 #define GET_B(c) ((c) & 0xFF)
 
+// how long the configuration has to stay the same before it is written to
+// the journal, so spinning the dial does not use up flash
+#define CONFIG_SAVE_DELAY_ms 2000
+
 // which setting the user is hovering on, and if it is selected or not
 uint8_t selected_setting = 0;
 bool selected = false;
 bool pending_change = false;
 bool pending_gui_change = false;
 
+// sequence number of the last host configuration frame that asked for an
+// echo, -1 if none is waiting
+volatile int16_t pending_ack_seq = -1;
+
+// the host asked for the outputs to be armed for a CMD_TRIGGER, and the USB
+// interrupt sets trigger_fired once it has started them
+bool trigger_armed = false;
+volatile bool trigger_fired = false;
+
+// the display shows the cpu and stack use instead of the settings. Toggled
+// with the back button while navigating the menu
+bool show_diagnostics = false;
+
+// preset to switch to or to store the current settings in, -1 if none.
+// Set by the menu, the MODE button and the host, done by the main task so
+// only it writes to the flash
+volatile int8_t pending_preset_select = -1;
+volatile int8_t pending_preset_save = -1;
+char pending_preset_name[PRESET_NAME_LEN] = {0};
+
+// a bias table from the host. The serial task loads the steps straight into
+// bias_table_mV, the main task starts and stops it. It runs until it is
+// stopped or the outputs are reconfigured
+int16_t bias_table_mV[BIAS_TABLE_MAX_STEPS] = {0};
+uint16_t bias_table_steps = 0;
+uint16_t bias_table_pulses = 1;
+bool bias_table_circular = false;
+volatile bool pending_bias_table_start = false;
+volatile bool pending_bias_table_stop = false;
+
+// the host has loaded a new output 4 calibration, the main task writes it
+// to flash and puts it on the outputs
+volatile bool pending_dac_cal_save = false;
+
+// the last preset switched to or stored, -1 if none
+static int8_t current_preset = -1;
+
+// the stored plan of the preset being switched to, used instead of working
+// the waveform out again from the settings. A copy, as a preset save in
+// between can move the bank in flash
+static OUTPUT_PLAN_t preset_plan;
+static bool preset_plan_ready = false;
+
 // pending input events that need to be serviced
 INPUTS_t pending_input_events = {0};
 
@@ -32,67 +85,138 @@ INPUTS_t pending_input_events = {0};
 #define OUT_VOLTAGE_SETTING 2
 #define BIAS_VOLTAGE_SETTING 3
 #define RUN_TYPE_SETTING 4
-SETTING_t settings[NUM_SETTINGS] =
+#define PRESET_SETTING 5
+static const SETTING_INFO_t setting_info[NUM_SETTINGS] =
 {
 		{
 				.name = "Freq (Hz)",
 				.type = CONTINUOUS,
-				.cont_value = 1000,
 				.min = 1,
 				.max = 125000,
 				.num_digits = 6,
-				.decimal_loc = 0,
-				.current_digit = 0
+				.decimal_loc = 0
 		},
 		{
 				.name = "On Time",
 				.type = TOGGLE,
-				.toggle_value = 0,
 				.setting1_name = "LnG",
 				.setting2_name = "Shrt"
 		},
 		{
 				.name = "Out V",
 				.type = TOGGLE,
-				.toggle_value = 0,
 				.setting1_name = "0.45V",
 				.setting2_name = "5.0V"
 		},
 		{
 				.name = "Bias V",
 				.type = CONTINUOUS,
-				.cont_value = 0,
-				.min = -3300,
-				.max = 3300,
+				.min = -DAC_CAL_MAX_mV,
+				.max = DAC_CAL_MAX_mV,
 				.num_digits = 4,
-				.decimal_loc = 3,
-				.current_digit = 0
+				.decimal_loc = 3
 		},
 		{
 				.name = "Running",
 				.type = TOGGLE,
-				.toggle_value = 0,
 				.setting1_name = "OFF",
 				.setting2_name = "ON"
+		},
+		{
+				.name = "Preset",
+				.type = CONTINUOUS,
+				.min = 1,
+				.max = NUM_PRESETS,
+				.num_digits = 2,
+				.decimal_loc = 0
 		}
 };
 
+SETTING_t settings[NUM_SETTINGS] =
+{
+		{ .info = &setting_info[FREQ_SETTING], .cont_value = 1000 },
+		{ .info = &setting_info[OUT_MODE_SETTING] },
+		{ .info = &setting_info[OUT_VOLTAGE_SETTING] },
+		{ .info = &setting_info[BIAS_VOLTAGE_SETTING], .cont_value = 0 },
+		{ .info = &setting_info[RUN_TYPE_SETTING] },
+		{ .info = &setting_info[PRESET_SETTING], .cont_value = 1 }
+};
+
+// what is kept in the configuration journal
+typedef struct
+{
+	int32_t freq;       // settings[FREQ_SETTING].cont_value
+	int16_t bias;       // settings[BIAS_VOLTAGE_SETTING].cont_value
+	uint8_t toggles;    // bit n is the toggle_value of setting n
+	uint8_t reserved;
+	uint32_t relay_ops; // get_relay_ops(), so the wear count survives resets
+} SAVED_CONFIG_t;
+
+static JOURNAL_t config_journal = JOURNAL_INIT(CONFIG_JOURNAL_START, CONFIG_JOURNAL_SECTOR, sizeof(SAVED_CONFIG_t));
+
+// a change has been applied but not saved yet, and when
+static bool save_pending = false;
+static uint32_t change_tick = 0;
+
 // NOTE: running will never be true in single shot mode
 bool running = false;
 uint32_t curr_period_100ns = 0;
 OUTPUT_TYPE_t curr_out_type = STANDARD;
 OUT12_VOLTAGE_t curr_out_voltage = LOW_VOLTAGE_450mV;
-float curr_bias_voltage = 0;
+int16_t curr_bias_mV = 0;
 bool curr_single = false;
 
+static void update_leds(void);
+static bool save_config(void);
+static bool select_preset(uint8_t slot);
+static void store_preset(uint8_t slot, const char* name);
+
+// restore_outputs
+//  loads the last saved configuration and starts the outputs if they were
+//  running. Called from main() before the scheduler starts so the first
+//  edge does not wait on the display or USB
+void restore_outputs(void)
+{
+	SAVED_CONFIG_t saved;
+	if (journal_load(&config_journal, &saved))
+	{
+		settings[FREQ_SETTING].cont_value = saved.freq;
+		settings[BIAS_VOLTAGE_SETTING].cont_value = saved.bias;
+		restore_relay_ops(saved.relay_ops);
+		for (uint8_t s = 0; s < NUM_SETTINGS; s++)
+		{
+			SETTING_t* setting = settings + s;
+			if (setting->info->type == TOGGLE)
+			{
+				setting->toggle_value = (saved.toggles >> s) & 1;
+			}
+			else if (setting->cont_value < setting->info->min)
+			{
+				setting->cont_value = setting->info->min;
+			}
+			else if (setting->cont_value > setting->info->max)
+			{
+				setting->cont_value = setting->info->max;
+			}
+		}
+	}
+
+	// no events, this only works out the run parameters from the settings
+	INPUTS_t no_events = {0};
+	handle_input_events(&no_events);
+
+	if (running)
+	{
+		enable_output_waveform(curr_period_100ns, curr_out_type,
+				               curr_out_voltage, curr_bias_mV,
+							   curr_single);
+	}
+}
+
 void main_task(void)
 {
-	// set the neopixel leds to off
-	set_neopixel(0, 0, 0, 0);
-	set_neopixel(1, 0, 0, 0);
-	set_neopixel(2, 0, 0, 0);
-	set_neopixel(3, 0, 0, 0);
-	send_neo_led_sequence();
+	// the outputs may already be running from the saved configuration
+	update_leds();
 
 	while(1)
 	{
@@ -107,13 +231,47 @@ void main_task(void)
 		// set all the inputs to zero as all the pending events have been serviced
 		memset(&pending_input_events, 0, sizeof(pending_input_events));
 
+		// presets asked for by the menu, the MODE button or the host
+		if (pending_preset_select >= 0)
+		{
+			if (select_preset(pending_preset_select)) pending_change = true;
+			pending_preset_select = -1;
+		}
+		if (pending_preset_save >= 0)
+		{
+			store_preset(pending_preset_save, pending_preset_name);
+			pending_preset_save = -1;
+		}
+		if (pending_dac_cal_save)
+		{
+			pending_dac_cal_save = false;
+			if (dac_cal_save()) pending_change = true;
+		}
+
+		// the outputs were already started by the USB interrupt, so only the
+		// settings and LEDs need to catch up
+		if (trigger_fired)
+		{
+			trigger_fired = false;
+			trigger_armed = false;
+			settings[RUN_TYPE_SETTING].toggle_value = 1;
+			running = true;
+			sendCurrentConfiguration();
+			update_leds();
+			save_pending = true;
+			change_tick = xTaskGetTickCount();
+		}
+
 		// if there has been a change in desired configuration, update the
 		// outputs to match that. Also change the LEDs
 		if (pending_change || pending_gui_change)
 		{
+			int16_t ack_seq = -1;
 			if (pending_gui_change)
 			{
 				pending_gui_change = false;
+				ack_seq = pending_ack_seq;
+				pending_ack_seq = -1;
 			}
 
 			if (pending_change)
@@ -123,52 +281,75 @@ void main_task(void)
 
 			if (running)
 			{
-				enable_output_waveform(curr_period_100ns, curr_out_type,
-						               curr_out_voltage, curr_bias_voltage,
-							           curr_single);
-				// set the neopixel LEDs to the correct colors based on the outputs
-				if (curr_out_voltage == LOW_VOLTAGE_450mV)
+				trigger_armed = false;
+				if (preset_plan_ready)
 				{
-					set_neopixel(0, 0, MAX_LED_BRIGHTNESS, 0);
-					set_neopixel(1, 0, MAX_LED_BRIGHTNESS, 0);
+					enable_output_plan(&preset_plan);
 				}
 				else
 				{
-					set_neopixel(0, MAX_LED_BRIGHTNESS, 0, 0);
-					set_neopixel(1, MAX_LED_BRIGHTNESS, 0, 0);
+					enable_output_waveform(curr_period_100ns, curr_out_type,
+							               curr_out_voltage, curr_bias_mV,
+								           curr_single);
 				}
-
-				// set the last output based on the bias voltage
-				if (curr_bias_voltage > 0)
+			}
+			else if (trigger_armed)
+			{
+				// keep the outputs armed with the latest settings
+				if (preset_plan_ready)
 				{
-					// orange for positive
-					uint8_t set_value = MAX_LED_BRIGHTNESS*(curr_bias_voltage / 5.0);
-					set_neopixel(3, set_value, set_value, 0);
+					arm_output_plan(&preset_plan);
 				}
 				else
 				{
-					// purple for negative
-					uint8_t set_value = MAX_LED_BRIGHTNESS*(-1*curr_bias_voltage / 5.0);
-					set_neopixel(3, set_value, 0, set_value);
+					arm_output_waveform(curr_period_100ns, curr_out_type,
+							            curr_out_voltage, curr_bias_mV,
+										curr_single);
 				}
-
-				// for single shot, show that the output is no longer on once
-				// the current cycle is complete
-				// TODO
-
-				set_neopixel(2, MAX_LED_BRIGHTNESS, 0, 0);
-				send_neo_led_sequence();
 			}
 			else
 			{
-				// no longer enabled, turn off all the LEDs
 				disable_all_outputs();
-				set_neopixel(0, 0, 0, 0);
-				set_neopixel(1, 0, 0, 0);
-				set_neopixel(2, 0, 0, 0);
-				set_neopixel(3, 0, 0, 0);
-				send_neo_led_sequence();
 			}
+			preset_plan_ready = false;
+			update_leds();
+
+			// tell the host its change is now on the outputs
+			if (ack_seq >= 0)
+			{
+				sendConfigurationAck((uint8_t)ack_seq);
+			}
+
+			save_pending = true;
+			change_tick = xTaskGetTickCount();
+		}
+
+		if (pending_bias_table_stop)
+		{
+			pending_bias_table_stop = false;
+			stop_bias_table();
+		}
+		if (pending_bias_table_start)
+		{
+			pending_bias_table_start = false;
+			start_bias_table(bias_table_mV, bias_table_steps, bias_table_pulses, bias_table_circular);
+		}
+
+		// after any change above, so the readback sees the bias it is on now
+		run_out4_sense();
+
+		if (save_pending && xTaskGetTickCount() - change_tick >= CONFIG_SAVE_DELAY_ms)
+		{
+			// tried again later if the journal is waiting on an erase
+			save_pending = !save_config();
+			change_tick = xTaskGetTickCount();
+		}
+
+		// flash erases stall everything running from flash, so the journals
+		// only get their spare sectors ready while nothing is being output
+		if (!running && !trigger_armed)
+		{
+			journal_erase_spares();
 		}
 
 		osDelay(10);
@@ -176,6 +357,132 @@ void main_task(void)
 }
 
 
+// update_leds
+//  sets the neopixel LEDs to match the current output state
+static void update_leds(void)
+{
+	if (!running)
+	{
+		// not enabled, turn off all the LEDs
+		set_neopixel(0, 0, 0, 0);
+		set_neopixel(1, 0, 0, 0);
+		set_neopixel(2, 0, 0, 0);
+		set_neopixel(3, 0, 0, 0);
+		send_neo_led_sequence();
+		return;
+	}
+
+	// set the neopixel LEDs to the correct colors based on the outputs
+	if (curr_out_voltage == LOW_VOLTAGE_450mV)
+	{
+		set_neopixel(0, 0, MAX_LED_BRIGHTNESS, 0);
+		set_neopixel(1, 0, MAX_LED_BRIGHTNESS, 0);
+	}
+	else
+	{
+		set_neopixel(0, MAX_LED_BRIGHTNESS, 0, 0);
+		set_neopixel(1, MAX_LED_BRIGHTNESS, 0, 0);
+	}
+
+	// set the last output based on the bias voltage, full brightness at
+	// either end of the setting
+	int32_t max_bias_mV = setting_info[BIAS_VOLTAGE_SETTING].max;
+	if (curr_bias_mV > 0)
+	{
+		// orange for positive
+		uint8_t set_value = MAX_LED_BRIGHTNESS * curr_bias_mV / max_bias_mV;
+		set_neopixel(3, set_value, set_value, 0);
+	}
+	else
+	{
+		// purple for negative
+		uint8_t set_value = MAX_LED_BRIGHTNESS * -curr_bias_mV / max_bias_mV;
+		set_neopixel(3, set_value, 0, set_value);
+	}
+
+	// for single shot, show that the output is no longer on once
+	// the current cycle is complete
+	// TODO
+
+	set_neopixel(2, MAX_LED_BRIGHTNESS, 0, 0);
+	send_neo_led_sequence();
+}
+
+// save_config
+//  writes the settings to the journal, which skips it if nothing changed
+//  since the last save. Returns false if it could not be written
+static bool save_config(void)
+{
+	SAVED_CONFIG_t saved = {
+		.freq = settings[FREQ_SETTING].cont_value,
+		.bias = settings[BIAS_VOLTAGE_SETTING].cont_value,
+		.toggles = 0,
+		.reserved = 0,
+		.relay_ops = get_relay_ops()
+	};
+	for (uint8_t s = 0; s < NUM_SETTINGS; s++)
+	{
+		if (settings[s].info->type == TOGGLE && settings[s].toggle_value)
+		{
+			saved.toggles |= 1 << s;
+		}
+	}
+	return journal_save(&config_journal, &saved);
+}
+
+// select_preset
+//  copies a stored preset into the settings and picks up its plan for the
+//  next output update. The running setting is left as it is. Returns false
+//  if the slot is empty
+static bool select_preset(uint8_t slot)
+{
+	const PRESET_t* preset = get_preset(slot);
+	if (preset == NULL) return false;
+
+	settings[FREQ_SETTING].cont_value = preset->freq;
+	settings[BIAS_VOLTAGE_SETTING].cont_value = preset->bias;
+	settings[OUT_MODE_SETTING].toggle_value = preset->out_mode;
+	settings[OUT_VOLTAGE_SETTING].toggle_value = preset->out_voltage;
+	settings[PRESET_SETTING].cont_value = slot + 1;
+	current_preset = slot;
+
+	INPUTS_t no_events = {0};
+	handle_input_events(&no_events);
+
+	// none if it was stored by older firmware, the settings are used then
+	const OUTPUT_PLAN_t* plan = get_preset_plan(slot);
+	preset_plan_ready = plan != NULL;
+	if (preset_plan_ready) memcpy(&preset_plan, plan, sizeof(preset_plan));
+	return true;
+}
+
+// store_preset
+//  saves the current settings in a slot. Without a name it is called after
+//  its number
+static void store_preset(uint8_t slot, const char* name)
+{
+	PRESET_t preset = {
+		.freq = settings[FREQ_SETTING].cont_value,
+		.bias = settings[BIAS_VOLTAGE_SETTING].cont_value,
+		.out_mode = settings[OUT_MODE_SETTING].toggle_value,
+		.out_voltage = settings[OUT_VOLTAGE_SETTING].toggle_value
+	};
+	if (name != NULL && name[0] != '\0')
+	{
+		strncpy(preset.name, name, PRESET_NAME_LEN);
+	}
+	else
+	{
+		snprintf(preset.name, PRESET_NAME_LEN, "Preset %u", slot + 1);
+	}
+
+	if (save_preset(slot, &preset))
+	{
+		current_preset = slot;
+		settings[PRESET_SETTING].cont_value = slot + 1;
+	}
+}
+
 // handle_input_events
 //  returns true if there is a change to the config that needs to be updated
 bool handle_input_events(INPUTS_t* events)
@@ -187,13 +494,27 @@ bool handle_input_events(INPUTS_t* events)
 		// a setting is selected. Changing the dial changes the setting and
 		// the navigation buttons exit
 		if (events->back_click) selected = false;
-		switch (curr_setting->type)
+
+		// spinning steps through the presets and switches to the ones that
+		// are stored, clicking stores the current settings in the one shown
+		if (selected_setting == PRESET_SETTING)
+		{
+			if (events->left_spin && curr_setting->cont_value > curr_setting->info->min) curr_setting->cont_value--;
+			if (events->right_spin && curr_setting->cont_value < curr_setting->info->max) curr_setting->cont_value++;
+			if (events->left_spin || events->right_spin) pending_preset_select = curr_setting->cont_value - 1;
+			if (events->select_click)
+			{
+				pending_preset_name[0] = '\0';
+				pending_preset_save = curr_setting->cont_value - 1;
+			}
+		}
+		else switch (curr_setting->info->type)
 		{
 		case CONTINUOUS:
 			// clicking the dial will change the digit we are changing
 			if (events->select_click)
 			{
-				curr_setting->current_digit = (curr_setting->current_digit + 1) % curr_setting->num_digits;
+				curr_setting->current_digit = (curr_setting->current_digit + 1) % curr_setting->info->num_digits;
 			}
 
 			// left and right will increase and decrease that digit
@@ -202,13 +523,13 @@ bool handle_input_events(INPUTS_t* events)
 			if (events->left_spin)
 			{
 				curr_setting->cont_value -= change_value;
-				if (curr_setting->cont_value < curr_setting->min) curr_setting->cont_value = curr_setting->min;
+				if (curr_setting->cont_value < curr_setting->info->min) curr_setting->cont_value = curr_setting->info->min;
 				retval = true;
 			}
 			if (events->right_spin)
 			{
 				curr_setting->cont_value += change_value;
-				if (curr_setting->cont_value > curr_setting->max) curr_setting->cont_value = curr_setting->max;
+				if (curr_setting->cont_value > curr_setting->info->max) curr_setting->cont_value = curr_setting->info->max;
 				retval = true;
 			}
 			break;
@@ -236,13 +557,23 @@ bool handle_input_events(INPUTS_t* events)
 			if (selected_setting < NUM_SETTINGS-1) selected_setting++;
 		}
 		if (events->select_click) selected = true;
+		if (events->back_click) show_diagnostics = !show_diagnostics;
 	}
 
-	// mode click button will change the output mode
+	// mode click button steps through the stored presets, or changes the
+	// output mode if there are none
 	if (events->mode_click)
 	{
-		settings[OUT_VOLTAGE_SETTING].toggle_value = !settings[OUT_VOLTAGE_SETTING].toggle_value;
-		retval = true;
+		int8_t next = next_preset(current_preset);
+		if (next >= 0)
+		{
+			pending_preset_select = next;
+		}
+		else
+		{
+			settings[OUT_VOLTAGE_SETTING].toggle_value = !settings[OUT_VOLTAGE_SETTING].toggle_value;
+			retval = true;
+		}
 	}
 
 	if (events->enable_click)
@@ -252,8 +583,8 @@ bool handle_input_events(INPUTS_t* events)
 	}
 
 	// convert all of the settings to actual run parameters
-	curr_period_100ns = 1e7 / CONVERT_TO_FLOAT(settings[FREQ_SETTING].cont_value, settings[FREQ_SETTING].decimal_loc);
-	curr_bias_voltage = CONVERT_TO_FLOAT(settings[BIAS_VOLTAGE_SETTING].cont_value, settings[BIAS_VOLTAGE_SETTING].decimal_loc);;
+	curr_period_100ns = 1e7 / CONVERT_TO_FLOAT(settings[FREQ_SETTING].cont_value, settings[FREQ_SETTING].info->decimal_loc);
+	curr_bias_mV = settings[BIAS_VOLTAGE_SETTING].cont_value;
 	curr_out_type = settings[OUT_MODE_SETTING].toggle_value;
 	curr_out_voltage = settings[OUT_VOLTAGE_SETTING].toggle_value;
 	running = settings[RUN_TYPE_SETTING].toggle_value;
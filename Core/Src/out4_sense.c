@@ -0,0 +1,242 @@
+// out4_sense.c
+//  reads back the bias that reaches output 4 and trims the DAC to take out
+//  drift. The ADC is started by the tim2 channel 2 compare half way through
+//  every output 4 pulse and a low priority DMA stream writes the samples into
+//  a ring, so sampling costs no interrupts and can not move a pulse edge. The
+//  main task takes what has come in on each pass, averages it over blocks
+//  and nudges the DAC code a little at the end of each one.
+//  The HAL ADC driver is not part of the project, so the ADC is set up with
+//  its registers here. ADC1 and its DMA stream are in the .ioc to keep them
+//  reserved, with MX_ADC1_Init() set not to be called
+
+#include "out4_sense.h"
+#include "outputs.h"
+#include "dac_cal.h"
+#include "main.h"
+#include "cmsis_os.h"
+
+// OUT4_SENSE on PA3 is ADC123_IN3. ADC1 requests go to DMA2 stream 0 on
+// channel 0, a stream nothing else uses
+#define SENSE_ADC ADC1
+#define SENSE_CHANNEL 3
+#define SENSE_DMA_STREAM DMA2_Stream0
+#define SENSE_DMA_FLAGS (DMA_LIFCR_CTCIF0 | DMA_LIFCR_CHTIF0 | DMA_LIFCR_CTEIF0 | DMA_LIFCR_CDMEIF0 | DMA_LIFCR_CFEIF0)
+
+// the regular trigger from the tim2 channel 2 compare, on the rising edge
+#define SENSE_EXTSEL_TIM2_CH2 (ADC_CR2_EXTSEL_1 | ADC_CR2_EXTSEL_0)
+// 28 ADC clocks of sampling, which ends well before the fall of the
+// shortest pulse
+#define SENSE_SAMPLE_TIME 2
+
+// the sense input sees output 4 through a divider with an offset that puts
+// -5V at 0 and +5V at the top of the ADC range, so 0V is mid scale
+#define SENSE_ZERO_COUNTS 2048
+#define SENSE_HALF_RANGE_COUNTS 2048
+#define SENSE_FULL_SCALE_mV 5000
+
+DMA_BUFFER static uint16_t sense_ring[OUT4_SENSE_RING_SIZE];
+static uint32_t ring_tail = 0;
+static uint32_t last_pulses = 0;
+static uint32_t skip_samples = 0;
+
+// the bias being measured. Any change starts the average and the trim over
+static bool measuring = false;
+static bool trimming = false;
+static int16_t set_mV = 0;
+static uint16_t set_code = 0;
+
+// the block being averaged, which starts once the output has settled
+static uint32_t settle_until_ms = 0;
+static uint32_t block_sum = 0;
+static uint32_t block_samples = 0;
+
+// the result of the last block, read by the telemetry in the serial task
+static volatile int16_t sense_mV = 0;
+static volatile int16_t trim_codes = 0;
+static volatile bool sense_valid = false;
+
+static void start_ring(void);
+static uint32_t collect_samples(uint32_t* sum);
+static void restart_block(uint32_t now, bool settle);
+static void trim_step(void);
+
+// out4_sense_init
+//  sets up the ADC and its DMA ring. Nothing is sampled until the outputs run
+void out4_sense_init(void)
+{
+	__HAL_RCC_ADC1_CLK_ENABLE();
+
+	// PCLK2 / 4, within the 36MHz the ADC can take
+	ADC123_COMMON->CCR = ADC_CCR_ADCPRE_0;
+	SENSE_ADC->CR1 = 0;
+	SENSE_ADC->SMPR2 = SENSE_SAMPLE_TIME << (3 * SENSE_CHANNEL);
+	SENSE_ADC->SQR1 = 0;
+	SENSE_ADC->SQR3 = SENSE_CHANNEL;
+
+	// 16 bit transfers from the data register into the ring, round and round
+	SENSE_DMA_STREAM->CR = DMA_SxCR_MSIZE_0 | DMA_SxCR_PSIZE_0 | DMA_SxCR_MINC | DMA_SxCR_CIRC;
+	SENSE_DMA_STREAM->PAR = (uint32_t)&SENSE_ADC->DR;
+	SENSE_DMA_STREAM->M0AR = (uint32_t)sense_ring;
+	start_ring();
+
+	// the first conversion is at least one output start away, longer than
+	// the ADC takes to power up
+	SENSE_ADC->CR2 = ADC_CR2_ADON;
+	SENSE_ADC->CR2 = ADC_CR2_ADON | ADC_CR2_DMA | ADC_CR2_DDS | SENSE_EXTSEL_TIM2_CH2 | ADC_CR2_EXTEN_0;
+}
+
+// run_out4_sense
+//  called on every pass of the main task, which owns the outputs. Takes the
+//  new samples, and at the end of a block updates the reading and the trim.
+//  A bias held for calibration is read back but not trimmed
+void run_out4_sense(void)
+{
+	uint32_t now = xTaskGetTickCount();
+	int16_t bias_mV = 0;
+	uint16_t code = 0;
+	int32_t trim = 0;
+	bool steady = get_out4_bias(&bias_mV, &code, &trim);
+	bool trim_now = steady && !dac_cal_holding();
+
+	// the DMA fell behind the ADC, which then stops asking for transfers
+	if (SENSE_ADC->SR & ADC_SR_OVR)
+	{
+		SENSE_ADC->CR2 &= ~ADC_CR2_DMA;
+		SENSE_ADC->SR = ~(uint32_t)ADC_SR_OVR;
+		start_ring();
+		SENSE_ADC->CR2 |= ADC_CR2_DMA;
+	}
+
+	uint32_t sum = 0;
+	uint32_t samples = collect_samples(&sum);
+
+	// a new bias, a bias table or the outputs stopping start it all over,
+	// and all but a restart with the same bias take the trim off the DAC
+	if (steady != measuring || trim_now != trimming ||
+		(steady && (bias_mV != set_mV || code != set_code || trim != trim_codes)))
+	{
+		measuring = steady;
+		trimming = trim_now;
+		set_mV = bias_mV;
+		set_code = code;
+		trim_codes = trim;
+		sense_valid = false;
+		restart_block(now, true);
+		return;
+	}
+	if (!measuring || (int32_t)(now - settle_until_ms) < 0) return;
+
+	block_sum += sum;
+	block_samples += samples;
+	if (now - settle_until_ms < OUT4_SENSE_BLOCK_ms || block_samples < OUT4_SENSE_MIN_SAMPLES) return;
+
+	// in Q4 counts so the average keeps the resolution it gains over the ADC
+	int32_t mean_q4 = (int32_t)(((uint64_t)block_sum << 4) / block_samples);
+	sense_mV = (mean_q4 - SENSE_ZERO_COUNTS * 16) * SENSE_FULL_SCALE_mV / (SENSE_HALF_RANGE_COUNTS * 16);
+	sense_valid = true;
+
+	int16_t last_trim = trim_codes;
+	if (trimming) trim_step();
+	restart_block(now, trim_codes != last_trim);
+}
+
+// get_out4_sense
+//  the last reading of output 4 and the trim on the DAC. Returns false if
+//  there is no reading of the bias that is on the output now
+bool get_out4_sense(int16_t* reading_mV, int16_t* trim)
+{
+	*reading_mV = sense_mV;
+	*trim = trim_codes;
+	return sense_valid;
+}
+
+// start_ring
+//  starts the DMA over from the top of the ring
+static void start_ring(void)
+{
+	SENSE_DMA_STREAM->CR &= ~DMA_SxCR_EN;
+	while (SENSE_DMA_STREAM->CR & DMA_SxCR_EN);
+	DMA2->LIFCR = SENSE_DMA_FLAGS;
+	SENSE_DMA_STREAM->NDTR = OUT4_SENSE_RING_SIZE;
+	SENSE_DMA_STREAM->CR |= DMA_SxCR_EN;
+	ring_tail = 0;
+}
+
+// collect_samples
+//  adds up the samples written since the last call and returns how many.
+//  There is one sample per pulse, so if the pulse count says the ring may
+//  have wrapped only the newest ones are taken, the ones that are sure to be
+//  new. That is the decimation at high frequencies
+static uint32_t collect_samples(uint32_t* sum)
+{
+	uint32_t head = (OUT4_SENSE_RING_SIZE - SENSE_DMA_STREAM->NDTR) % OUT4_SENSE_RING_SIZE;
+	uint32_t pulses = get_pulses_emitted();
+	uint32_t new_pulses = pulses - last_pulses;
+	last_pulses = pulses;
+
+	// the pulse count only moves in steps of a few pulses, so below a
+	// quarter of the ring the samples since the tail are all new
+	uint32_t tail = ring_tail;
+	if (new_pulses >= OUT4_SENSE_RING_SIZE / 4)
+	{
+		uint32_t take = (new_pulses < OUT4_SENSE_RING_SIZE / 2) ? new_pulses : OUT4_SENSE_RING_SIZE / 2;
+		tail = (head + OUT4_SENSE_RING_SIZE - take) % OUT4_SENSE_RING_SIZE;
+	}
+	ring_tail = head;
+
+	uint32_t samples = 0;
+	for (; tail != head; tail = (tail + 1) % OUT4_SENSE_RING_SIZE)
+	{
+		if (skip_samples > 0)
+		{
+			skip_samples--;
+			continue;
+		}
+		*sum += sense_ring[tail];
+		samples++;
+	}
+	return samples;
+}
+
+// restart_block
+//  starts a new average. After a change of the DAC the output is given time
+//  to settle, and the first sample is dropped as it can be from the pulse
+//  before the new code was latched
+static void restart_block(uint32_t now, bool settle)
+{
+	settle_until_ms = now + (settle ? OUT4_SENSE_SETTLE_ms : 0);
+	skip_samples = settle ? 1 : 0;
+	block_sum = 0;
+	block_samples = 0;
+}
+
+// trim_step
+//  moves the trim by half of the error, worked out with the slope of the
+//  calibration around the bias. The magnitudes are compared, so it is the
+//  same for both polarities
+static void trim_step(void)
+{
+	int8_t sign = (set_mV > 0) - (set_mV < 0);
+	int32_t target_mV = (set_mV < 0) ? -set_mV : set_mV;
+	int32_t error_mV = target_mV - sign * sense_mV;
+	if (error_mV >= -OUT4_TRIM_DEADBAND_mV && error_mV <= OUT4_TRIM_DEADBAND_mV) return;
+
+	// codes per 100mV, negative where the code goes down as the bias goes up.
+	// Past the last calibration point the codes stop changing, so at the top
+	// of the range the slope is taken from below
+	int32_t slope = dac_cal_code(target_mV + 100, sign) - dac_cal_code(target_mV, sign);
+	if (slope == 0 && target_mV >= 100) slope = dac_cal_code(target_mV, sign) - dac_cal_code(target_mV - 100, sign);
+	if (slope == 0) return;
+
+	int32_t step = error_mV * slope / 200;
+	if (step == 0) step = ((error_mV > 0) == (slope > 0)) ? 1 : -1;
+	if (step > OUT4_TRIM_MAX_STEP) step = OUT4_TRIM_MAX_STEP;
+	if (step < -OUT4_TRIM_MAX_STEP) step = -OUT4_TRIM_MAX_STEP;
+
+	int32_t trim = trim_codes + step;
+	if (trim > OUT4_TRIM_MAX_CODES) trim = OUT4_TRIM_MAX_CODES;
+	if (trim < -OUT4_TRIM_MAX_CODES) trim = -OUT4_TRIM_MAX_CODES;
+	if (trim_out4_bias(trim)) trim_codes = trim;
+}
+
+// End of out4_sense.c
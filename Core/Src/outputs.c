@@ -5,6 +5,12 @@
 //  of the outputs
 
 #include "outputs.h"
+#include "trace.h"
+#include "relays.h"
+#include "dac_cal.h"
+#include "stm32f7xx_ll_tim.h"
+#include "stm32f7xx_ll_dac.h"
+#include <string.h>
 
 // Note: This library assumes the frequency per tick of htim5 and htim2 are both 10MHz
 #define TIMER_FREQ_Hz 10000000ul
@@ -19,6 +25,9 @@
 
 // output 4 has a target fall time of 1us
 #define OUT4_FALL_TIME_100ns 10
+// a bias table only hands output 4 between the MOSFETs if the handover can be
+// at least this far from the edges of the gap it is in, see start_handover()
+#define OUT4_HANDOVER_MIN_100ns 5
 
 // tim8 is the master that controls both tim2 and tim5 so they are syncronized
 extern TIM_HandleTypeDef htim8;
@@ -32,18 +41,107 @@ extern TIM_HandleTypeDef htim5;
 // tim2 channel 3 is neg enable, channel 4 is pos enable. Must be configured in OC
 // Toggle on match with DMA
 extern TIM_HandleTypeDef htim2;
-// DAC controls the voltage level of output4
+// DAC controls the voltage level of output4. It is triggered by the tim5 update,
+// so a new code only reaches the output at the start of the next period
 extern DAC_HandleTypeDef hdac;
+// tim2 channel 2 is not on a pin. Its compare half way through the output 4 pulse
+// triggers the ADC that reads output 4 back, see out4_sense.c
 // WARNING: When running htim2, Never have channel 3 and channel 4 on at the same time.
-// This will cause MOSFET shootthrough
+// This will cause MOSFET shootthrough. A MOSFET is only on from the output 4 rise
+// to the fall, so the channels are only ever swapped before the rise
 
 // waveforms for the three channels. These should be calculated mathematically based on
 // the desired period, and whether we want to be in short or normal mode. Fall is the
 // first number, rise is the second number
 #define BUFFER_REPEATS 10
-uint32_t chan_2_out[2*BUFFER_REPEATS] = {0};
-uint32_t chan_3_out[2*BUFFER_REPEATS] = {0};
-uint32_t chan_4_out[2*BUFFER_REPEATS] = {0};
+DMA_BUFFER uint32_t chan_2_out[2*BUFFER_REPEATS];
+DMA_BUFFER uint32_t chan_3_out[2*BUFFER_REPEATS];
+DMA_BUFFER uint32_t chan_4_out[2*BUFFER_REPEATS];
+
+// the codes of a bias table and the tim2 channel modes, one per pulse, with
+// room for the entries that go after the last pulse. See start_bias_table()
+DMA_BUFFER uint16_t bias_codes[BIAS_TABLE_MAX_CODES + 2];
+DMA_BUFFER uint32_t out4_modes[BIAS_TABLE_MAX_CODES + 1];
+static volatile bool bias_table_running = false;
+
+// a table that hands output 4 between the MOSFETs, left by start_bias_table()
+// for commit_output_regs()
+static uint32_t handover_codes = 0;
+static bool handover_circular = false;
+static int8_t handover_first_sign = 0;
+
+// every wrap of the output 2 DMA buffer is BUFFER_REPEATS pulses
+volatile uint32_t pulses_emitted = 0;
+
+// set when the timers are configured and only waiting on tim8 to start
+static volatile bool output_armed = false;
+// set from the start of tim8 until the outputs are stopped
+static volatile bool output_running = false;
+
+// a compare channel that has its edge times reloaded from a buffer by DMA.
+// Output 4 uses one of the two tim2 channels depending on the bias sign
+typedef struct
+{
+	TIM_HandleTypeDef* htim;
+	uint32_t channel;             // LL_TIM_CHANNEL_CHx
+	uint16_t dma_id;              // TIM_DMA_ID_CCx, where the HAL keeps the stream
+	uint32_t dma_request;         // TIM_DIER_CCxDE
+	volatile uint32_t* ccr;
+	uint32_t* buffer;
+} OUT_DMA_t;
+
+enum
+{
+	OUT_DMA_2 = 0,
+	OUT_DMA_3,
+	OUT_DMA_4_NEG,
+	OUT_DMA_4_POS,
+	NUM_OUT_DMA,
+	OUT_DMA_NONE = NUM_OUT_DMA
+};
+
+static const OUT_DMA_t out_dma[NUM_OUT_DMA] = {
+	{ &htim5, LL_TIM_CHANNEL_CH2, TIM_DMA_ID_CC2, TIM_DIER_CC2DE, &TIM5->CCR2, chan_2_out },
+	{ &htim5, LL_TIM_CHANNEL_CH3, TIM_DMA_ID_CC3, TIM_DIER_CC3DE, &TIM5->CCR3, chan_3_out },
+	{ &htim2, LL_TIM_CHANNEL_CH3, TIM_DMA_ID_CC3, TIM_DIER_CC3DE, &TIM2->CCR3, chan_4_out },
+	{ &htim2, LL_TIM_CHANNEL_CH4, TIM_DMA_ID_CC4, TIM_DIER_CC4DE, &TIM2->CCR4, chan_4_out },
+};
+
+// everything on the outputs that depends on the plan. The image of the last
+// commit is kept so the next one only writes what changed, e.g. a new bias
+// of the same sign is one DAC write
+typedef struct
+{
+	uint32_t arr;                 // tim2, tim5 and tim8 share the period
+	uint32_t out1_fall;           // tim5 CCR1
+	uint32_t dac_value;
+	uint32_t relays_set;          // both relays are set for the 0.45V outputs
+	uint32_t out4_dma;            // OUT_DMA_4_NEG, OUT_DMA_4_POS or OUT_DMA_NONE
+	uint32_t out4_start_mode;     // level the output 4 channel toggles from
+	uint32_t out4_handover;       // a bias table swaps the output 4 channels while running
+	uint32_t out4_sense;          // tim2 CCR2, when the output 4 readback is sampled
+	int32_t bias_mV;              // not a register, the bias dac_value was looked up for
+	uint32_t out2[2];             // rise and fall, the contents of the buffers
+	uint32_t out3[2];
+	uint32_t out4[2];
+} OUTPUT_REGS_t;
+
+// what commit_output_regs() leaves for start_prepared_outputs(), which can
+// run later from the timer task if the relays had to move
+static DMA_Stream_TypeDef* start_streams[NUM_OUT_DMA];
+static uint32_t start_stream_cr[NUM_OUT_DMA];
+static uint8_t num_start_streams = 0;
+static uint32_t start_tim5_dier = 0;
+static uint32_t start_tim2_dier = 0;
+static bool start_fire = false;
+static volatile bool start_pending = false;
+
+static OUTPUT_REGS_t live_regs;
+// the readback trim on top of the calibrated code of the bias, see
+// trim_out4_bias(). Dropped whenever the code changes
+static int32_t out4_trim = 0;
+static bool live_regs_valid = false;
+static bool output_dma_ready = false;
 
 // neopixel LED outputs
 // must be configured to be 20MHz for 0.05us resolution, with output 1 defined
@@ -56,16 +154,50 @@ uint32_t chan_4_out[2*BUFFER_REPEATS] = {0};
 #define OUT3_OFFSET_50ns 1 // output 3 is slightly delated compared to 1 and 2 in 0.45V mode
 extern TIM_HandleTypeDef htim1;
 
-// waveform for the 4 neopixel leds
+// waveform for the 4 neopixel leds. Only the data bits and one zero after
+// them are sent by DMA, the low time that latches the colors is counted out
+// by the timer with its repetition counter. The repetition counter only
+// takes a new count at an update, so the timer is put in one-pulse mode from
+// the update that starts the gap and then stops itself at the end of it,
+// which raises the update interrupt that ends the frame
 #define NEO_BUFFER_SIZE_PER_LED 24
-#define NEO_RESET_CYCLES 2500 // lots of cycles of low to garuntee a reset cycle on the NEOPixel LEDs
-#define TOTAL_NEO_BUFFER_SIZE ((NUM_NEO_LEDS*NEO_BUFFER_SIZE_PER_LED)+NEO_RESET_CYCLES)
-uint16_t neo_out[TOTAL_NEO_BUFFER_SIZE] = {0};
-volatile bool send_done = true;
+#define NEO_RESET_PERIODS 250 // 375us of low, more than the 280us the newest LEDs need to latch
+#define TOTAL_NEO_BUFFER_SIZE ((NUM_NEO_LEDS*NEO_BUFFER_SIZE_PER_LED)+1)
+DMA_BUFFER uint16_t neo_out[TOTAL_NEO_BUFFER_SIZE];
+
+// the colors are double buffered. set_neopixel only writes neo_colors, and a
+// frame copies them to neo_shown and encodes them into neo_out when the
+// driver is free, so an update never has to wait for a transfer
+static uint32_t neo_colors[NUM_NEO_LEDS] = {0};
+static uint32_t neo_shown[NUM_NEO_LEDS] = {0};
+static bool neo_shown_valid = false;
+
+// set from the start of a send until all NEO_RESET_PERIODS of the reset gap
+// have been counted, so the next frame never starts before the LEDs latch
+static volatile bool neo_sending = false;
+// set by the update that starts the reset gap, once the timer counts it
+static volatile bool neo_gap_counting = false;
+// a frame was asked for while the last one was still going out
+static volatile bool neo_frame_pending = false;
 
 // static functions
-static OUTPUT_ERROR_t set_out4_voltage(float voltage);
+static uint32_t out4_channel(int8_t sign, uint32_t* start_mode);
+static uint32_t out4_mode_word(int8_t sign);
+static void start_output_regs(const OUTPUT_REGS_t* next);
+static void build_output_regs(const OUTPUT_PLAN_t* plan, OUTPUT_REGS_t* regs);
+static void commit_output_regs(const OUTPUT_REGS_t* next, bool fire);
+static void start_prepared_outputs(void);
+static void stop_outputs(void);
+static void setup_output_dma(void);
+static void out2_buffer_wrapped(DMA_HandleTypeDef* hdma);
+static void stop_stream(DMA_HandleTypeDef* hdma);
+static void start_handover(const OUTPUT_REGS_t* next);
+static void load_bias_stream(const uint16_t* codes, uint32_t num_codes, bool circular);
+static void halt_bias_table(void);
+static void bias_table_done(DMA_HandleTypeDef* hdma);
 static void set_all_buffer(uint32_t* array, uint32_t value1, uint32_t value2);
+static void start_neo_frame(void);
+static uint32_t out4_trimmed_code(void);
 
 
 // enable_output_waveform
@@ -74,47 +206,79 @@ static void set_all_buffer(uint32_t* array, uint32_t value1, uint32_t value2);
 OUTPUT_ERROR_t enable_output_waveform(uint32_t period_100ns,
 		                              OUTPUT_TYPE_t out_type,
 									  OUT12_VOLTAGE_t out_voltage,
-									  float target_bias_voltage_V,
+									  int16_t target_bias_mV,
 									  bool single_shot)
 {
-	TIM_OC_InitTypeDef sConfigOC = {0};
-	uint32_t out1_fall_time = 0;
-	uint32_t out2_rise_time = 0;
-	uint32_t out2_fall_time = 0;
-	uint32_t out3_rise_time = 0;
-	uint32_t out3_fall_time = 0;
-	uint32_t out4_rise_time = 0;
-	uint32_t out4_fall_time = 0;
-	OUTPUT_ERROR_t err = OUT_SUCCESS;
-	uint32_t time_step_100ns;
-	HIGH_SPEED_MODIFICATION_t speed_mod = NO_MOD;
+	uint32_t start_cycles = trace_now();
+	OUTPUT_PLAN_t plan;
+	OUTPUT_ERROR_t err = plan_output_waveform(period_100ns, out_type, out_voltage,
+			                                  target_bias_mV, single_shot, &plan);
+	if (err != OUT_SUCCESS) return err;
 
-	// disable all outputs so there is no strange behavior when switching values
-	disable_all_outputs();
+	OUTPUT_REGS_t next;
+	build_output_regs(&plan, &next);
+	start_output_regs(&next);
+	trace_record(TRACE_RECONFIG, start_cycles);
 
-	// set the correct voltage on output4
-	err = set_out4_voltage(target_bias_voltage_V);
+	return OUT_SUCCESS;
+}
+
+// enable_output_plan
+//  same as enable_output_waveform() from a plan that was worked out before,
+//  e.g. one stored with a preset
+OUTPUT_ERROR_t enable_output_plan(const OUTPUT_PLAN_t* plan)
+{
+	uint32_t start_cycles = trace_now();
+	OUTPUT_REGS_t next;
+	build_output_regs(plan, &next);
+	start_output_regs(&next);
+	trace_record(TRACE_RECONFIG, start_cycles);
+
+	return OUT_SUCCESS;
+}
+
+// arm_output_waveform
+//  Does all of the setup for the outputs, leaving only the start of the tim8
+//  master pending. fire_output_waveform() then starts them with one register
+//  write, which can be done from an interrupt
+OUTPUT_ERROR_t arm_output_waveform(uint32_t period_100ns,
+		                           OUTPUT_TYPE_t out_type,
+								   OUT12_VOLTAGE_t out_voltage,
+								   int16_t target_bias_mV,
+								   bool single_shot)
+{
+	OUTPUT_PLAN_t plan;
+	OUTPUT_ERROR_t err = plan_output_waveform(period_100ns, out_type, out_voltage,
+			                                  target_bias_mV, single_shot, &plan);
 	if (err != OUT_SUCCESS) return err;
 
-	// configure out1 and out2 to the correct voltage by setting the relay
-	if (out_voltage == LOW_VOLTAGE_450mV)
-	{
-		HAL_GPIO_WritePin(RELAY_1_GPIO_Port, RELAY_1_Pin, SET);
-		HAL_GPIO_WritePin(RELAY_2_GPIO_Port, RELAY_2_Pin, SET);
-	}
-	else
-	{
-		HAL_GPIO_WritePin(RELAY_1_GPIO_Port, RELAY_1_Pin, RESET);
-		HAL_GPIO_WritePin(RELAY_2_GPIO_Port, RELAY_2_Pin, RESET);
-	}
+	return arm_output_plan(&plan);
+}
 
-	// set the correct period for tim2 and tim5
-	__HAL_TIM_SET_AUTORELOAD(&htim2, period_100ns - 1);
-	__HAL_TIM_SET_AUTORELOAD(&htim5, period_100ns - 1);
-	__HAL_TIM_SET_AUTORELOAD(&htim8, period_100ns - 1);
-	__HAL_TIM_SET_COUNTER(&htim2, 0);
-	__HAL_TIM_SET_COUNTER(&htim5, 0);
-	__HAL_TIM_SET_COUNTER(&htim8, 0);
+// plan_output_waveform
+//  works out all of the edge times and the bias for the parameters without
+//  touching the hardware. The plan does not change unless the parameters do,
+//  so it can be stored and put on the outputs later. The DAC code of the bias
+//  is only looked up when a plan goes on the outputs, so stored plans follow
+//  a new calibration
+OUTPUT_ERROR_t plan_output_waveform(uint32_t period_100ns,
+		                            OUTPUT_TYPE_t out_type,
+									OUT12_VOLTAGE_t out_voltage,
+									int16_t target_bias_mV,
+									bool single_shot,
+									OUTPUT_PLAN_t* plan)
+{
+	uint32_t time_step_100ns;
+	uint32_t out4_fall_time = 0;
+	HIGH_SPEED_MODIFICATION_t speed_mod = NO_MOD;
+
+	if (out_voltage != LOW_VOLTAGE_450mV && out_voltage != HIGH_VOLTAGE_5000mV) return OUT_BAD_ENUM;
+
+	memset(plan, 0, sizeof(*plan));
+	plan->period_100ns = period_100ns;
+	plan->out_voltage = out_voltage;
+	plan->bias_sign = (target_bias_mV > 0) - (target_bias_mV < 0);
+	plan->bias_mV = target_bias_mV;
 
 	// find if there needs to be a modification because the frequency is too high
 	if (period_100ns < CHANGE_OUT4_DUTY_CUTOFF_100ns) speed_mod = CHANGE_OUT4_DUTY;
@@ -141,196 +305,688 @@ OUTPUT_ERROR_t enable_output_waveform(uint32_t period_100ns,
 
 	// shift everything to be based off of the output 1 timer, meaning the start
 	// of output 4 is two time steps after the start
-	out4_rise_time = (2*time_step_100ns);
-	out4_fall_time += (2*time_step_100ns);
-	out2_rise_time = (1*time_step_100ns);
-	out3_rise_time = out4_rise_time;
-	out3_fall_time = out4_fall_time - (2*time_step_100ns);
+	plan->out4_rise = (2*time_step_100ns);
+	plan->out4_fall = out4_fall_time + (2*time_step_100ns);
+	plan->out2_rise = (1*time_step_100ns);
+	plan->out3_rise = plan->out4_rise;
+	plan->out3_fall = plan->out4_fall - (2*time_step_100ns);
 	switch (out_type)
 	{
 	case STANDARD:
-		out1_fall_time = out4_fall_time - (3*time_step_100ns);
-		out2_fall_time = out4_fall_time - (2*time_step_100ns);
+		plan->out1_fall = plan->out4_fall - (3*time_step_100ns);
+		plan->out2_fall = plan->out4_fall - (2*time_step_100ns);
 		break;
 
 	case SHORT:
-		out1_fall_time = SHORT_TIME_PERIOD_100ns;
-		out2_fall_time = out2_rise_time + SHORT_TIME_PERIOD_100ns;
+		plan->out1_fall = SHORT_TIME_PERIOD_100ns;
+		plan->out2_fall = plan->out2_rise + SHORT_TIME_PERIOD_100ns;
 		break;
 
 	default: return OUT_BAD_ENUM;
 	}
 
-    // force OCxREF low at the start of the cycle for each timer output
-    // this is done with the FORCE_INACTIVE mode
-    sConfigOC.OCMode = TIM_OCMODE_FORCED_ACTIVE;
-    sConfigOC.Pulse = 0;
-    sConfigOC.OCPolarity = TIM_OCPOLARITY_HIGH;
-    sConfigOC.OCFastMode = TIM_OCFAST_DISABLE;
-    HAL_TIM_OC_ConfigChannel(&htim5, &sConfigOC, TIM_CHANNEL_2);
-    HAL_TIM_OC_ConfigChannel(&htim5, &sConfigOC, TIM_CHANNEL_3);
-    sConfigOC.OCMode = TIM_OCMODE_TOGGLE;
-    HAL_TIM_OC_ConfigChannel(&htim5, &sConfigOC, TIM_CHANNEL_2);
-    HAL_TIM_OC_ConfigChannel(&htim5, &sConfigOC, TIM_CHANNEL_3);
-
-    // if we are creating a positive voltage, force channel 4 low. If neg voltage
-    // force channel 3 high. Positive is active low
-	if (target_bias_voltage_V > 0)
+    // based on which mode the first two outputs are in, we need to
+    // add a bit of an offset on output 3 to make it line up
+	if (out_voltage == LOW_VOLTAGE_450mV)
+	{
+		plan->out3_rise -= OUT3_OFFSET_50ns;
+		plan->out3_fall -= OUT3_OFFSET_50ns;
+	}
+
+	// TODO some code to make single-shot work
+
+	return OUT_SUCCESS;
+}
+
+// arm_output_plan
+//  puts a plan on the timers, the DAC and the relays and leaves the outputs
+//  waiting on tim8. If the relays have to move, the outputs are only armed
+//  once they have settled. No floating point in here, it only copies numbers
+//  out of the plan
+OUTPUT_ERROR_t arm_output_plan(const OUTPUT_PLAN_t* plan)
+{
+	OUTPUT_REGS_t next;
+	build_output_regs(plan, &next);
+	commit_output_regs(&next, false);
+
+	return OUT_SUCCESS;
+}
+
+// fire_output_waveform
+//  starts tim8, and with it all of the outputs, if they have been armed.
+//  Returns false if there was nothing armed
+bool fire_output_waveform(void)
+{
+	if (!output_armed) return false;
+
+	output_armed = false;
+	LL_TIM_EnableCounter(htim8.Instance);
+	output_running = true;
+	trace_boot_step(BOOT_FIRST_EDGE);
+	return true;
+}
+
+// is_output_armed
+//  true if arm_output_waveform() has run and the outputs are waiting on tim8
+bool is_output_armed(void)
+{
+	return output_armed;
+}
+
+// disable_all_outputs
+//  Turns off and resets all outputs
+void disable_all_outputs(void)
+{
+	// TODO something to wait for the sequence to end
+
+	stop_outputs();
+	htim5.Instance->CCER = 0;
+	htim2.Instance->CCER = 0;
+}
+
+// start_output_regs
+//  puts the image on the outputs and starts them. If they are already running
+//  and only the size of the bias changed, the waveform is left alone and the
+//  new level is one DAC write, which goes out at the next period boundary
+static void start_output_regs(const OUTPUT_REGS_t* next)
+{
+	OUTPUT_REGS_t check = *next;
+	check.dac_value = live_regs.dac_value;
+	check.bias_mV = live_regs.bias_mV;
+	if (output_running && live_regs_valid && memcmp(&check, &live_regs, sizeof(check)) == 0)
 	{
-		sConfigOC.OCMode = TIM_OCMODE_FORCED_INACTIVE;
-		HAL_TIM_OC_ConfigChannel(&htim2, &sConfigOC, TIM_CHANNEL_3);
-	    HAL_TIM_OC_ConfigChannel(&htim2, &sConfigOC, TIM_CHANNEL_4);
+		stop_bias_table();
+		if (next->dac_value != live_regs.dac_value)
+		{
+			LL_DAC_ConvertData12RightAligned(hdac.Instance, LL_DAC_CHANNEL_1, next->dac_value);
+			live_regs.dac_value = next->dac_value;
+			out4_trim = 0;
+		}
+		live_regs.bias_mV = next->bias_mV;
+		return;
+	}
 
-	    sConfigOC.OCMode = TIM_OCMODE_TOGGLE;
-		HAL_TIM_OC_ConfigChannel(&htim2, &sConfigOC, TIM_CHANNEL_4);
+	commit_output_regs(next, true);
+}
+
+// build_output_regs
+//  works out the register image of a plan
+static void build_output_regs(const OUTPUT_PLAN_t* plan, OUTPUT_REGS_t* regs)
+{
+	memset(regs, 0, sizeof(*regs));
+	regs->arr = plan->period_100ns - 1;
+	regs->out1_fall = plan->out1_fall;
+	regs->dac_value = dac_cal_code(plan->bias_mV, plan->bias_sign);
+	regs->relays_set = (plan->out_voltage == LOW_VOLTAGE_450mV);
+	regs->out2[0] = plan->out2_rise;
+	regs->out2[1] = plan->out2_fall;
+	regs->out3[0] = plan->out3_rise;
+	regs->out3[1] = plan->out3_fall;
+	regs->out4[0] = plan->out4_rise;
+	regs->out4[1] = plan->out4_fall;
+	regs->out4_sense = (plan->out4_rise + plan->out4_fall) / 2;
+	regs->bias_mV = plan->bias_mV;
+
+	regs->out4_dma = out4_channel(plan->bias_sign, &regs->out4_start_mode);
+}
+
+// out4_channel
+//  the output 4 channel for a bias sign and the level it toggles from. If we
+//  are creating a positive voltage, channel 4 toggles from low. If neg
+//  voltage channel 3 toggles from high. Positive is active low
+static uint32_t out4_channel(int8_t sign, uint32_t* start_mode)
+{
+	*start_mode = 0;
+	if (sign > 0)
+	{
+		*start_mode = LL_TIM_OCMODE_FORCED_INACTIVE;
+		return OUT_DMA_4_POS;
 	}
-	else if (target_bias_voltage_V < 0)
+	if (sign < 0)
 	{
-		sConfigOC.OCMode = TIM_OCMODE_FORCED_ACTIVE;
-		HAL_TIM_OC_ConfigChannel(&htim2, &sConfigOC, TIM_CHANNEL_4);
-		HAL_TIM_OC_ConfigChannel(&htim2, &sConfigOC, TIM_CHANNEL_3);
+		*start_mode = LL_TIM_OCMODE_FORCED_ACTIVE;
+		return OUT_DMA_4_NEG;
+	}
+	return OUT_DMA_NONE;
+}
+
+// out4_mode_word
+//  the tim2 CCMR2 value that has the channel for the sign toggling and the
+//  other one forced to the level that keeps its MOSFET off
+static uint32_t out4_mode_word(int8_t sign)
+{
+	uint32_t word = htim2.Instance->CCMR2 & ~(TIM_CCMR2_OC3M | TIM_CCMR2_OC4M);
+	uint32_t ch3 = (sign < 0) ? LL_TIM_OCMODE_TOGGLE : LL_TIM_OCMODE_FORCED_INACTIVE;
+	uint32_t ch4 = (sign > 0) ? LL_TIM_OCMODE_TOGGLE : LL_TIM_OCMODE_FORCED_ACTIVE;
+	return word | ch3 | (ch4 << 8);
+}
 
-		sConfigOC.OCMode = TIM_OCMODE_TOGGLE;
-		HAL_TIM_OC_ConfigChannel(&htim2, &sConfigOC, TIM_CHANNEL_3);
+// commit_output_regs
+//  stops the outputs, writes the parts of the image that differ from the one
+//  on the hardware and restarts everything from the top of the period. Only
+//  the enables are written with the interrupts off
+static void commit_output_regs(const OUTPUT_REGS_t* next, bool fire)
+{
+	if (!output_dma_ready) setup_output_dma();
+	stop_outputs();
+
+#define REG_CHANGED(field) (!live_regs_valid || next->field != live_regs.field)
+	if (REG_CHANGED(arr))
+	{
+		htim8.Instance->ARR = next->arr;
+		htim5.Instance->ARR = next->arr;
+		htim2.Instance->ARR = next->arr;
 	}
-	else
+	if (REG_CHANGED(out1_fall)) htim5.Instance->CCR1 = next->out1_fall;
+	if (REG_CHANGED(out4_sense)) htim2.Instance->CCR2 = next->out4_sense;
+	if (REG_CHANGED(dac_value))
 	{
-		sConfigOC.OCMode = TIM_OCMODE_FORCED_INACTIVE;
-		HAL_TIM_OC_ConfigChannel(&htim2, &sConfigOC, TIM_CHANNEL_3);
-		sConfigOC.OCMode = TIM_OCMODE_FORCED_ACTIVE;
-		HAL_TIM_OC_ConfigChannel(&htim2, &sConfigOC, TIM_CHANNEL_4);
+		LL_DAC_ConvertData12RightAligned(hdac.Instance, LL_DAC_CHANNEL_1, next->dac_value);
+		out4_trim = 0;
 	}
+#undef REG_CHANGED
+	// a table that swaps the output 4 channels starts with the outputs
+	if (next->out4_handover) LL_DAC_ConvertData12RightAligned(hdac.Instance, LL_DAC_CHANNEL_1, bias_codes[0]);
 
-    // based on which mode the first two outputs are in, we need to
-    // add a bit of an offset on output 3 to make it line up
-	if (out_voltage == LOW_VOLTAGE_450mV)
+	// the timers are stopped, so the update that latches the code into the DAC
+	// is made here instead of at the end of the first period. Also needed if a
+	// bias table was running, the DAC output still has a code from the table
+	htim5.Instance->EGR = TIM_EGR_UG;
+
+	if (!live_regs_valid || memcmp(next->out2, live_regs.out2, sizeof(next->out2)) != 0)
+	{
+		set_all_buffer(chan_2_out, next->out2[0], next->out2[1]);
+	}
+	if (!live_regs_valid || memcmp(next->out3, live_regs.out3, sizeof(next->out3)) != 0)
+	{
+		set_all_buffer(chan_3_out, next->out3[0], next->out3[1]);
+	}
+	if (!live_regs_valid || memcmp(next->out4, live_regs.out4, sizeof(next->out4)) != 0)
 	{
-		out3_rise_time -= OUT3_OFFSET_50ns;
-		out3_fall_time -= OUT3_OFFSET_50ns;
+		set_all_buffer(chan_4_out, next->out4[0], next->out4[1]);
 	}
+	live_regs = *next;
+	live_regs_valid = true;
+
+	// every start is from the top of the period with the buffers from their
+	// first entry. The toggled outputs are forced to the level they start
+	// from and then go back to toggling. During a handover both output 4
+	// channels have their edge times loaded, the one not in use stays forced
+	uint32_t out4_start_mode = next->out4_start_mode;
+	uint32_t out4_dma = next->out4_handover ? out4_channel(handover_first_sign, &out4_start_mode) : next->out4_dma;
+	htim8.Instance->CNT = 0;
+	htim5.Instance->CNT = 0;
+	htim2.Instance->CNT = 0;
+	num_start_streams = 0;
+	start_tim5_dier = TIM_DIER_CC2DE | TIM_DIER_CC3DE;
+	start_tim2_dier = 0;
+	for (uint8_t d = 0; d < NUM_OUT_DMA; d++)
+	{
+		bool toggles = (d < OUT_DMA_4_NEG) || d == out4_dma;
+		if (!toggles && !next->out4_handover) continue;
+
+		const OUT_DMA_t* out = out_dma + d;
+		DMA_Stream_TypeDef* stream = out->htim->hdma[out->dma_id]->Instance;
+		*out->ccr = 0;
+		if (toggles)
+		{
+			LL_TIM_OC_SetMode(out->htim->Instance, out->channel,
+					          (d < OUT_DMA_4_NEG) ? LL_TIM_OCMODE_FORCED_ACTIVE : out4_start_mode);
+			LL_TIM_OC_SetMode(out->htim->Instance, out->channel, LL_TIM_OCMODE_TOGGLE);
+		}
+		stream->NDTR = 2*BUFFER_REPEATS;
+
+		if (out->htim == &htim2) start_tim2_dier |= out->dma_request;
+		start_streams[num_start_streams] = stream;
+		start_stream_cr[num_start_streams] = stream->CR | DMA_SxCR_EN;
+		num_start_streams++;
+	}
+	if (next->out4_handover) start_handover(next);
+	start_fire = fire;
+	start_pending = true;
 
-	// take the rise and fall times and turn them into the actual DMA and PWM
-	// prescaler values
-	__HAL_TIM_SET_COMPARE(&htim5, TIM_CHANNEL_1, out1_fall_time);
-    set_all_buffer(chan_2_out, out2_rise_time, out2_fall_time);
-    set_all_buffer(chan_3_out, out3_rise_time, out3_fall_time);
-    set_all_buffer(chan_4_out, out4_rise_time, out4_fall_time);
+	// configure out1 and out2 to the correct voltage by setting the relays.
+	// If they have to move the outputs are started once they have settled
+	if (!set_relays(next->relays_set, start_prepared_outputs))
+	{
+		start_prepared_outputs();
+	}
+}
 
-	// TODO some code to make single-shot work
+// start_prepared_outputs
+//  the end of commit_output_regs(), or called from the timer task once the
+//  relays have settled. Does nothing if the outputs were stopped since
+static void start_prepared_outputs(void)
+{
+	uint32_t irq_off_cycles;
 
-	// prime the first three outputs to start. These will not start until tim8 is started
-    __disable_irq();
-    HAL_TIM_PWM_Start(&htim5, TIM_CHANNEL_1);
-	HAL_TIM_OC_Start_DMA(&htim5, TIM_CHANNEL_2, chan_2_out, 2*BUFFER_REPEATS);
-	HAL_TIM_OC_Start_DMA(&htim5, TIM_CHANNEL_3, chan_3_out, 2*BUFFER_REPEATS);
+	// prime the outputs to start. These will not start until tim8 is started
+	__disable_irq();
+	if (!start_pending)
+	{
+		__enable_irq();
+		return;
+	}
+	irq_off_cycles = trace_now();
+	for (uint8_t s = 0; s < num_start_streams; s++)
+	{
+		start_streams[s]->CR = start_stream_cr[s];
+	}
+	htim5.Instance->DIER = start_tim5_dier;
+	htim2.Instance->DIER = start_tim2_dier;
+	htim5.Instance->CCER = TIM_CCER_CC1E | TIM_CCER_CC2E | TIM_CCER_CC3E;
+	htim2.Instance->CCER = TIM_CCER_CC3E | TIM_CCER_CC4E;
+	start_pending = false;
+	output_armed = true;
+	__enable_irq();
+	trace_record(TRACE_IRQ_OFF, irq_off_cycles);
+
+	if (start_fire) fire_output_waveform();
+}
 
-	if (target_bias_voltage_V > 0)
+// stop_outputs
+//  stops the counters, the DMA requests and the streams so the outputs can be
+//  rewritten. Output 4 is put in the state with both MOSFETs off first. The
+//  channels stay enabled and hold their levels
+static void stop_outputs(void)
+{
+	start_pending = false;
+	output_armed = false;
+	output_running = false;
+	LL_TIM_DisableCounter(htim8.Instance);
+	LL_TIM_DisableCounter(htim5.Instance);
+	LL_TIM_DisableCounter(htim2.Instance);
+	LL_TIM_OC_SetMode(htim2.Instance, LL_TIM_CHANNEL_CH3, LL_TIM_OCMODE_FORCED_INACTIVE);
+	LL_TIM_OC_SetMode(htim2.Instance, LL_TIM_CHANNEL_CH4, LL_TIM_OCMODE_FORCED_ACTIVE);
+	htim5.Instance->DIER = 0;
+	htim2.Instance->DIER = 0;
+
+	for (uint8_t d = 0; d < NUM_OUT_DMA; d++)
 	{
-		HAL_TIM_OC_Start(&htim2, TIM_CHANNEL_3);
-		HAL_TIM_OC_Start_DMA(&htim2, TIM_CHANNEL_4, chan_4_out, 2*BUFFER_REPEATS);
+		stop_stream(out_dma[d].htim->hdma[out_dma[d].dma_id]);
 	}
-	else if (target_bias_voltage_V < 0)
+	halt_bias_table();
+}
+
+// stop_stream
+//  disables a DMA stream, waits for it to finish the transfer it is in the
+//  middle of and clears its flags
+static void stop_stream(DMA_HandleTypeDef* hdma)
+{
+	hdma->Instance->CR &= ~DMA_SxCR_EN;
+	while (hdma->Instance->CR & DMA_SxCR_EN);
+
+	// the HAL worked out where the flags of the stream are when it set it up
+	*(volatile uint32_t*)(hdma->StreamBaseAddress + 8) = 0x3FUL << hdma->StreamIndex;
+}
+
+// setup_output_dma
+//  points the output streams at their compare registers and buffers once,
+//  after that a restart only reloads the transfer counts. Only the output 2
+//  stream interrupts, to count the pulses as its buffer wraps
+static void setup_output_dma(void)
+{
+	for (uint8_t d = 0; d < NUM_OUT_DMA; d++)
 	{
-		HAL_TIM_OC_Start(&htim2, TIM_CHANNEL_4);
-		HAL_TIM_OC_Start_DMA(&htim2, TIM_CHANNEL_3, chan_4_out, 2*BUFFER_REPEATS);
+		DMA_Stream_TypeDef* stream = out_dma[d].htim->hdma[out_dma[d].dma_id]->Instance;
+		stream->CR &= ~(DMA_SxCR_EN | DMA_SxCR_TCIE | DMA_SxCR_HTIE | DMA_SxCR_TEIE | DMA_SxCR_DMEIE);
+		stream->PAR = (uint32_t)out_dma[d].ccr;
+		stream->M0AR = (uint32_t)out_dma[d].buffer;
 	}
-	else
+
+	DMA_HandleTypeDef* hdma = out_dma[OUT_DMA_2].htim->hdma[out_dma[OUT_DMA_2].dma_id];
+	hdma->XferCpltCallback = out2_buffer_wrapped;
+	hdma->Instance->CR |= DMA_SxCR_TCIE;
+
+	// the bias table streams, the DAC codes and the tim2 modes written on the
+	// tim5 channel 4 compare
+	hdac.DMA_Handle1->Instance->PAR = (uint32_t)&hdac.Instance->DHR12R1;
+	DMA_Stream_TypeDef* stream = htim5.hdma[TIM_DMA_ID_CC4]->Instance;
+	stream->CR &= ~(DMA_SxCR_EN | DMA_SxCR_TCIE | DMA_SxCR_HTIE | DMA_SxCR_TEIE | DMA_SxCR_DMEIE);
+	stream->PAR = (uint32_t)&htim2.Instance->CCMR2;
+	stream->M0AR = (uint32_t)out4_modes;
+
+	// the readback trigger, one rising edge of the reference at every compare
+	LL_TIM_OC_SetMode(htim2.Instance, LL_TIM_CHANNEL_CH2, LL_TIM_OCMODE_PWM2);
+
+	LL_DAC_Enable(hdac.Instance, LL_DAC_CHANNEL_1);
+	output_dma_ready = true;
+}
+
+// out2_buffer_wrapped
+//  transfer complete of the output 2 stream
+static void out2_buffer_wrapped(DMA_HandleTypeDef* hdma)
+{
+	pulses_emitted += BUFFER_REPEATS;
+}
+
+// start_bias_table
+//  steps output 4 through a table of bias voltages in mV while the outputs
+//  run, holding each one for pulses_per_step pulses. The DAC takes the next
+//  code from DMA at every tim5 update, so the steps stay locked to the pulses
+//  with no interrupts. A circular table repeats until stopped, a one-pass
+//  table ends on the configured bias. A step of 0 is 0V on the MOSFET of the
+//  configured bias, or output 4 off if that is 0.
+//  A table that only has the sign of the configured bias is started in
+//  place. Any other sign needs output 4 handed between the MOSFETs, which
+//  starts the outputs over from the top of the period, see start_handover()
+OUTPUT_ERROR_t start_bias_table(const int16_t* bias_mV, uint16_t num_steps,
+		                        uint16_t pulses_per_step, bool circular)
+{
+	uint32_t num_codes = (uint32_t)num_steps * pulses_per_step;
+	if (num_codes == 0 || num_codes > BIAS_TABLE_MAX_CODES || num_steps > BIAS_TABLE_MAX_STEPS) return OUT_BAD_RANGE;
+	if (!output_running) return OUT_NOT_READY;
+
+	int8_t sign = (live_regs.out4_dma == OUT_DMA_4_POS) ? 1 : (live_regs.out4_dma == OUT_DMA_4_NEG) ? -1 : 0;
+	bool handover = live_regs.out4_handover;
+	for (uint16_t s = 0; s < num_steps; s++)
 	{
-		HAL_TIM_OC_Start(&htim2, TIM_CHANNEL_3);
-		HAL_TIM_OC_Start(&htim2, TIM_CHANNEL_4);
+		int8_t step_sign = (bias_mV[s] > 0) - (bias_mV[s] < 0);
+		if (step_sign != 0 && step_sign != sign) handover = true;
 	}
+	if (handover && (live_regs.out4[0] / 2 < OUT4_HANDOVER_MIN_100ns || (!circular && num_codes < 2))) return OUT_BAD_RANGE;
 
-	HAL_TIM_Base_Start(&htim8);
-	__enable_irq();
+	// the buffers are only rewritten once nothing reads them
+	if (handover) stop_outputs();
+	else halt_bias_table();
+	out4_trim = 0;
+
+	uint32_t c = 0;
+	for (uint16_t s = 0; s < num_steps; s++)
+	{
+		int8_t step_sign = (bias_mV[s] > 0) - (bias_mV[s] < 0);
+		if (step_sign == 0) step_sign = sign;
+		uint16_t code = dac_cal_code(bias_mV[s], step_sign);
+		uint32_t mode = out4_mode_word(step_sign);
+		for (uint16_t p = 0; p < pulses_per_step; p++)
+		{
+			bias_codes[c] = code;
+			out4_modes[c] = mode;
+			c++;
+		}
+	}
+	// after the last pulse, the first ones again or the configured bias. A
+	// handover reads one code further ahead, see start_handover()
+	bias_codes[c] = circular ? bias_codes[0] : live_regs.dac_value;
+	bias_codes[c + 1] = bias_codes[1];
+	out4_modes[c] = out4_mode_word(sign);
+
+	if (handover)
+	{
+		handover_codes = num_codes;
+		handover_circular = circular;
+		handover_first_sign = (bias_mV[0] > 0) - (bias_mV[0] < 0);
+		if (handover_first_sign == 0) handover_first_sign = sign;
+
+		OUTPUT_REGS_t next = live_regs;
+		next.out4_handover = true;
+		commit_output_regs(&next, true);
+		return OUT_SUCCESS;
+	}
+
+	// at every update the DAC moves the code in its holding register to the
+	// output and only then asks the DMA for the next one. The first code is
+	// written by hand and the stream runs from the second
+	load_bias_stream(bias_codes + 1, num_codes, circular);
+	bias_table_running = true;
+	hdac.DMA_Handle1->Instance->CR |= DMA_SxCR_EN;
+	LL_DAC_ConvertData12RightAligned(hdac.Instance, LL_DAC_CHANNEL_1, bias_codes[0]);
+	LL_DAC_EnableDMAReq(hdac.Instance, LL_DAC_CHANNEL_1);
 
 	return OUT_SUCCESS;
 }
 
-// disable_all_outputs
-//  Turns off and resets all outputs
-void disable_all_outputs(void)
+// start_handover
+//  the part of commit_output_regs() for a table that swaps the output 4
+//  channels, with the timers stopped. Both channels get their edge times
+//  from DMA so either can take over at any pulse, and tim5 channel 4 has a
+//  third stream write the modes of both into the tim2 CCMR2 half way to the
+//  output 4 rise. Both MOSFETs are off from the fall of one pulse to the rise
+//  of the next, so the one going off has been off since the last fall and the
+//  one taking over only turns on at the rise, all without the CPU. The DAC
+//  takes the code for the pulse at the update before, in the same gap
+static void start_handover(const OUTPUT_REGS_t* next)
 {
-	// TODO something to wait for the sequence to end
+	htim5.Instance->CCR4 = next->out4[0] / 2;
+
+	// the first code went out with the update made by commit_output_regs(),
+	// the second goes out at the end of the first period and the stream
+	// runs from the third
+	LL_DAC_ConvertData12RightAligned(hdac.Instance, LL_DAC_CHANNEL_1, bias_codes[1]);
+	load_bias_stream(bias_codes + 2, handover_circular ? handover_codes : handover_codes - 1, handover_circular);
+	hdac.DMA_Handle1->Instance->CR |= DMA_SxCR_EN;
+	LL_DAC_EnableDMAReq(hdac.Instance, LL_DAC_CHANNEL_1);
+
+	// the first mode is already on tim2, the stream writes it again in the
+	// first period and goes on from there
+	DMA_Stream_TypeDef* stream = htim5.hdma[TIM_DMA_ID_CC4]->Instance;
+	stream->NDTR = handover_circular ? handover_codes : handover_codes + 1;
+	if (handover_circular)
+	{
+		stream->CR |= DMA_SxCR_CIRC;
+	}
+	else
+	{
+		stream->CR &= ~DMA_SxCR_CIRC;
+	}
+	stream->CR |= DMA_SxCR_EN;
 
-	__disable_irq();
-	HAL_TIM_Base_Stop(&htim5);
-	HAL_TIM_Base_Stop(&htim2);
-	HAL_TIM_Base_Stop(&htim8);
-	HAL_TIM_PWM_Stop(&htim5, TIM_CHANNEL_1);
-	HAL_TIM_OC_Stop_DMA(&htim5, TIM_CHANNEL_2);
-	HAL_TIM_OC_Stop_DMA(&htim5, TIM_CHANNEL_3);
-	HAL_TIM_OC_Stop_DMA(&htim2, TIM_CHANNEL_3);
-	HAL_TIM_OC_Stop_DMA(&htim2, TIM_CHANNEL_4);
-//	HAL_DAC_Stop(&hdac, DAC_CHANNEL_1);
-	__enable_irq();
+	start_tim5_dier |= TIM_DIER_CC4DE;
+	bias_table_running = true;
 }
 
+// load_bias_stream
+//  points the DAC stream at the codes of a table, ready to be enabled
+static void load_bias_stream(const uint16_t* codes, uint32_t num_codes, bool circular)
+{
+	DMA_HandleTypeDef* hdma = hdac.DMA_Handle1;
+	DMA_Stream_TypeDef* stream = hdma->Instance;
+	stream->M0AR = (uint32_t)codes;
+	stream->NDTR = num_codes;
+	stream->CR &= ~(DMA_SxCR_CIRC | DMA_SxCR_TCIE | DMA_SxCR_HTIE | DMA_SxCR_TEIE | DMA_SxCR_DMEIE);
+	if (circular)
+	{
+		stream->CR |= DMA_SxCR_CIRC;
+	}
+	else
+	{
+		// the only interrupt, to hand the DAC back once the table has run out
+		hdma->XferCpltCallback = bias_table_done;
+		stream->CR |= DMA_SxCR_TCIE;
+	}
+}
+
+// stop_bias_table
+//  goes back to the configured bias at the next period boundary. If the
+//  table had output 4 on the other MOSFET the outputs are started over
+void stop_bias_table(void)
+{
+	if (!bias_table_running) return;
+
+	if (output_running && live_regs.out4_handover)
+	{
+		OUTPUT_REGS_t next = live_regs;
+		next.out4_handover = false;
+		commit_output_regs(&next, true);
+		return;
+	}
+	halt_bias_table();
+}
+
+// halt_bias_table
+//  stops the table streams and puts the configured bias back in the DAC
+//  holding register. The tim2 modes are left as they are
+static void halt_bias_table(void)
+{
+	LL_DAC_DisableDMAReq(hdac.Instance, LL_DAC_CHANNEL_1);
+	stop_stream(hdac.DMA_Handle1);
+	stop_stream(htim5.hdma[TIM_DMA_ID_CC4]);
+	LL_DAC_ConvertData12RightAligned(hdac.Instance, LL_DAC_CHANNEL_1, out4_trimmed_code());
+	bias_table_running = false;
+}
+
+// is_bias_table_running
+bool is_bias_table_running(void)
+{
+	return bias_table_running;
+}
+
+// get_out4_bias
+//  the bias output 4 is held at, the calibrated DAC code for it and the trim
+//  on top of that. Returns false if output 4 is not at a steady bias: the
+//  outputs are stopped, there is no bias or a bias table is running
+bool get_out4_bias(int16_t* bias_mV, uint16_t* code, int32_t* trim_codes)
+{
+	if (!output_running || bias_table_running || live_regs.out4_dma == OUT_DMA_NONE) return false;
+
+	*bias_mV = live_regs.bias_mV;
+	*code = live_regs.dac_value;
+	*trim_codes = out4_trim;
+	return true;
+}
+
+// trim_out4_bias
+//  moves the DAC a few codes off the calibrated code of the bias, for the
+//  readback loop in out4_sense.c. Like any DAC write it goes out at the next
+//  period boundary. The trim is kept when the outputs are restarted with the
+//  same bias, and dropped by a new bias or a bias table
+bool trim_out4_bias(int32_t trim_codes)
+{
+	if (!output_running || bias_table_running || live_regs.out4_dma == OUT_DMA_NONE) return false;
+
+	out4_trim = trim_codes;
+	LL_DAC_ConvertData12RightAligned(hdac.Instance, LL_DAC_CHANNEL_1, out4_trimmed_code());
+	return true;
+}
+
+// out4_trimmed_code
+//  the configured bias code with the readback trim on it
+static uint32_t out4_trimmed_code(void)
+{
+	int32_t code = (int32_t)live_regs.dac_value + out4_trim;
+	if (code < 0) code = 0;
+	if (code > DAC_CAL_MAX_CODE) code = DAC_CAL_MAX_CODE;
+	return code;
+}
+
+// bias_table_done
+//  transfer complete of a one-pass table. The configured bias is already in
+//  the DAC holding register and goes out at the next update. During a
+//  handover the last mode is written by its stream one pulse later
+static void bias_table_done(DMA_HandleTypeDef* hdma)
+{
+	LL_DAC_DisableDMAReq(hdac.Instance, LL_DAC_CHANNEL_1);
+	bias_table_running = false;
+}
+
+// set_neopixel
+//  sets the color of one LED for the next frame. Can be called at any time,
+//  it shows up once send_neo_led_sequence is called
 int8_t set_neopixel(uint8_t led_num, uint8_t red, uint8_t grn, uint8_t blu)
 {
-	// make sure the last send is done before modifying
-	if (!send_done) return OUT_NOT_READY;
 	if (led_num >= NUM_NEO_LEDS) return OUT_BAD_RANGE;
 
 	// these LEDs are in the opposite order of the outputs
 	led_num = NUM_NEO_LEDS - led_num - 1;
 
 	// pack the color into one bit sequence
-	uint32_t bits = (uint32_t)grn << 16 | (uint32_t)red << 8 | blu;
-
-	uint16_t* this_bit = neo_out + (led_num*NEO_BUFFER_SIZE_PER_LED);
-	for (int8_t c = NEO_BUFFER_SIZE_PER_LED-1; c >= 0; c--)
-	{
-		*this_bit = (bits & (0b1 << c)) ? HIGH_BIT_FALL_TIME_50ns: LOW_BIT_FALL_TIME_50ns;
-		this_bit++;
-	}
+	neo_colors[led_num] = (uint32_t)grn << 16 | (uint32_t)red << 8 | blu;
 
 	return OUT_SUCCESS;
 }
 
-
+// send_neo_led_sequence
+//  sends the colors set so far. If a frame is still going out the latest
+//  colors are sent as soon as it is done, and nothing is sent at all if the
+//  LEDs already show them
 void send_neo_led_sequence(void)
 {
-	// make sure the sending is done
-	if (!send_done) return;
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	neo_frame_pending = true;
+	if (!neo_sending) start_neo_frame();
+	__set_PRIMASK(primask);
+}
+
+// start_neo_frame
+//  encodes the current colors and starts the DMA. Called with the interrupts
+//  off from send_neo_led_sequence, or from the interrupt at the end of the
+//  last frame
+static void start_neo_frame(void)
+{
+	neo_frame_pending = false;
+	if (neo_shown_valid && memcmp(neo_shown, neo_colors, sizeof(neo_shown)) == 0) return;
+	memcpy(neo_shown, neo_colors, sizeof(neo_shown));
+	neo_shown_valid = true;
+
+	uint16_t* this_bit = neo_out;
+	for (uint8_t led = 0; led < NUM_NEO_LEDS; led++)
+	{
+		for (int8_t c = NEO_BUFFER_SIZE_PER_LED-1; c >= 0; c--)
+		{
+			*this_bit = (neo_shown[led] & (0b1 << c)) ? HIGH_BIT_FALL_TIME_50ns: LOW_BIT_FALL_TIME_50ns;
+			this_bit++;
+		}
+	}
 
-	// make sure the first value in the preload register is 0 to ensure there is
-	// no effect from the first cycle before the DMA kicks in
+	// back to one update per bit, loaded right away with the update event.
+	// Make sure the first value in the preload register is 0 to ensure there
+	// is no effect from the first cycle before the DMA kicks in
+	htim1.Instance->CR1 &= ~TIM_CR1_OPM;
+	htim1.Instance->RCR = 0;
 	htim1.Instance->CCR1 = 0;
 	htim1.Instance->CNT = 0;
+	htim1.Instance->EGR = TIM_EGR_UG;
+	__HAL_TIM_CLEAR_FLAG(&htim1, TIM_FLAG_UPDATE);
 
+	neo_gap_counting = false;
+	neo_sending = true;
 	HAL_TIM_PWM_Start_DMA(&htim1, TIM_CHANNEL_1, (uint32_t*)neo_out, TOTAL_NEO_BUFFER_SIZE);
-	send_done = false;
 }
 
-void HAL_TIM_PWM_PulseFinishedCallback(TIM_HandleTypeDef *htim)
+// neo_period_elapsed
+//  update interrupt of tim1 during the reset gap. The first one is the update
+//  that starts the gap, which has loaded the repetition counter, so from there
+//  the timer counts the gap as one period and stops itself at its end. Only
+//  that second update finishes the frame and lets a pending one start
+void neo_period_elapsed(void)
 {
-	if (htim == &htim1)
+	if (!neo_gap_counting)
 	{
-		HAL_TIM_PWM_Stop_DMA(htim, TIM_CHANNEL_1);
-		send_done = true;
+		htim1.Instance->CR1 |= TIM_CR1_OPM;
+		neo_gap_counting = true;
+		return;
 	}
+	if (htim1.Instance->CR1 & TIM_CR1_CEN) return;
 
+	__HAL_TIM_DISABLE_IT(&htim1, TIM_IT_UPDATE);
+	neo_gap_counting = false;
+	neo_sending = false;
+	if (neo_frame_pending) start_neo_frame();
 }
 
-// set_out4_voltage
-//  sets the voltage for output 4 using the DA
-static OUTPUT_ERROR_t set_out4_voltage(float voltage)
+// get_pulses_emitted
+//  total number of pulses put out since boot. Counted in chunks of
+//  BUFFER_REPEATS as the DMA buffer wraps
+uint32_t get_pulses_emitted(void)
 {
-	// TODO configure correctly with the gain. Clamp for now
-	if (voltage < -3.3) voltage = -3.3;
-	if (voltage > 3.3) voltage = 3.3;
+	return pulses_emitted;
+}
 
-	if (voltage < 0)
-	{
-		voltage *= -1;
-	}
-	else
+void HAL_TIM_PWM_PulseFinishedCallback(TIM_HandleTypeDef *htim)
+{
+	if (htim == &htim1)
 	{
-		voltage = 3.3f - voltage;
+		// the trailing zero has just gone into the preload register and the
+		// output is left running at 0. The next update loads the gap into the
+		// repetition counter, and the one-pulse mode can only be set after
+		// that or it would stop the timer at that same update, see
+		// neo_period_elapsed
+		__HAL_TIM_DISABLE_DMA(htim, TIM_DMA_CC1);
+		htim->Instance->RCR = NEO_RESET_PERIODS - 1;
+		__HAL_TIM_CLEAR_FLAG(htim, TIM_FLAG_UPDATE);
+		__HAL_TIM_ENABLE_IT(htim, TIM_IT_UPDATE);
 	}
-	HAL_DAC_SetValue(&hdac, DAC_CHANNEL_1, DAC_ALIGN_12B_R, voltage*4096/3.3);
-	HAL_DAC_Start(&hdac, DAC_CHANNEL_1);
-	return OUT_SUCCESS;
 }
 
 // set_all_buffer
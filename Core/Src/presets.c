@@ -0,0 +1,112 @@
+// presets.c
+//  a bank of named configurations kept in flash. The bank is read in place
+//  from the preset journal, so switching to a preset only reads its plan out
+//  of flash and a save writes a new copy of the whole bank
+
+#include "presets.h"
+#include "config_journal.h"
+#include <string.h>
+
+static JOURNAL_t preset_journal = JOURNAL_INIT(PRESET_JOURNAL_START, PRESET_JOURNAL_SECTOR, sizeof(PRESET_BANK_t));
+
+// a save builds the new bank here, too big for the main task stack
+static PRESET_BANK_t new_bank;
+
+// get_preset
+//  the stored preset, or NULL if the slot is empty
+const PRESET_t* get_preset(uint8_t slot)
+{
+	const PRESET_BANK_t* bank = journal_latest(&preset_journal);
+	if (bank == NULL || slot >= NUM_PRESETS || !(bank->used & (1 << slot))) return NULL;
+	return bank->presets + slot;
+}
+
+// get_preset_plan
+//  the stored plan of a preset, or NULL if the slot is empty or the plan was
+//  worked out by older firmware and has to be redone from the settings.
+//  Points into the journal, so it is only good until the next save
+const OUTPUT_PLAN_t* get_preset_plan(uint8_t slot)
+{
+	const PRESET_BANK_t* bank = journal_latest(&preset_journal);
+	const PRESET_t* preset = get_preset(slot);
+	if (preset == NULL || bank->plan_version != OUTPUT_PLAN_VERSION) return NULL;
+	return &preset->plan;
+}
+
+// next_preset
+//  the first used slot after the one given, wrapping around. -1 starts from
+//  the first slot. Returns -1 if the bank is empty
+int8_t next_preset(int8_t slot)
+{
+	for (uint8_t n = 1; n <= NUM_PRESETS; n++)
+	{
+		int8_t next = (slot + n) % NUM_PRESETS;
+		if (next < 0) next += NUM_PRESETS;
+		if (get_preset(next) != NULL) return next;
+	}
+	return -1;
+}
+
+// plan_preset
+//  works out the plan from the settings of the preset. The frequency is in
+//  Hz and the bias in mV, the same as the settings on the menu
+static OUTPUT_ERROR_t plan_preset(PRESET_t* preset)
+{
+	if (preset->freq <= 0) return OUT_BAD_RANGE;
+	return plan_output_waveform(10000000UL / preset->freq, preset->out_mode, preset->out_voltage,
+			                    preset->bias, false, &preset->plan);
+}
+
+// save_preset
+//  stores the settings of the preset in the slot and works out its plan.
+//  Plans left by older firmware are redone while the bank is rewritten
+bool save_preset(uint8_t slot, const PRESET_t* preset)
+{
+	if (slot >= NUM_PRESETS) return false;
+
+	const PRESET_BANK_t* bank = journal_latest(&preset_journal);
+	if (bank != NULL)
+	{
+		memcpy(&new_bank, bank, sizeof(new_bank));
+	}
+	else
+	{
+		memset(&new_bank, 0, sizeof(new_bank));
+	}
+	memcpy(new_bank.presets + slot, preset, sizeof(PRESET_t));
+	new_bank.used |= 1 << slot;
+
+	for (uint8_t p = 0; p < NUM_PRESETS; p++)
+	{
+		if (!(new_bank.used & (1 << p))) continue;
+		if (p != slot && new_bank.plan_version == OUTPUT_PLAN_VERSION) continue;
+		if (plan_preset(new_bank.presets + p) != OUT_SUCCESS) new_bank.used &= ~(1 << p);
+	}
+	new_bank.plan_version = OUTPUT_PLAN_VERSION;
+
+	return journal_save(&preset_journal, &new_bank) && (new_bank.used & (1 << slot));
+}
+
+// send_preset
+//  answers CMD_PRESET_GET on the transport that asked
+void send_preset(SERIAL_TRANSPORT_t transport, uint8_t slot)
+{
+	PRESET_RECORD_t record = {0};
+	const PRESET_t* preset = get_preset(slot);
+
+	record.type = PRESET_RECORD_TYPE;
+	record.slot = slot;
+	if (preset != NULL)
+	{
+		record.used = 1;
+		memcpy(record.name, preset->name, PRESET_NAME_LEN);
+		record.freq = preset->freq;
+		record.bias = preset->bias;
+		record.out_mode = preset->out_mode;
+		record.out_voltage = preset->out_voltage;
+	}
+
+	sendFrame(transport, (const uint8_t*)&record, sizeof(record), true);
+}
+
+// End of presets.c
@@ -0,0 +1,115 @@
+// relays.c
+//  keeps track of the output 1 and 2 voltage relays. The contacts are only
+//  moved when the state asked for differs from the one they are in, and the
+//  caller is told through a one-shot timer once they have settled, so nothing
+//  has to wait on them. The operations are counted for wear tracking
+
+#include "relays.h"
+#include "main.h"
+#include "cmsis_os.h"
+#include "stm32f7xx_ll_gpio.h"
+
+static void relay_settle_done(void const* argument);
+
+static osStaticTimerDef_t relay_settle_control;
+osTimerStaticDef(relay_settle, relay_settle_done, &relay_settle_control);
+static osTimerId relay_settle_timer = NULL;
+
+// the pins are reset by MX_GPIO_Init, so that is the state at boot
+static bool relays_set = false;
+static volatile bool relays_settling = false;
+static volatile RELAY_SETTLED_t settled_callback = NULL;
+static volatile uint32_t switch_tick = 0;
+
+// both relays always switch together, so this is the count of each
+static uint32_t relay_ops = 0;
+
+// set_relays
+//  moves both relays to the state if they are not in it already. Returns
+//  true if the contacts are still moving, settled is then called from the
+//  timer task once they have settled. Returns false if they are already in
+//  place, settled is not called in that case
+bool set_relays(bool set, RELAY_SETTLED_t settled)
+{
+	if (set == relays_set)
+	{
+		// the timer task could run in between the check and the callback being
+		// set, and it would never be called
+		uint32_t primask = __get_PRIMASK();
+		__disable_irq();
+		bool settling = relays_settling;
+		if (settling) settled_callback = settled;
+		__set_PRIMASK(primask);
+		return settling;
+	}
+
+	// created on first use, this can be called before the scheduler starts
+	if (relay_settle_timer == NULL)
+	{
+		relay_settle_timer = osTimerCreate(osTimer(relay_settle), osTimerOnce, NULL);
+	}
+
+	if (set)
+	{
+		LL_GPIO_SetOutputPin(RELAY_1_GPIO_Port, RELAY_1_Pin);
+		LL_GPIO_SetOutputPin(RELAY_2_GPIO_Port, RELAY_2_Pin);
+	}
+	else
+	{
+		LL_GPIO_ResetOutputPin(RELAY_1_GPIO_Port, RELAY_1_Pin);
+		LL_GPIO_ResetOutputPin(RELAY_2_GPIO_Port, RELAY_2_Pin);
+	}
+	relays_set = set;
+	relay_ops++;
+
+	switch_tick = osKernelSysTick();
+	relays_settling = true;
+	settled_callback = settled;
+	osTimerStart(relay_settle_timer, RELAY_SETTLE_ms);
+	return true;
+}
+
+// are_relays_settling
+//  true from a switch until RELAY_SETTLE_ms after it
+bool are_relays_settling(void)
+{
+	return relays_settling;
+}
+
+// get_relay_ops
+//  operations of each relay, including the ones from before the last reset
+//  if they were put back with restore_relay_ops()
+uint32_t get_relay_ops(void)
+{
+	return relay_ops;
+}
+
+// restore_relay_ops
+//  adds the count saved before the reset
+void restore_relay_ops(uint32_t ops)
+{
+	relay_ops += ops;
+}
+
+// relay_settle_done
+//  the one-shot timer, runs in the timer task
+static void relay_settle_done(void const* argument)
+{
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+
+	// an expiry from before a second switch, the restarted timer comes next
+	if (osKernelSysTick() - switch_tick < RELAY_SETTLE_ms)
+	{
+		__set_PRIMASK(primask);
+		return;
+	}
+	relays_settling = false;
+	RELAY_SETTLED_t settled = settled_callback;
+	settled_callback = NULL;
+	__set_PRIMASK(primask);
+
+	if (settled != NULL) settled();
+}
+
+// End of relays.c
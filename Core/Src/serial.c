@@ -9,10 +9,17 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <string.h>
 #include "usbd_cdc_if.h"
 #include "main_task.h"
 #include "user_input.h"
 #include "serial.h"
+#include "telemetry.h"
+#include "diagnostics.h"
+#include "uart_serial.h"
+#include "outputs.h"
+#include "presets.h"
+#include "dac_cal.h"
 #include "cmsis_os.h"
 
 #define BUFFER_SIZE 		250
@@ -20,14 +27,69 @@
 #define ESCAPE              0x7D
 #define XOR_VALUE           0x20
 
+// outgoing frames are escaped into one of two buffers per transport. One is
+// filled by the tasks while the peripheral sends the other, so nobody waits
+// on the host
+#define TX_BUFFER_SIZE      512
+#define USB_FS_PACKET_SIZE  64
+#define TX_FLUSH_TIMEOUT_MS 5
+
+// each transport gets its own frame parser so bytes from the USB and the
+// UART can never end up mixed into one frame
+typedef struct
+{
+	SERIAL_TRANSPORT_t transport;
+	uint8_t recvBuffer[BUFFER_SIZE];
+	uint32_t recvIdx;
+	bool discarding;  // a frame overflowed the buffer, drop bytes up to its end
+} FRAME_PARSER_t;
+
+typedef struct
+{
+	uint8_t buffers[2][TX_BUFFER_SIZE];
+	uint8_t active;          // buffer currently being filled
+	uint32_t fill;           // bytes waiting in the active buffer
+	uint32_t firstByteTick;  // when the oldest waiting byte was added
+	bool force;              // send a partial packet on the next flush
+	uint32_t packetSize;     // only send multiples of this unless forced
+	uint8_t (*transmit)(uint8_t* buf, uint16_t len); // returns 0 once the transfer has started
+} TX_CHANNEL_t;
+
 
 extern osMessageQId vComHandle;
 extern SETTING_t settings[NUM_SETTINGS];
 extern bool pending_gui_change;
+extern bool trigger_armed;
+extern volatile bool trigger_fired;
+extern volatile int16_t pending_ack_seq;
+extern volatile int8_t pending_preset_select;
+extern volatile int8_t pending_preset_save;
+extern char pending_preset_name[PRESET_NAME_LEN];
+extern int16_t bias_table_mV[BIAS_TABLE_MAX_STEPS];
+extern uint16_t bias_table_steps;
+extern uint16_t bias_table_pulses;
+extern bool bias_table_circular;
+extern volatile bool pending_bias_table_start;
+extern volatile bool pending_bias_table_stop;
+extern volatile bool pending_dac_cal_save;
+
+
+
+static FRAME_PARSER_t parsers[NUM_TRANSPORTS] =
+{
+		{ .transport = TRANSPORT_USB },
+		{ .transport = TRANSPORT_UART }
+};
 
+static TX_CHANNEL_t txChannels[NUM_TRANSPORTS] =
+{
+		{ .packetSize = USB_FS_PACKET_SIZE, .transmit = CDC_Transmit_FS },
+		{ .packetSize = 1, .transmit = uartSerialTransmit }
+};
+uint32_t txDroppedFrames = 0;
 
-
-uint8_t recvBuffer[BUFFER_SIZE];
+static void parseByte(FRAME_PARSER_t* parser, uint8_t byte);
+static void flushTxBuffer(TX_CHANNEL_t* channel);
 
 uint32_t decodeFrame(uint8_t* decoded, uint8_t* encoded, uint32_t numBytes)
 {
@@ -118,20 +180,131 @@ size_t escape_data(const uint8_t *input_data, size_t input_length, uint8_t *esca
 
 
 
-void parseMessage(uint8_t *encoded, uint32_t encodedBytes)
+// parseMessage
+//  the command dispatcher shared by all of the transports
+void parseMessage(uint8_t *encoded, uint32_t encodedBytes, SERIAL_TRANSPORT_t transport)
 {
-    // Allocate a buffer for the decoded array
-    uint8_t msg[BUFFER_SIZE] = { 0 };
-
-    // Decode the array
+    // Decode the array in place. The decoded frame is never longer than the
+    // encoded one, so each byte is written at or behind where it was read
+    uint8_t* msg = encoded;
     uint32_t numBytes = decodeFrame(msg, encoded, encodedBytes);
 
-    if (numBytes == 1 && msg[0] == 0xAA)
+    if (numBytes == 1 && msg[0] == CMD_QUERY_CONFIG)
     {
     	sendCurrentConfiguration();
     }
 
-    if (numBytes != 9)
+    if (numBytes == 1 && msg[0] == CMD_ARM)
+    {
+    	// the main task does the arming so the timers are only touched from one place
+    	trigger_armed = true;
+    	pending_gui_change = true;
+    	return;
+    }
+
+    if (numBytes == 1 && msg[0] == CMD_TRIGGER)
+    {
+    	// only reaches here if it came from the UART or was not its own USB packet
+    	if (fire_output_waveform()) trigger_fired = true;
+    	return;
+    }
+
+    if (numBytes == 1 && msg[0] == CMD_DIAGNOSTICS)
+    {
+    	send_diagnostics(transport);
+    	return;
+    }
+
+    if (numBytes == 2 && msg[0] == CMD_PRESET_SELECT && msg[1] < NUM_PRESETS)
+    {
+    	// the main task switches, it is the one that owns the outputs
+    	pending_preset_select = msg[1];
+    	return;
+    }
+
+    // always padded to the full name length so it can not be taken for a
+    // configuration frame
+    if (numBytes == 2 + PRESET_NAME_LEN && msg[0] == CMD_PRESET_SAVE && msg[1] < NUM_PRESETS)
+    {
+    	memcpy(pending_preset_name, &msg[2], PRESET_NAME_LEN);
+    	pending_preset_save = msg[1];
+    	return;
+    }
+
+    if (numBytes == 2 && msg[0] == CMD_PRESET_GET && msg[1] < NUM_PRESETS)
+    {
+    	send_preset(transport, msg[1]);
+    	return;
+    }
+
+    // always a whole chunk, for the same reason
+    if (numBytes == 3 + 2 * BIAS_TABLE_CHUNK && msg[0] == CMD_BIAS_TABLE_LOAD)
+    {
+    	uint16_t first = msg[2] << 8 | msg[1];
+    	for (uint8_t s = 0; s < BIAS_TABLE_CHUNK && first + s < BIAS_TABLE_MAX_STEPS; s++)
+    	{
+    		bias_table_mV[first + s] = (int16_t)(msg[4 + 2*s] << 8 | msg[3 + 2*s]);
+    	}
+    	return;
+    }
+
+    if (numBytes == 6 && msg[0] == CMD_BIAS_TABLE_START)
+    {
+    	// the main task starts it, it is the one that owns the outputs
+    	bias_table_steps = msg[2] << 8 | msg[1];
+    	bias_table_pulses = msg[4] << 8 | msg[3];
+    	bias_table_circular = (msg[5] != 0);
+    	pending_bias_table_start = true;
+    	return;
+    }
+
+    if (numBytes == 1 && msg[0] == CMD_BIAS_TABLE_STOP)
+    {
+    	pending_bias_table_stop = true;
+    	return;
+    }
+
+    if (numBytes == 4 && msg[0] == CMD_DAC_CAL_HOLD)
+    {
+    	// the main task puts it on the output with an update
+    	dac_cal_hold(msg[1], msg[3] << 8 | msg[2]);
+    	pending_gui_change = true;
+    	return;
+    }
+
+    // always all of the points, zero padded
+    if (numBytes == 3 + 4 * DAC_CAL_MAX_POINTS && msg[0] == CMD_DAC_CAL_LOAD)
+    {
+    	DAC_CAL_POINT_t points[DAC_CAL_MAX_POINTS];
+    	for (uint8_t p = 0; p < DAC_CAL_MAX_POINTS; p++)
+    	{
+    		points[p].mV = msg[4 + 4*p] << 8 | msg[3 + 4*p];
+    		points[p].code = msg[6 + 4*p] << 8 | msg[5 + 4*p];
+    	}
+    	dac_cal_stage(msg[1], points, msg[2]);
+    	return;
+    }
+
+    if (numBytes == 1 && msg[0] == CMD_DAC_CAL_SAVE)
+    {
+    	// the main task does the flash write
+    	pending_dac_cal_save = true;
+    	return;
+    }
+
+    if (numBytes == 2 && msg[0] == CMD_DAC_CAL_GET)
+    {
+    	send_dac_cal(transport, msg[1]);
+    	return;
+    }
+
+    if (numBytes == 3 && msg[0] == CMD_TELEMETRY)
+    {
+    	set_telemetry_rate(msg[2] << 8 | msg[1], transport);
+    	return;
+    }
+
+    if (numBytes != CONFIG_FRAME_SIZE && numBytes != CONFIG_SEQ_FRAME_SIZE)
     {
         return;
     }
@@ -140,6 +313,10 @@ void parseMessage(uint8_t *encoded, uint32_t encodedBytes)
     bool onTime = (msg[4] == 0x00);
     bool outVoltage = (msg[5] != 0x00);
     int32_t biasVRaw = (msg[7] << 8 | msg[6]) - 5000;
+    // the frame can carry +-5V, only what the bias setting allows is taken so
+    // the echo shows the bias that is on the output
+    if (biasVRaw < settings[3].info->min) biasVRaw = settings[3].info->min;
+    if (biasVRaw > settings[3].info->max) biasVRaw = settings[3].info->max;
     bool running = (msg[8] != 0x00);
     settings[0].cont_value = (int32_t)freqCount;
     settings[1].toggle_value = onTime;
@@ -148,13 +325,18 @@ void parseMessage(uint8_t *encoded, uint32_t encodedBytes)
     settings[4].toggle_value = running;
     INPUTS_t events = {0};
     handle_input_events(&events);
+    if (numBytes == CONFIG_SEQ_FRAME_SIZE)
+    {
+    	// the main task echoes this once it has updated the outputs
+    	pending_ack_seq = msg[9];
+    }
     pending_gui_change = true;
 }
 
-void sendCurrentConfiguration()
+// packConfiguration
+//  fills in the 9 byte configuration frame from the settings
+static void packConfiguration(uint8_t* curConfig)
 {
-	uint8_t curConfig[200] = {0};
-	uint8_t escapedCurConfig[200] = {0};
 	// Cast to unsigned to deal with sign extension
 	uint32_t freqCount = (uint32_t)settings[0].cont_value;
 
@@ -168,38 +350,168 @@ void sendCurrentConfiguration()
 	curConfig[6] = biasVRaw & 0xFF;
 	curConfig[7] = (biasVRaw >> 8) & 0xFF;
 	curConfig[8] = (settings[4].toggle_value == 0x00);
+}
 
-	uint32_t numBytes = escape_data(curConfig, 9, escapedCurConfig, 200);
+void sendCurrentConfiguration()
+{
+	uint8_t curConfig[CONFIG_FRAME_SIZE] = {0};
+	packConfiguration(curConfig);
 
-	CDC_Transmit_FS(escapedCurConfig, numBytes);
+	for (uint8_t t = 0; t < NUM_TRANSPORTS; t++)
+	{
+		sendFrame((SERIAL_TRANSPORT_t)t, curConfig, sizeof(curConfig), true);
+	}
 }
 
-void runSerial()
+// sendConfigurationAck
+//  the current configuration with the sequence number of the host change it
+//  answers. Goes to every transport so all hosts see the change
+void sendConfigurationAck(uint8_t seq)
+{
+	uint8_t curConfig[CONFIG_SEQ_FRAME_SIZE] = {0};
+	packConfiguration(curConfig);
+	curConfig[CONFIG_FRAME_SIZE] = seq;
+
+	for (uint8_t t = 0; t < NUM_TRANSPORTS; t++)
+	{
+		sendFrame((SERIAL_TRANSPORT_t)t, curConfig, sizeof(curConfig), true);
+	}
+}
+
+// sendFrame
+//  escapes the frame into the active transmit buffer of the transport. Frames
+//  are batched so the USB gets full packets, flushNow sends whatever is
+//  waiting right away. Returns false if the frame was dropped because the
+//  buffers are full
+bool sendFrame(SERIAL_TRANSPORT_t transport, const uint8_t* data, uint32_t numBytes, bool flushNow)
+{
+	bool added;
+	if (transport >= NUM_TRANSPORTS) return false;
+	TX_CHANNEL_t* channel = txChannels + transport;
+
+	taskENTER_CRITICAL();
+	size_t escapedBytes = escape_data(data, numBytes, &channel->buffers[channel->active][channel->fill],
+			                          TX_BUFFER_SIZE - channel->fill);
+	added = (escapedBytes != 0);
+	if (added)
+	{
+		if (channel->fill == 0) channel->firstByteTick = xTaskGetTickCount();
+		channel->fill += escapedBytes;
+		channel->force |= flushNow;
+	}
+	else
+	{
+		txDroppedFrames++;
+	}
+	taskEXIT_CRITICAL();
+
+	if (flushNow) flushTxBuffer(channel);
+	return added;
+}
+
+// flushTxBuffer
+//  hands the waiting bytes to the peripheral if the last transfer has
+//  finished. Only whole packets are sent unless the data has been waiting too
+//  long or a flush was requested. The leftover partial packet moves to the
+//  other buffer which becomes the one that gets filled
+static void flushTxBuffer(TX_CHANNEL_t* channel)
+{
+	taskENTER_CRITICAL();
+	uint32_t sendBytes = channel->fill - (channel->fill % channel->packetSize);
+	if (channel->force || (channel->fill && xTaskGetTickCount() - channel->firstByteTick >= TX_FLUSH_TIMEOUT_MS))
+	{
+		sendBytes = channel->fill;
+	}
+
+	if (sendBytes && channel->transmit(channel->buffers[channel->active], sendBytes) == 0)
+	{
+		uint32_t leftover = channel->fill - sendBytes;
+		memcpy(channel->buffers[!channel->active], &channel->buffers[channel->active][sendBytes], leftover);
+		channel->active = !channel->active;
+		channel->fill = leftover;
+		channel->firstByteTick = xTaskGetTickCount();
+		channel->force = false;
+	}
+	taskEXIT_CRITICAL();
+}
+
+// parseByte
+//  feeds one received byte into a transport's parser, dispatching the frame
+//  once the closing delimiter arrives
+static void parseByte(FRAME_PARSER_t* parser, uint8_t byte)
 {
-	static uint32_t recvIdx = 0;
-	while (xQueueReceive(vComHandle, &recvBuffer[recvIdx], 0) == pdPASS && recvIdx < BUFFER_SIZE)
+	// If just received FRAME_DELIMITER indicates beginning of new message
+	if (byte == FRAME_DELIMITER)
 	{
-		// If just received FRAME_DELIMITER indicates beginning of new message
-		if (recvBuffer[recvIdx] == FRAME_DELIMITER)
+		// the end of a frame that did not fit, the next one starts clean
+		if (parser->discarding)
 		{
-			if (recvIdx == 0)
-			{
-				// Since recvIdx == 0 no data has been received. This means that the FRAME_DELIMITER that was
-				// received was due to the start delimiter
-				continue;
-			}
-			else
-			{
-				// Data received. FRAME_DELIMITER that was received was due to end delimiter. Parse message
-				parseMessage(recvBuffer, recvIdx);
-				// Reset recvIdx to allow for reading of new message
-				recvIdx = 0;
-			}
+			parser->discarding = false;
+			parser->recvIdx = 0;
+			return;
 		}
-		else
+		// If recvIdx == 0 no data has been received. This means that the FRAME_DELIMITER that was
+		// received was due to the start delimiter
+		if (parser->recvIdx != 0)
 		{
-			// Still receiving new data. Increment recvIdx
-			recvIdx++;
+			// Data received. FRAME_DELIMITER that was received was due to end delimiter. Parse message
+			parseMessage(parser->recvBuffer, parser->recvIdx, parser->transport);
+			// Reset recvIdx to allow for reading of new message
+			parser->recvIdx = 0;
 		}
 	}
+	else if (!parser->discarding)
+	{
+		// Still receiving new data. A frame that does not fit is thrown away
+		// whole, so its tail is never taken for a command of its own
+		if (parser->recvIdx >= BUFFER_SIZE)
+		{
+			parser->discarding = true;
+			parser->recvIdx = 0;
+			return;
+		}
+		parser->recvBuffer[parser->recvIdx++] = byte;
+	}
+}
+
+void startSerial()
+{
+	uartSerialStart();
+}
+
+// waitSerial
+//  sleeps until a transport signals new data or the next 1ms poll is due
+void waitSerial()
+{
+	ulTaskNotifyTake(pdTRUE, 1);
+}
+
+void runSerial()
+{
+	uint8_t byte;
+	uint8_t uartBytes[32];
+	uint32_t numBytes;
+
+	while (xQueueReceive(vComHandle, &byte, 0) == pdPASS)
+	{
+		parseByte(&parsers[TRANSPORT_USB], byte);
+	}
+
+	// the queue has been drained, let the host send more if the USB was paused
+	CDC_ResumeReceive_FS();
+
+	while ((numBytes = uartSerialRead(uartBytes, sizeof(uartBytes))) != 0)
+	{
+		for (uint32_t c = 0; c < numBytes; c++)
+		{
+			parseByte(&parsers[TRANSPORT_UART], uartBytes[c]);
+		}
+	}
+
+	update_diagnostics();
+	run_telemetry();
+	for (uint8_t t = 0; t < NUM_TRANSPORTS; t++)
+	{
+		flushTxBuffer(&txChannels[t]);
+	}
 }
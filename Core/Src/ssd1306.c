@@ -50,6 +50,7 @@
 #include "ssd1306.h"
 #include "time.h"
 #include "stdio.h"
+#include "cmsis_os.h"
 
 extern I2C_HandleTypeDef hi2c1;
 /* Write command */
@@ -732,18 +733,15 @@ void SSD1306_Println(char* format, ...)
 /* I2C Functions */
 
 void ssd1306_I2C_Init() {
-	uint32_t p = 250000;
-	while(p>0)
-		p--;
+	/* power up time of the panel, slept rather than spun since this runs in
+	   the display task while the outputs are already going */
+	osDelay(5);
 }
 
 void ssd1306_I2C_WriteMulti(uint8_t address, uint8_t reg, uint8_t* data, uint16_t count) {
-	uint8_t dt[256];
-	dt[0] = reg;
-	uint8_t i;
-	for(i = 0; i < count; i++)
-	dt[i+1] = data[i];
-	HAL_I2C_Master_Transmit(&hi2c1, address, dt, count+1, 10);
+	/* the control byte goes out as the memory address, so the data is sent
+	   straight from the caller's buffer without a copy on the stack */
+	HAL_I2C_Mem_Write(&hi2c1, address, reg, I2C_MEMADD_SIZE_8BIT, data, count, 10);
 }
 
 void ssd1306_I2C_Write(uint8_t address, uint8_t reg, uint8_t data) {
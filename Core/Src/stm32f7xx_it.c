@@ -22,6 +22,7 @@
 #include "stm32f7xx_it.h"
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
+#include "trace.h"
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -56,12 +57,17 @@
 
 /* External variables --------------------------------------------------------*/
 extern PCD_HandleTypeDef hpcd_USB_OTG_FS;
+extern DMA_HandleTypeDef hdma_dac1;
 extern DAC_HandleTypeDef hdac;
 extern DMA_HandleTypeDef hdma_tim1_ch1;
 extern DMA_HandleTypeDef hdma_tim2_up_ch3;
 extern DMA_HandleTypeDef hdma_tim2_ch2_ch4;
 extern DMA_HandleTypeDef hdma_tim5_ch2;
 extern DMA_HandleTypeDef hdma_tim5_ch3_up;
+extern DMA_HandleTypeDef hdma_tim5_ch4_trig;
+extern DMA_HandleTypeDef hdma_uart4_rx;
+extern UART_HandleTypeDef huart4;
+extern TIM_HandleTypeDef htim1;
 extern TIM_HandleTypeDef htim6;
 
 /* USER CODE BEGIN EV */
@@ -172,10 +178,12 @@ void DebugMon_Handler(void)
 void DMA1_Stream0_IRQHandler(void)
 {
   /* USER CODE BEGIN DMA1_Stream0_IRQn 0 */
+  uint32_t isr_start = trace_now();
 
   /* USER CODE END DMA1_Stream0_IRQn 0 */
   HAL_DMA_IRQHandler(&hdma_tim5_ch3_up);
   /* USER CODE BEGIN DMA1_Stream0_IRQn 1 */
+  trace_isr_exit(ISR_OUTPUT_DMA, isr_start);
 
   /* USER CODE END DMA1_Stream0_IRQn 1 */
 }
@@ -186,63 +194,152 @@ void DMA1_Stream0_IRQHandler(void)
 void DMA1_Stream1_IRQHandler(void)
 {
   /* USER CODE BEGIN DMA1_Stream1_IRQn 0 */
+  uint32_t isr_start = trace_now();
 
   /* USER CODE END DMA1_Stream1_IRQn 0 */
   HAL_DMA_IRQHandler(&hdma_tim2_up_ch3);
   /* USER CODE BEGIN DMA1_Stream1_IRQn 1 */
+  trace_isr_exit(ISR_OUTPUT_DMA, isr_start);
 
   /* USER CODE END DMA1_Stream1_IRQn 1 */
 }
 
+/**
+  * @brief This function handles DMA1 stream2 global interrupt.
+  */
+void DMA1_Stream2_IRQHandler(void)
+{
+  /* USER CODE BEGIN DMA1_Stream2_IRQn 0 */
+  uint32_t isr_start = trace_now();
+
+  /* USER CODE END DMA1_Stream2_IRQn 0 */
+  HAL_DMA_IRQHandler(&hdma_uart4_rx);
+  /* USER CODE BEGIN DMA1_Stream2_IRQn 1 */
+  trace_isr_exit(ISR_UART, isr_start);
+
+  /* USER CODE END DMA1_Stream2_IRQn 1 */
+}
+
+/**
+  * @brief This function handles DMA1 stream3 global interrupt.
+  */
+void DMA1_Stream3_IRQHandler(void)
+{
+  /* USER CODE BEGIN DMA1_Stream3_IRQn 0 */
+  uint32_t isr_start = trace_now();
+
+  /* USER CODE END DMA1_Stream3_IRQn 0 */
+  HAL_DMA_IRQHandler(&hdma_tim5_ch4_trig);
+  /* USER CODE BEGIN DMA1_Stream3_IRQn 1 */
+  trace_isr_exit(ISR_OUTPUT_DMA, isr_start);
+
+  /* USER CODE END DMA1_Stream3_IRQn 1 */
+}
+
 /**
   * @brief This function handles DMA1 stream4 global interrupt.
   */
 void DMA1_Stream4_IRQHandler(void)
 {
   /* USER CODE BEGIN DMA1_Stream4_IRQn 0 */
+  uint32_t isr_start = trace_now();
 
   /* USER CODE END DMA1_Stream4_IRQn 0 */
   HAL_DMA_IRQHandler(&hdma_tim5_ch2);
   /* USER CODE BEGIN DMA1_Stream4_IRQn 1 */
+  trace_isr_exit(ISR_OUTPUT_DMA, isr_start);
 
   /* USER CODE END DMA1_Stream4_IRQn 1 */
 }
 
+/**
+  * @brief This function handles DMA1 stream5 global interrupt.
+  */
+void DMA1_Stream5_IRQHandler(void)
+{
+  /* USER CODE BEGIN DMA1_Stream5_IRQn 0 */
+  uint32_t isr_start = trace_now();
+
+  /* USER CODE END DMA1_Stream5_IRQn 0 */
+  HAL_DMA_IRQHandler(&hdma_dac1);
+  /* USER CODE BEGIN DMA1_Stream5_IRQn 1 */
+  trace_isr_exit(ISR_OUTPUT_DMA, isr_start);
+
+  /* USER CODE END DMA1_Stream5_IRQn 1 */
+}
+
 /**
   * @brief This function handles DMA1 stream6 global interrupt.
   */
 void DMA1_Stream6_IRQHandler(void)
 {
   /* USER CODE BEGIN DMA1_Stream6_IRQn 0 */
+  uint32_t isr_start = trace_now();
 
   /* USER CODE END DMA1_Stream6_IRQn 0 */
   HAL_DMA_IRQHandler(&hdma_tim2_ch2_ch4);
   /* USER CODE BEGIN DMA1_Stream6_IRQn 1 */
+  trace_isr_exit(ISR_OUTPUT_DMA, isr_start);
 
   /* USER CODE END DMA1_Stream6_IRQn 1 */
 }
 
+/**
+  * @brief This function handles TIM1 update interrupt and TIM10 global interrupt.
+  */
+void TIM1_UP_TIM10_IRQHandler(void)
+{
+  /* USER CODE BEGIN TIM1_UP_TIM10_IRQn 0 */
+  uint32_t isr_start = trace_now();
+
+  /* USER CODE END TIM1_UP_TIM10_IRQn 0 */
+  HAL_TIM_IRQHandler(&htim1);
+  /* USER CODE BEGIN TIM1_UP_TIM10_IRQn 1 */
+  trace_isr_exit(ISR_NEOPIXEL, isr_start);
+
+  /* USER CODE END TIM1_UP_TIM10_IRQn 1 */
+}
+
 /**
   * @brief This function handles EXTI line[15:10] interrupts.
   */
 void EXTI15_10_IRQHandler(void)
 {
   /* USER CODE BEGIN EXTI15_10_IRQn 0 */
+  uint32_t isr_start = trace_now();
 
   /* USER CODE END EXTI15_10_IRQn 0 */
   HAL_GPIO_EXTI_IRQHandler(ENC_1_Pin);
   HAL_GPIO_EXTI_IRQHandler(ENC_2_Pin);
   /* USER CODE BEGIN EXTI15_10_IRQn 1 */
+  trace_isr_exit(ISR_ENCODER, isr_start);
 
   /* USER CODE END EXTI15_10_IRQn 1 */
 }
 
+/**
+  * @brief This function handles UART4 global interrupt.
+  */
+void UART4_IRQHandler(void)
+{
+  /* USER CODE BEGIN UART4_IRQn 0 */
+  uint32_t isr_start = trace_now();
+
+  /* USER CODE END UART4_IRQn 0 */
+  HAL_UART_IRQHandler(&huart4);
+  /* USER CODE BEGIN UART4_IRQn 1 */
+  trace_isr_exit(ISR_UART, isr_start);
+
+  /* USER CODE END UART4_IRQn 1 */
+}
+
 /**
   * @brief This function handles TIM6 global interrupt, DAC1 and DAC2 underrun error interrupts.
   */
 void TIM6_DAC_IRQHandler(void)
 {
   /* USER CODE BEGIN TIM6_DAC_IRQn 0 */
+  uint32_t isr_start = trace_now();
 
   /* USER CODE END TIM6_DAC_IRQn 0 */
   if (hdac.State != HAL_DAC_STATE_RESET) {
@@ -250,6 +347,7 @@ void TIM6_DAC_IRQHandler(void)
   }
   HAL_TIM_IRQHandler(&htim6);
   /* USER CODE BEGIN TIM6_DAC_IRQn 1 */
+  trace_isr_exit(ISR_TICK, isr_start);
 
   /* USER CODE END TIM6_DAC_IRQn 1 */
 }
@@ -260,10 +358,12 @@ void TIM6_DAC_IRQHandler(void)
 void DMA2_Stream1_IRQHandler(void)
 {
   /* USER CODE BEGIN DMA2_Stream1_IRQn 0 */
+  uint32_t isr_start = trace_now();
 
   /* USER CODE END DMA2_Stream1_IRQn 0 */
   HAL_DMA_IRQHandler(&hdma_tim1_ch1);
   /* USER CODE BEGIN DMA2_Stream1_IRQn 1 */
+  trace_isr_exit(ISR_NEOPIXEL, isr_start);
 
   /* USER CODE END DMA2_Stream1_IRQn 1 */
 }
@@ -274,10 +374,12 @@ void DMA2_Stream1_IRQHandler(void)
 void OTG_FS_IRQHandler(void)
 {
   /* USER CODE BEGIN OTG_FS_IRQn 0 */
+  usb_irq_cycles = trace_now();
 
   /* USER CODE END OTG_FS_IRQn 0 */
   HAL_PCD_IRQHandler(&hpcd_USB_OTG_FS);
   /* USER CODE BEGIN OTG_FS_IRQn 1 */
+  trace_isr_exit(ISR_USB, usb_irq_cycles);
 
   /* USER CODE END OTG_FS_IRQn 1 */
 }
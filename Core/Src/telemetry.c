@@ -0,0 +1,89 @@
+// telemetry.c
+//  builds the periodic status records that get streamed to the host. The
+//  host turns the stream on with the CMD_TELEMETRY frame and picks the rate.
+//  Everything here runs in the serial task, the output code only bumps
+//  counters
+
+#include "telemetry.h"
+#include "serial.h"
+#include "outputs.h"
+#include "trace.h"
+#include "diagnostics.h"
+#include "out4_sense.h"
+#include "cmsis_os.h"
+
+extern bool running;
+extern uint32_t curr_period_100ns;
+extern OUTPUT_TYPE_t curr_out_type;
+extern OUT12_VOLTAGE_t curr_out_voltage;
+extern bool curr_single;
+extern osMessageQId vComHandle;
+extern osThreadId mainTaskHandle;
+extern osThreadId displayTask_tasHandle;
+extern osThreadId serialHandle;
+extern uint32_t txDroppedFrames;
+
+static uint16_t telemetry_rate_hz = 0;
+static SERIAL_TRANSPORT_t telemetry_transport = TRANSPORT_USB;
+static uint32_t stream_start_tick = 0;
+static uint32_t records_sent = 0;
+
+// set_telemetry_rate
+//  starts, changes or stops (rate of 0) the telemetry stream. The records go
+//  out on the transport that asked for them
+void set_telemetry_rate(uint16_t rate_hz, SERIAL_TRANSPORT_t transport)
+{
+	if (rate_hz > MAX_TELEMETRY_RATE_HZ) rate_hz = MAX_TELEMETRY_RATE_HZ;
+	telemetry_rate_hz = rate_hz;
+	telemetry_transport = transport;
+	stream_start_tick = xTaskGetTickCount();
+	records_sent = 0;
+}
+
+// run_telemetry
+//  called every pass of the serial task. Sends at most one record per call,
+//  if we fall behind the missed records are skipped instead of bursting
+void run_telemetry(void)
+{
+	static uint8_t seq = 0;
+	TELEMETRY_RECORD_t record;
+	int16_t sense_mV, trim;
+
+	if (telemetry_rate_hz == 0) return;
+
+	uint32_t elapsed_ms = xTaskGetTickCount() - stream_start_tick;
+	uint64_t due = ((uint64_t)elapsed_ms * telemetry_rate_hz) / 1000;
+	if (due < records_sent) return;
+
+	record.type = TELEMETRY_RECORD_TYPE;
+	record.seq = seq++;
+	bool sensed = get_out4_sense(&sense_mV, &trim);
+	record.run_state = (running ? TELEMETRY_STATE_RUNNING : 0) |
+			           (curr_out_type == SHORT ? TELEMETRY_STATE_SHORT : 0) |
+					   (curr_out_voltage == HIGH_VOLTAGE_5000mV ? TELEMETRY_STATE_5V : 0) |
+					   (curr_single ? TELEMETRY_STATE_SINGLE : 0) |
+					   (is_output_armed() ? TELEMETRY_STATE_ARMED : 0) |
+					   (is_bias_table_running() ? TELEMETRY_STATE_TABLE : 0) |
+					   (sensed ? TELEMETRY_STATE_SENSE : 0);
+	record.vcom_depth = uxQueueMessagesWaiting(vComHandle);
+	record.timestamp_ms = xTaskGetTickCount();
+	record.pulses = get_pulses_emitted();
+	record.period_100ns = curr_period_100ns;
+	record.reconfig_max_cycles = trace_stats[TRACE_RECONFIG].max_cycles;
+	record.irq_off_max_cycles = trace_stats[TRACE_IRQ_OFF].max_cycles;
+	record.cpu_load[0] = get_diagnostics()->cpu_permille / 10;
+	record.cpu_load[1] = get_task_cpu_percent(mainTaskHandle);
+	record.cpu_load[2] = get_task_cpu_percent(displayTask_tasHandle);
+	record.cpu_load[3] = get_task_cpu_percent(serialHandle);
+	record.reconfig_count = trace_stats[TRACE_RECONFIG].count;
+	record.dropped = txDroppedFrames;
+	record.trigger_last_cycles = trace_stats[TRACE_TRIGGER].last_cycles;
+	record.out4_sense_mV = sense_mV;
+	record.out4_trim = trim;
+
+	sendFrame(telemetry_transport, (uint8_t*)&record, sizeof(record), false);
+
+	records_sent = due + 1;
+}
+
+// End of telemetry.c
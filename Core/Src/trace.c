@@ -0,0 +1,75 @@
+// trace.c
+//  lightweight latency tracing using the Cortex-M7 DWT cycle counter. The
+//  same counter is used as the FreeRTOS run time stats timebase
+
+#include "trace.h"
+
+volatile TRACE_STAT_t trace_stats[NUM_TRACE_POINTS] = {0};
+
+volatile TRACE_ISR_STAT_t isr_stats[NUM_ISR_SOURCES] = {0};
+volatile uint32_t task_switches[MAX_TRACED_TASKS] = {0};
+
+// stamped on entry to the USB interrupt so latencies can be measured from
+// the moment the packet arrived
+volatile uint32_t usb_irq_cycles = 0;
+
+// 0 until the step is reached
+volatile uint32_t boot_us[NUM_BOOT_STEPS] = {0};
+
+// cycle count when the core switched to the PLL
+static uint32_t boot_clock_cycles = 0;
+
+// trace_init
+//  turns on the cycle counter. Safe to call more than once
+void trace_init(void)
+{
+	if (DWT->CTRL & DWT_CTRL_CYCCNTENA_Msk) return;
+
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->LAR = 0xC5ACCE55; // the M7 DWT is locked out of reset
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+// trace_record
+//  stores the time since start_cycles against the trace point. Wrapping
+//  of the counter is handled by the unsigned subtraction
+void trace_record(TRACE_POINT_t point, uint32_t start_cycles)
+{
+	if (point >= NUM_TRACE_POINTS) return;
+
+	uint32_t cycles = trace_now() - start_cycles;
+	volatile TRACE_STAT_t* stat = trace_stats + point;
+	stat->count++;
+	stat->last_cycles = cycles;
+	if (cycles > stat->max_cycles) stat->max_cycles = cycles;
+}
+
+// trace_task_switched_in
+//  hooked into the scheduler through traceTASK_SWITCHED_IN, so it runs on
+//  every context switch and has to stay short
+void trace_task_switched_in(uint32_t task_number)
+{
+	if (task_number >= MAX_TRACED_TASKS) task_number = MAX_TRACED_TASKS - 1;
+	task_switches[task_number]++;
+}
+
+// trace_boot_step
+//  stamps a boot step the first time it is reached. BOOT_CLOCKS has to come
+//  first, it is called right after SystemClock_Config() and counts the
+//  cycles up to there at the HSI rate. Everything after is at SystemCoreClock
+void trace_boot_step(BOOT_STEP_t step)
+{
+	if (step >= NUM_BOOT_STEPS || boot_us[step] != 0) return;
+
+	uint32_t now = trace_now();
+	if (step == BOOT_CLOCKS)
+	{
+		boot_clock_cycles = now;
+		boot_us[BOOT_CLOCKS] = now / (HSI_VALUE / 1000000);
+		return;
+	}
+	boot_us[step] = boot_us[BOOT_CLOCKS] + (now - boot_clock_cycles) / (SystemCoreClock / 1000000);
+}
+
+// End of trace.c
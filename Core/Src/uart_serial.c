@@ -0,0 +1,73 @@
+/*
+ * uart_serial.c
+ *
+ *  UART4 transport for the serial protocol. The DMA writes into a circular
+ *  buffer forever, the serial task just chases the DMA write position. The
+ *  idle line, half and full events only wake the serial task up early
+ */
+
+#include "uart_serial.h"
+#include "main.h"
+#include "cmsis_os.h"
+
+#define UART_RX_BUFFER_SIZE 256
+
+extern UART_HandleTypeDef huart4;
+extern osThreadId serialHandle;
+
+DMA_BUFFER static uint8_t uartRxBuffer[UART_RX_BUFFER_SIZE];
+static uint32_t uartRxRead = 0;
+uint32_t uartRxErrors = 0;
+
+void uartSerialStart()
+{
+	uartRxRead = 0;
+	HAL_UARTEx_ReceiveToIdle_DMA(&huart4, uartRxBuffer, UART_RX_BUFFER_SIZE);
+}
+
+// uartSerialRead
+//  copies out everything the DMA has written since the last call. Returns the
+//  number of bytes copied
+uint32_t uartSerialRead(uint8_t* data, uint32_t maxBytes)
+{
+	uint32_t numBytes = 0;
+	uint32_t writePos = UART_RX_BUFFER_SIZE - __HAL_DMA_GET_COUNTER(huart4.hdmarx);
+	if (writePos >= UART_RX_BUFFER_SIZE) writePos = 0;
+
+	while (uartRxRead != writePos && numBytes < maxBytes)
+	{
+		data[numBytes++] = uartRxBuffer[uartRxRead];
+		uartRxRead = (uartRxRead + 1) % UART_RX_BUFFER_SIZE;
+	}
+
+	return numBytes;
+}
+
+// uartSerialTransmit
+//  starts sending the buffer in the background. The buffer must stay valid
+//  until the transfer is done. Returns 0 (HAL_OK) if the transfer started
+uint8_t uartSerialTransmit(uint8_t* data, uint16_t numBytes)
+{
+	return HAL_UART_Transmit_IT(&huart4, data, numBytes);
+}
+
+void HAL_UARTEx_RxEventCallback(UART_HandleTypeDef *huart, uint16_t Size)
+{
+	BaseType_t woken = pdFALSE;
+
+	if (huart != &huart4) return;
+
+	vTaskNotifyGiveFromISR(serialHandle, &woken);
+	portYIELD_FROM_ISR(woken);
+}
+
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart)
+{
+	if (huart != &huart4) return;
+
+	// an overrun or framing error stops the DMA, so start it again. Whatever
+	// partial frame was in flight gets dropped by the parser
+	uartRxErrors++;
+	HAL_UART_AbortReceive(huart);
+	uartSerialStart();
+}
@@ -60,6 +60,20 @@ defined in linker script */
 Reset_Handler:  
   ldr   sp, =_estack      /* set stack pointer */
 
+/* Start the DWT cycle counter from zero so the boot can be timed from reset */
+  ldr r0, =0xE000EDFC     /* DEMCR */
+  ldr r1, [r0]
+  orr r1, r1, #0x01000000 /* TRCENA */
+  str r1, [r0]
+  ldr r0, =0xE0001000     /* DWT_CTRL */
+  ldr r1, =0xC5ACCE55
+  str r1, [r0, #0xFB0]    /* DWT_LAR, locked out of reset on the M7 */
+  movs r1, #0
+  str r1, [r0, #4]        /* DWT_CYCCNT */
+  ldr r1, [r0]
+  orr r1, r1, #1          /* CYCCNTENA */
+  str r1, [r0]
+
 /* Copy the data segment initializers from flash to SRAM */  
   ldr r0, =_sdata
   ldr r1, =_edata
@@ -91,6 +105,39 @@ LoopFillZerobss:
   cmp r2, r4
   bcc FillZerobss
 
+/* Copy the code that runs from ITCM out of flash */
+  ldr r0, =_sitcm
+  ldr r1, =_eitcm
+  ldr r2, =_siitcm
+  movs r3, #0
+  b LoopCopyItcmInit
+
+CopyItcmInit:
+  ldr r4, [r2, r3]
+  str r4, [r0, r3]
+  adds r3, r3, #4
+
+LoopCopyItcmInit:
+  adds r4, r0, r3
+  cmp r4, r1
+  bcc CopyItcmInit
+
+/* Zero fill the DMA buffers in SRAM2 */
+  ldr r2, =_sdma_buffer
+  ldr r4, =_edma_buffer
+  movs r3, #0
+  b LoopFillZeroDma
+
+FillZeroDma:
+  str  r3, [r2]
+  adds r2, r2, #4
+
+LoopFillZeroDma:
+  cmp r2, r4
+  bcc FillZeroDma
+  dsb
+  isb
+
 /* Call the clock system initialization function.*/
   bl  SystemInit   
 /* Call static constructors */
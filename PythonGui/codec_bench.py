@@ -0,0 +1,85 @@
+"""
+codec_bench.py
+ Throughput of the byte stuffing in framing.py, the bytes.replace() versions
+ against the byte at a time fallback. Also checks that both give the same
+ result so a faster version can not quietly break the framing.
+
+ Sizes cover a config frame (9), a telemetry record (40), a full transmit
+ buffer in the firmware (512) and a large pulse segment upload (4096).
+
+ Example:
+   python codec_bench.py --out codec.json
+"""
+
+import argparse
+import json
+import random
+import time
+
+import framing
+
+FRAME_SIZES = [9, 40, 512, 4096]
+
+# fraction of the payload bytes that need escaping, random telemetry has about
+# 2 in 256 while a pulse table full of 0x7E is the worst case
+ESCAPE_DENSITIES = [0.0, 2 / 256, 0.5]
+
+
+def make_payload(size, density, rng):
+    data = bytearray(rng.randrange(0, 0x7D) for _ in range(size))
+    for i in range(size):
+        if rng.random() < density:
+            data[i] = rng.choice([framing.FRAME_DELIMITER, framing.ESCAPE])
+    return bytes(data)
+
+
+def throughput(func, payload, min_time):
+    # Runs func until min_time has passed and returns payload MB/s
+    runs = 0
+    start = time.perf_counter()
+    elapsed = 0.0
+    while elapsed < min_time:
+        for _ in range(100):
+            func(payload)
+        runs += 100
+        elapsed = time.perf_counter() - start
+    return runs * len(payload) / elapsed / 1e6
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Benchmark the protocol byte stuffing")
+    parser.add_argument("--time", type=float, default=0.2, help="seconds per measurement")
+    parser.add_argument("--out", help="write the JSON report here as well")
+    args = parser.parse_args()
+
+    rng = random.Random(0)
+    results = []
+    for size in FRAME_SIZES:
+        for density in ESCAPE_DENSITIES:
+            payload = make_payload(size, density, rng)
+            escaped = framing.escape_payload(payload)
+            if escaped != framing.escape_payload_py(payload):
+                raise SystemExit("escape_payload does not match the fallback")
+            if framing.unescape_payload(escaped) != payload:
+                raise SystemExit("unescape_payload does not round trip")
+
+            result = {
+                "size": size,
+                "escape_density": density,
+                "escape_mb_s": throughput(framing.escape_payload, payload, args.time),
+                "escape_py_mb_s": throughput(framing.escape_payload_py, payload, args.time),
+                "unescape_mb_s": throughput(framing.unescape_payload, escaped, args.time),
+                "unescape_py_mb_s": throughput(framing.unescape_payload_py, escaped, args.time),
+            }
+            results.append(result)
+            print("{size:5d} B  {escape_density:5.3f}  escape {escape_mb_s:8.1f} MB/s ({escape_py_mb_s:5.1f})"
+                  "  unescape {unescape_mb_s:8.1f} MB/s ({unescape_py_mb_s:5.1f})".format(**result))
+
+    if args.out:
+        with open(args.out, "w") as f:
+            json.dump(results, f, indent=2)
+            f.write("\n")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,57 @@
+"""
+cpu_monitor.py
+ Polls a function generator for its task and interrupt CPU use, stack high
+ water marks and context switch counts, and prints a table. The last lines
+ are how long after reset each boot step finished and the relay operation
+ count for wear tracking. Useful to keep
+ an eye on the headroom while the outputs are running.
+
+ Example:
+   python cpu_monitor.py --port /dev/ttyACM0 --interval 1
+"""
+
+import argparse
+import asyncio
+
+from function_generator import FunctionGenerator
+
+
+def print_diagnostics(diag):
+    print("CPU {:5.1f}%  (window {} ms)".format(diag["cpu_percent"], diag["window_ms"]))
+    print("  {:<16} {:>7} {:>11} {:>10}".format("task", "cpu", "stack free", "switches"))
+    for task in diag["tasks"]:
+        print("  {:<16} {:>6.1f}% {:>11} {:>10}".format(task["name"], task["cpu_percent"], task["stack_free_words"],
+                                                      task["switches"]))
+    print("  {:<16} {:>7} {:>11} {:>10} {:>10}".format("interrupt", "cpu", "count", "mean cyc", "max cyc"))
+    for name, isr in diag["isrs"].items():
+        print("  {:<16} {:>6.1f}% {:>11} {:>10} {:>10}".format(name, isr["cpu_percent"], isr["count"],
+                                                             isr["mean_cycles"], isr["max_cycles"]))
+    print("  boot: " + ", ".join("{} {}".format(name, "-" if us is None else "{:.1f} ms".format(us / 1000))
+                                 for name, us in diag["boot_us"].items()))
+    print("  relay operations: {}".format(diag["relay_ops"]))
+    print()
+
+
+async def monitor(port, interval, count):
+    gen = await FunctionGenerator.connect(port)
+    try:
+        polled = 0
+        while count == 0 or polled < count:
+            print_diagnostics(await gen.diagnostics())
+            polled += 1
+            await asyncio.sleep(interval)
+    finally:
+        await gen.close()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Watch the function generator CPU use")
+    parser.add_argument("--port", help="serial port, the first generator found if not given")
+    parser.add_argument("--interval", type=float, default=1.0, help="seconds between polls")
+    parser.add_argument("--count", type=int, default=0, help="number of polls, 0 runs until interrupted")
+    args = parser.parse_args()
+    asyncio.run(monitor(args.port, args.interval, args.count))
+
+
+if __name__ == "__main__":
+    main()
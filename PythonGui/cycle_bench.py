@@ -0,0 +1,110 @@
+"""
+cycle_bench.py
+ Measures how many CPU cycles the firmware spends reconfiguring the outputs
+ and in each group of interrupts, from the DWT counts the device already
+ keeps. Meant for comparing two firmware builds, e.g. before and after a
+ change to the memory layout or the caches.
+
+ The bench runs the outputs and steps through BENCH_FREQS so every change
+ goes through enable_output_waveform(). At the end it puts back the
+ configuration it found.
+
+ Examples:
+   python cycle_bench.py --port /dev/ttyACM0 --label flash-nocache --out before.json
+   python cycle_bench.py --port /dev/ttyACM0 --label itcm-cache --out after.json
+   python cycle_bench.py --compare before.json after.json
+"""
+
+import argparse
+import asyncio
+import json
+import time
+
+from function_generator import FunctionGenerator
+
+BENCH_FREQS = [1000, 2000, 5000, 10000, 20000, 50000, 100000, 125000]
+TELEMETRY_RATE_HZ = 50
+
+
+async def bench(port, count, label):
+    gen = await FunctionGenerator.connect(port)
+    original = gen.config
+    telemetry = []
+    gen.telemetry_callbacks.append(lambda gen, record: telemetry.append(record))
+    await gen.set_telemetry_rate(TELEMETRY_RATE_HZ)
+
+    try:
+        start = time.perf_counter()
+        for n in range(count):
+            await gen.update(freq_hz=BENCH_FREQS[n % len(BENCH_FREQS)], running=True)
+        elapsed = time.perf_counter() - start
+
+        # one more telemetry record so the last changes are in it
+        await asyncio.sleep(2.0 / TELEMETRY_RATE_HZ)
+        diag = await gen.diagnostics()
+    finally:
+        await gen.set_telemetry_rate(0)
+        await gen.apply(original)
+        await gen.close()
+
+    last = telemetry[-1] if telemetry else {}
+    return {
+        "label": label,
+        "port": port,
+        "time": time.strftime("%Y-%m-%dT%H:%M:%S%z"),
+        "changes": count,
+        "changes_per_s": count / elapsed if elapsed else None,
+        "reconfig_count": last.get("reconfig_count"),
+        "reconfig_max_cycles": last.get("reconfig_max_cycles"),
+        "irq_off_max_cycles": last.get("irq_off_max_cycles"),
+        "isrs": {name: {"mean_cycles": isr["mean_cycles"], "max_cycles": isr["max_cycles"], "count": isr["count"]}
+                 for name, isr in diag["isrs"].items()},
+    }
+
+
+def compare(before, after):
+    print("{:<28}{:>12}{:>12}{:>9}".format("", before["label"] or "before", after["label"] or "after", "change"))
+
+    def row(name, old, new):
+        change = "" if not old or new is None else "{:+.0f}%".format(100 * (new - old) / old)
+        print("{:<28}{:>12}{:>12}{:>9}".format(name, "-" if old is None else old, "-" if new is None else new,
+                                               change))
+
+    row("reconfig max cycles", before["reconfig_max_cycles"], after["reconfig_max_cycles"])
+    row("irq off max cycles", before["irq_off_max_cycles"], after["irq_off_max_cycles"])
+    for name in before["isrs"]:
+        if name not in after["isrs"]:
+            continue
+        row(name + " mean cycles", before["isrs"][name]["mean_cycles"], after["isrs"][name]["mean_cycles"])
+        row(name + " max cycles", before["isrs"][name]["max_cycles"], after["isrs"][name]["max_cycles"])
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Reconfiguration and interrupt cycle counts")
+    parser.add_argument("--port", help="serial port of the device")
+    parser.add_argument("--count", type=int, default=200, help="configuration changes to make")
+    parser.add_argument("--label", default="", help="firmware build or other tag stored in the report")
+    parser.add_argument("--out", help="write the JSON report here as well as to stdout")
+    parser.add_argument("--compare", nargs=2, metavar=("BEFORE", "AFTER"), help="compare two saved reports")
+    args = parser.parse_args()
+
+    if args.compare:
+        with open(args.compare[0]) as f:
+            before = json.load(f)
+        with open(args.compare[1]) as f:
+            after = json.load(f)
+        compare(before, after)
+        return
+    if not args.port:
+        parser.error("either --port or --compare is needed")
+
+    report = asyncio.run(bench(args.port, args.count, args.label))
+    text = json.dumps(report, indent=2)
+    if args.out:
+        with open(args.out, "w") as f:
+            f.write(text + "\n")
+    print(text)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,189 @@
+"""
+dac_calibrate.py
+ Calibrates the output 4 bias of one unit. For each polarity the device is
+ held at a series of raw DAC codes while the bias is measured, and the
+ measured points are saved to the device's flash, where the firmware turns
+ them into its mV to code lookup table, see Core/Src/dac_cal.c.
+
+ Output 4 is only driven during the pulse, so measure the top of the pulse
+ with a scope or a meter on the output 4 load. By default the script asks
+ for each reading, --meter runs a command that prints the reading in volts
+ instead, e.g. a script that reads a bench meter.
+
+ --readback steps through a few biases instead and prints what the
+ device's own readback of output 4 sees and how far its trim has moved the
+ DAC, a quick check of a calibration, see Core/Src/out4_sense.c.
+
+ Examples:
+   python dac_calibrate.py
+   python dac_calibrate.py --points 12 --meter "python read_dmm.py"
+   python dac_calibrate.py --show
+   python dac_calibrate.py --reset
+   python dac_calibrate.py --readback
+"""
+
+import argparse
+import asyncio
+import json
+import subprocess
+import sys
+
+from function_generator import (FunctionGenerator, DAC_CAL_MAX_POINTS, DAC_CAL_MAX_MV, DAC_CAL_MAX_CODE,
+                                TELEMETRY_STATE_SENSE)
+
+SETTLE_S = 0.3
+HOLD_BIAS_MV = 1000  # any bias of the sign turns on its MOSFET, the held code sets the level
+READBACK_BIASES_MV = (-3000, -1000, -100, 100, 1000, 3000)
+READBACK_TIMEOUT_S = 10
+READBACK_SETTLE_S = 3  # a few blocks of the trim
+
+
+def read_meter(command, sign, code):
+    if command is None:
+        while True:
+            text = input("  {} code {:4d}, measured V: ".format("+" if sign > 0 else "-", code))
+            try:
+                return float(text)
+            except ValueError:
+                print("  not a number")
+    result = subprocess.run(command, shell=True, check=True, capture_output=True, text=True)
+    return float(result.stdout.split()[0])
+
+
+def fit_points(measured, sign):
+    # [(code, volts), ...] to the (mV, code) points of the firmware table:
+    # magnitudes going up with the codes going one way. Readings past 0V or
+    # past the end of the bias range are replaced by where the line crosses
+    # them, readings that go against the rest are dropped, and if there are
+    # too many the ends are kept and the rest thinned out evenly
+    points = sorted((sign * volts * 1000, code) for code, volts in measured)
+    below = [p for p in points if p[0] < 0]
+    above = [p for p in points if p[0] > DAC_CAL_MAX_MV]
+    points = [p for p in points if 0 <= p[0] <= DAC_CAL_MAX_MV]
+    if below and points and points[0][0] > 0:
+        (m0, c0), (m1, c1) = below[-1], points[0]
+        points.insert(0, (0, c0 + (c1 - c0) * (0 - m0) / (m1 - m0)))
+    if above and points and points[-1][0] < DAC_CAL_MAX_MV:
+        (m0, c0), (m1, c1) = points[-1], above[0]
+        points.append((DAC_CAL_MAX_MV, c0 + (c1 - c0) * (DAC_CAL_MAX_MV - m0) / (m1 - m0)))
+
+    points = [(round(mv), round(code)) for mv, code in points]
+    if len(points) < 2:
+        raise ValueError("fewer than 2 usable readings for the {} side".format("+" if sign > 0 else "-"))
+    rising = points[-1][1] >= points[0][1]
+    kept = [points[0]]
+    for mv, code in points[1:]:
+        if mv > kept[-1][0] and (code >= kept[-1][1] if rising else code <= kept[-1][1]):
+            kept.append((mv, code))
+
+    if len(kept) > DAC_CAL_MAX_POINTS:
+        step = (len(kept) - 1) / (DAC_CAL_MAX_POINTS - 1)
+        kept = [kept[round(n * step)] for n in range(DAC_CAL_MAX_POINTS)]
+    return kept
+
+
+async def measure(gen, sign, codes, meter, freq_hz):
+    await gen.update(freq_hz=freq_hz, bias_mv=sign * HOLD_BIAS_MV, running=True)
+    measured = []
+    for code in codes:
+        await gen.hold_dac_code(sign, code)
+        await asyncio.sleep(SETTLE_S)
+        volts = await asyncio.get_running_loop().run_in_executor(None, read_meter, meter, sign, code)
+        measured.append((code, volts))
+    return measured
+
+
+async def show(gen):
+    for sign in (1, -1):
+        _, points, stored = await gen.get_dac_cal(sign)
+        print("{} side, {}:".format("+" if sign > 0 else "-", "calibrated" if stored else "nominal"))
+        for mv, code in points:
+            print("  {:5d} mV  code {:4d}".format(mv, code))
+
+
+async def readback(gen, freq_hz):
+    # the readback only counts once the device says it is of the bias now on
+    # the output, and the trim is given a few blocks to settle after that
+    latest = {}
+    gen.telemetry_callbacks.append(lambda _, record: latest.update(record))
+    await gen.set_telemetry_rate(10)
+    try:
+        for bias_mv in READBACK_BIASES_MV:
+            await gen.update(freq_hz=freq_hz, bias_mv=bias_mv, running=True)
+            # past any record sent before the change reached the readback
+            await asyncio.sleep(0.1)
+            latest.clear()
+            loop = asyncio.get_running_loop()
+            deadline = loop.time() + READBACK_TIMEOUT_S
+            while not latest.get("run_state", 0) & TELEMETRY_STATE_SENSE and loop.time() < deadline:
+                await asyncio.sleep(0.1)
+            if not latest.get("run_state", 0) & TELEMETRY_STATE_SENSE:
+                print("  {:5d} mV  no readback".format(bias_mv))
+                continue
+            await asyncio.sleep(READBACK_SETTLE_S)
+            print("  {:5d} mV  read back {:5d} mV  trim {:+4d} codes".format(
+                bias_mv, latest["out4_sense_mv"], latest["out4_trim"]))
+    finally:
+        await gen.set_telemetry_rate(0)
+
+
+async def calibrate(args):
+    gen = await FunctionGenerator.connect(args.port)
+    original = gen.config
+    try:
+        if args.show:
+            await show(gen)
+            return 0
+        if args.reset:
+            await gen.save_dac_cal({1: [], -1: []})
+            await show(gen)
+            return 0
+        if args.readback:
+            await readback(gen, args.freq)
+            return 0
+
+        codes = [round(n * DAC_CAL_MAX_CODE / (args.points - 1)) for n in range(args.points)]
+        tables = {}
+        readings = {}
+        for sign in (1, -1):
+            print("{} side: set up to measure the {} bias".format("+" if sign > 0 else "-",
+                                                                   "positive" if sign > 0 else "negative"))
+            try:
+                measured = await measure(gen, sign, codes, args.meter, args.freq)
+            finally:
+                await gen.hold_dac_code(sign, None)
+            readings[sign] = measured
+            tables[sign] = fit_points(measured, sign)
+
+        if args.out:
+            with open(args.out, "w") as f:
+                json.dump({"readings": {str(s): r for s, r in readings.items()},
+                           "points": {str(s): p for s, p in tables.items()}}, f, indent=2)
+        await gen.save_dac_cal(tables)
+        await show(gen)
+        return 0
+    finally:
+        if original is not None:
+            await gen.apply(original)
+        await gen.close()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Output 4 bias calibration")
+    parser.add_argument("--port", help="serial port, the first generator found if not given")
+    parser.add_argument("--points", type=int, default=DAC_CAL_MAX_POINTS,
+                        help="codes to measure on each side, 2 to {}".format(DAC_CAL_MAX_POINTS))
+    parser.add_argument("--meter", help="command that prints the measured output in volts")
+    parser.add_argument("--freq", type=int, default=1000, help="output frequency while measuring, Hz")
+    parser.add_argument("--out", help="also write the readings and points to this JSON file")
+    parser.add_argument("--show", action="store_true", help="only print the calibration in use")
+    parser.add_argument("--reset", action="store_true", help="go back to the nominal calibration")
+    parser.add_argument("--readback", action="store_true", help="only print the device's readback at a few biases")
+    args = parser.parse_args()
+    if not 2 <= args.points <= DAC_CAL_MAX_POINTS:
+        parser.error("--points must be 2 to {}".format(DAC_CAL_MAX_POINTS))
+    return asyncio.run(calibrate(args))
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,308 @@
+"""
+experiment_log.py
+ Binary log of every configuration and telemetry record the host sees, for
+ long unattended runs.
+
+ The file is a 64 byte header followed by 64 byte records, so it can be
+ memory mapped and any record found by its number. After every
+ INDEX_INTERVAL data records an index record is written summarizing that
+ block (first and last time), which lets a reader find a point in time by
+ looking only at the index records.
+
+ ExperimentLogger packs records on the caller's thread and a writer thread
+ puts them on disk. The queue between them is bounded and full means the
+ record is counted as dropped, so a slow disk never holds up the serial
+ reader.
+
+ Converting a log:
+   python experiment_log.py run.bin --csv run.csv
+   python experiment_log.py run.bin --columns run_columns/
+"""
+
+import argparse
+import array
+import json
+import mmap
+import os
+import queue
+import struct
+import sys
+import threading
+import time
+
+from function_generator import TELEMETRY_FORMAT, TELEMETRY_FIELDS
+
+MAGIC = b"MTJLOG\0\0"
+VERSION = 1
+RECORD_SIZE = 64
+INDEX_INTERVAL = 1024
+
+HEADER_FORMAT = struct.Struct("<8sHHIQ")                  # magic, version, record size, index interval, start time ns
+RECORD_HEADER = struct.Struct("<QBBBB")                   # time ns, kind, device, seq, flags
+PAYLOAD_OFFSET = RECORD_HEADER.size
+PAYLOAD_SIZE = RECORD_SIZE - PAYLOAD_OFFSET
+
+KIND_DEVICE = 0     # payload is the port name, gives the device number its meaning
+KIND_CONFIG = 1
+KIND_TELEMETRY = 2
+KIND_INDEX = 0xFF
+
+NO_SEQ = 0xFF
+
+CONFIG_PAYLOAD = struct.Struct("<IBBhB")                  # freq, long on time, 5V, bias mV, running
+INDEX_PAYLOAD = struct.Struct("<QQII")                    # first time ns, last time ns, records, dropped so far
+
+# records waiting for the writer thread before new ones are dropped
+DEFAULT_QUEUE_SIZE = 65536
+FLUSH_INTERVAL = 1.0  # seconds
+
+
+def pack_record(time_ns, kind, device, seq, payload):
+    return RECORD_HEADER.pack(time_ns, kind, device, seq, 0) + payload.ljust(PAYLOAD_SIZE, b"\0")
+
+
+class ExperimentLogger:
+    def __init__(self, path, queue_size=DEFAULT_QUEUE_SIZE):
+        self.file = open(path, "wb")
+        self.file.write(HEADER_FORMAT.pack(MAGIC, VERSION, RECORD_SIZE, INDEX_INTERVAL, time.time_ns())
+                        .ljust(RECORD_SIZE, b"\0"))
+
+        self.queue = queue.Queue(maxsize=queue_size)
+        self.devices = {}
+        self.dropped = 0
+        self.written = 0
+
+        # the block the next index record describes
+        self.block_records = 0
+        self.block_first = 0
+        self.block_last = 0
+
+        self.writer = threading.Thread(target=self._write_loop, daemon=True)
+        self.writer.start()
+
+    def attach(self, gen):
+        # Logs everything a FunctionGenerator reports
+        gen.config_callbacks.append(lambda gen, config, seq: self.log_config(gen.port, config, seq))
+        gen.telemetry_callbacks.append(lambda gen, record: self.log_telemetry(gen.port, record))
+
+    def _device(self, port):
+        device = self.devices.get(port)
+        if device is None:
+            device = len(self.devices)
+            self.devices[port] = device
+            self._put(pack_record(time.time_ns(), KIND_DEVICE, device, NO_SEQ, port.encode()[:PAYLOAD_SIZE]))
+        return device
+
+    def _put(self, record):
+        try:
+            self.queue.put_nowait(record)
+        except queue.Full:
+            self.dropped += 1
+
+    def log_config(self, port, config, seq=None):
+        payload = CONFIG_PAYLOAD.pack(config.freq_hz, config.long_on_time, config.out_5v, config.bias_mv,
+                                      config.running)
+        self._put(pack_record(time.time_ns(), KIND_CONFIG, self._device(port), NO_SEQ if seq is None else seq,
+                              payload))
+
+    def log_telemetry(self, port, record):
+        payload = TELEMETRY_FORMAT.pack(*(record[field] for field in TELEMETRY_FIELDS))
+        self._put(pack_record(time.time_ns(), KIND_TELEMETRY, self._device(port), NO_SEQ, payload))
+
+    def close(self):
+        self.queue.put(None)
+        self.writer.join()
+        self.file.close()
+
+    # the writer takes whatever has queued up and writes it in one go, adding
+    # the index records as the blocks fill
+    def _write_loop(self):
+        last_flush = time.monotonic()
+        while True:
+            try:
+                records = [self.queue.get(timeout=FLUSH_INTERVAL)]
+            except queue.Empty:
+                records = []
+            while records and records[-1] is not None and len(records) < INDEX_INTERVAL:
+                try:
+                    records.append(self.queue.get_nowait())
+                except queue.Empty:
+                    break
+
+            closing = bool(records) and records[-1] is None
+            if closing:
+                records.pop()
+
+            out = bytearray()
+            for record in records:
+                out += record
+                self._count(record, out)
+            self.file.write(out)
+            self.written += len(records)
+
+            if closing:
+                self.file.flush()
+                return
+            if time.monotonic() - last_flush >= FLUSH_INTERVAL:
+                self.file.flush()
+                last_flush = time.monotonic()
+
+    def _count(self, record, out):
+        time_ns = RECORD_HEADER.unpack_from(record)[0]
+        if self.block_records == 0:
+            self.block_first = time_ns
+        self.block_last = time_ns
+        self.block_records += 1
+        if self.block_records == INDEX_INTERVAL:
+            payload = INDEX_PAYLOAD.pack(self.block_first, self.block_last, self.block_records, self.dropped)
+            out += pack_record(time_ns, KIND_INDEX, 0, NO_SEQ, payload)
+            self.block_records = 0
+
+
+class LogReader:
+    # Memory maps a log. Records are read straight out of the map, nothing is
+    # loaded up front
+    def __init__(self, path):
+        self.file = open(path, "rb")
+        self.map = mmap.mmap(self.file.fileno(), 0, access=mmap.ACCESS_READ)
+        magic, version, record_size, self.index_interval, self.start_ns = HEADER_FORMAT.unpack_from(self.map)
+        if magic != MAGIC or version != VERSION or record_size != RECORD_SIZE:
+            raise ValueError("{} is not a version {} experiment log".format(path, VERSION))
+        self.num_slots = len(self.map) // RECORD_SIZE - 1
+
+        # device number -> port, filled in from the device records. The kind
+        # bytes are picked out with one strided slice rather than a Python loop
+        # over every record
+        self.devices = {}
+        kinds = self.map[RECORD_SIZE + 8::RECORD_SIZE]
+        number = kinds.find(KIND_DEVICE)
+        while number >= 0:
+            _, _, device, _, payload = self.slot(number)
+            self.devices[device] = payload.rstrip(b"\0").decode()
+            number = kinds.find(KIND_DEVICE, number + 1)
+
+    def close(self):
+        self.map.close()
+        self.file.close()
+
+    def slot(self, number):
+        offset = (number + 1) * RECORD_SIZE
+        time_ns, kind, device, seq, _ = RECORD_HEADER.unpack_from(self.map, offset)
+        return time_ns, kind, device, seq, self.map[offset + PAYLOAD_OFFSET:offset + RECORD_SIZE]
+
+    def records(self, start_slot=0):
+        # (time ns, kind, device, seq, payload) for every data record from start_slot
+        for number in range(start_slot, self.num_slots):
+            record = self.slot(number)
+            if record[1] != KIND_INDEX:
+                yield record
+
+    def seek_time(self, time_ns):
+        # First slot of the block holding time_ns, found by a binary search over
+        # the index records only
+        num_blocks = self.num_slots // (self.index_interval + 1)
+        low, high = 0, num_blocks
+        while low < high:
+            middle = (low + high) // 2
+            index_slot = (middle + 1) * (self.index_interval + 1) - 1
+            _, last_ns, _, _ = INDEX_PAYLOAD.unpack_from(self.slot(index_slot)[4])
+            if last_ns < time_ns:
+                low = middle + 1
+            else:
+                high = middle
+        return low * (self.index_interval + 1)
+
+    def rows(self, start_ns=None):
+        # One dict per config or telemetry record, in the order they were logged
+        start_slot = 0 if start_ns is None else self.seek_time(start_ns)
+        for time_ns, kind, device, seq, payload in self.records(start_slot):
+            if start_ns is not None and time_ns < start_ns:
+                continue
+            row = {"time_s": time_ns / 1e9, "port": self.devices.get(device, device)}
+            if kind == KIND_CONFIG:
+                row["kind"] = "config"
+                row["seq"] = None if seq == NO_SEQ else seq
+                row.update(zip(CONFIG_FIELDS, CONFIG_PAYLOAD.unpack_from(payload)))
+            elif kind == KIND_TELEMETRY:
+                row["kind"] = "telemetry"
+                row.update(zip(TELEMETRY_FIELDS, TELEMETRY_FORMAT.unpack_from(payload)))
+            else:
+                continue
+            yield row
+
+
+CONFIG_FIELDS = ("freq_hz", "long_on_time", "out_5v", "bias_mv", "running")
+# seq is the acknowledged change for a config and the record number for telemetry
+CSV_COLUMNS = ("time_s", "port", "kind", "seq") + CONFIG_FIELDS + TELEMETRY_FIELDS[2:]
+
+
+def to_csv(reader, path):
+    with open(path, "w") as f:
+        f.write(",".join(CSV_COLUMNS) + "\n")
+        for row in reader.rows():
+            f.write(",".join("" if row.get(column) is None else str(row.get(column)) for column in CSV_COLUMNS) + "\n")
+
+
+def to_columns(reader, directory):
+    # One raw little endian array per field and table (config and telemetry),
+    # with a schema.json giving each file's numpy dtype, so the columns can be
+    # loaded with numpy.fromfile or pandas without parsing text
+    tables = {
+        "config": {"time_s": array.array("d"), "device": array.array("B"), "seq": array.array("h"),
+                   **{field: array.array(code) for field, code in zip(CONFIG_FIELDS, "IBBhB")}},
+        "telemetry": {"time_s": array.array("d"), "device": array.array("B"),
+                      **{field: array.array(code) for field, code in zip(TELEMETRY_FIELDS, "BBBBIIIIIBBBBHHIhh")}},
+    }
+    for time_ns, kind, device, seq, payload in reader.records():
+        if kind == KIND_CONFIG:
+            table = tables["config"]
+            values = CONFIG_PAYLOAD.unpack_from(payload)
+            table["seq"].append(-1 if seq == NO_SEQ else seq)
+            fields = CONFIG_FIELDS
+        elif kind == KIND_TELEMETRY:
+            table = tables["telemetry"]
+            values = TELEMETRY_FORMAT.unpack_from(payload)
+            fields = TELEMETRY_FIELDS
+        else:
+            continue
+        table["time_s"].append(time_ns / 1e9)
+        table["device"].append(device)
+        for field, value in zip(fields, values):
+            table[field].append(value)
+
+    os.makedirs(directory, exist_ok=True)
+    schema = {"devices": reader.devices, "tables": {}}
+    for name, columns in tables.items():
+        schema["tables"][name] = {}
+        for field, values in columns.items():
+            if sys.byteorder != "little":
+                values.byteswap()
+            filename = "{}.{}.bin".format(name, field)
+            with open(os.path.join(directory, filename), "wb") as f:
+                values.tofile(f)
+            kind = "f" if values.typecode == "d" else ("i" if values.typecode in "bhilq" else "u")
+            schema["tables"][name][field] = {"file": filename, "dtype": "<{}{}".format(kind, values.itemsize)}
+    with open(os.path.join(directory, "schema.json"), "w") as f:
+        json.dump(schema, f, indent=2)
+        f.write("\n")
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Convert an experiment log")
+    parser.add_argument("log")
+    parser.add_argument("--csv", help="write every record as a CSV row")
+    parser.add_argument("--columns", help="write one array file per field into this directory")
+    args = parser.parse_args()
+
+    reader = LogReader(args.log)
+    if args.csv:
+        to_csv(reader, args.csv)
+    if args.columns:
+        to_columns(reader, args.columns)
+    if not args.csv and not args.columns:
+        print("{} records, devices {}".format(reader.num_slots, reader.devices))
+    reader.close()
+
+
+if __name__ == "__main__":
+    main()
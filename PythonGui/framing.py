@@ -0,0 +1,113 @@
+"""
+framing.py
+ Byte stuffing for the function generator's serial protocol. Frames are
+ delimited by 0x7E and any 0x7E or 0x7D inside a frame is sent as 0x7D
+ followed by the byte XORed with 0x20.
+
+ escape_payload() and unescape_payload() do the work with bytes.replace(),
+ which runs in C over the whole buffer. The byte at a time versions are kept
+ as the fallback for malformed escapes and as the reference the fast ones
+ are benchmarked against (see codec_bench.py).
+"""
+
+FRAME_DELIMITER = 0x7E
+ESCAPE = 0x7D
+XOR_VALUE = 0x20
+
+_DELIMITER = bytes([FRAME_DELIMITER])
+_ESCAPE = bytes([ESCAPE])
+_ESCAPED_DELIMITER = bytes([ESCAPE, FRAME_DELIMITER ^ XOR_VALUE])
+_ESCAPED_ESCAPE = bytes([ESCAPE, ESCAPE ^ XOR_VALUE])
+
+
+def escape_payload_py(data):
+    escaped = bytearray()
+    for byte in data:
+        if byte == FRAME_DELIMITER or byte == ESCAPE:
+            escaped.append(ESCAPE)
+            escaped.append(byte ^ XOR_VALUE)
+        else:
+            escaped.append(byte)
+    return bytes(escaped)
+
+
+def unescape_payload_py(escaped):
+    # Same rules as decodeFrame() in the firmware: whatever follows an escape
+    # is XORed, whether or not it needed escaping
+    unescaped = bytearray()
+    i = 0
+    while i < len(escaped):
+        byte = escaped[i]
+        if byte == ESCAPE:
+            i += 1
+            if i == len(escaped):
+                raise ValueError("Frame ends in an escape byte")
+            unescaped.append(escaped[i] ^ XOR_VALUE)
+        else:
+            unescaped.append(byte)
+        i += 1
+    return bytes(unescaped)
+
+
+def escape_payload(data):
+    # The escapes have to go first, otherwise the ones added for the
+    # delimiters would be escaped again
+    return bytes(data).replace(_ESCAPE, _ESCAPED_ESCAPE).replace(_DELIMITER, _ESCAPED_DELIMITER)
+
+
+def unescape_payload(escaped):
+    escaped = bytes(escaped)
+    if _ESCAPE not in escaped:
+        return escaped
+
+    # When every escape is one of the two pairs the sender makes, the pairs can
+    # not overlap and two replaces undo them. Anything else takes the slow path
+    num_escapes = escaped.count(_ESCAPE)
+    num_pairs = escaped.count(_ESCAPED_DELIMITER) + escaped.count(_ESCAPED_ESCAPE)
+    if num_escapes != num_pairs:
+        return unescape_payload_py(escaped)
+    return escaped.replace(_ESCAPED_DELIMITER, _DELIMITER).replace(_ESCAPED_ESCAPE, _ESCAPE)
+
+
+def escape_data(bytestring):
+    # Escapes the payload and adds the delimiters, ready to write to the port
+    return _DELIMITER + escape_payload(bytestring) + _DELIMITER
+
+
+def unescape_data(escaped_frame):
+    # Check and remove frame delimiters
+    if escaped_frame[0] != FRAME_DELIMITER or escaped_frame[-1] != FRAME_DELIMITER:
+        raise ValueError("Invalid frame delimiters")
+
+    return unescape_payload(escaped_frame[1:-1])
+
+
+class FrameDecoder:
+    # Incremental decoder. Bytes can be fed in whatever chunks the serial port
+    # returns, and every complete frame comes back unescaped. The partial frame
+    # at the end of a chunk is kept until the rest of it arrives
+    MAX_FRAME_SIZE = 1024
+
+    def __init__(self):
+        self.partial = bytearray()
+
+    def feed(self, data):
+        self.partial.extend(data)
+        pieces = self.partial.split(_DELIMITER)
+        self.partial = pieces.pop()
+
+        # Without a delimiter for this long the stream is garbage, drop it and
+        # resync on the next one
+        if len(self.partial) > self.MAX_FRAME_SIZE:
+            self.partial.clear()
+
+        frames = []
+        for piece in pieces:
+            # Back to back delimiters give empty pieces
+            if not piece or len(piece) > self.MAX_FRAME_SIZE:
+                continue
+            try:
+                frames.append(unescape_payload(piece))
+            except ValueError:
+                pass
+        return frames
@@ -0,0 +1,731 @@
+"""
+function_generator.py
+ asyncio client for the MTJ function generator. Nothing in here touches Tk,
+ so it can drive scripted experiments as well as the GUI.
+
+ Commands are acknowledged by the device itself: every configuration change
+ carries a sequence number, and the device echoes the configuration with that
+ number once the outputs have been updated. Several commands can be in flight
+ at once, and a sweep steps as fast as the device applies each step.
+
+ For interactive edits, CoalescingSender keeps only the newest configuration
+ and sends it once the previous one has been applied, so a dragged slider does
+ not queue up every intermediate value.
+
+ GeneratorGroup connects to every generator on the host at once and sends
+ broadcast commands (start all, stop all, trigger all) back to back, reporting
+ the skew between the devices.
+
+ Example:
+   async def main():
+       gen = await FunctionGenerator.connect()
+       await gen.set_frequency(10000)
+       await gen.set_bias(0.5)
+       await gen.run()
+       await gen.sweep("freq_hz", range(1000, 20001, 1000), dwell=0.1)
+       await gen.close()
+
+   asyncio.run(main())
+"""
+
+import asyncio
+import struct
+import threading
+import time
+from dataclasses import dataclass, replace
+
+import serial
+import serial.tools.list_ports
+
+from framing import escape_data, FrameDecoder
+
+# from USB_DEVICE/App/usbd_desc.c
+USB_VID = 1155
+USB_PID = 22336
+USB_PRODUCT = "MTJ Function Generator"
+
+CMD_QUERY_CONFIG = 0xAA
+CMD_TELEMETRY = 0xAB
+CMD_TRIGGER = 0xAC
+CMD_ARM = 0xAD
+CMD_DIAGNOSTICS = 0xAE
+CMD_PRESET_SELECT = 0xAF
+CMD_PRESET_SAVE = 0xB0
+CMD_PRESET_GET = 0xB1
+CMD_BIAS_TABLE_LOAD = 0xB2
+CMD_BIAS_TABLE_START = 0xB3
+CMD_BIAS_TABLE_STOP = 0xB4
+CMD_DAC_CAL_HOLD = 0xB5
+CMD_DAC_CAL_LOAD = 0xB6
+CMD_DAC_CAL_SAVE = 0xB7
+CMD_DAC_CAL_GET = 0xB8
+
+CONFIG_FRAME_SIZE = 9
+CONFIG_SEQ_FRAME_SIZE = 10
+TELEMETRY_RECORD_TYPE = 0xC1
+DIAGNOSTICS_RECORD_TYPE = 0xD1
+PRESET_RECORD_TYPE = 0xE1
+DAC_CAL_RECORD_TYPE = 0xE2
+
+# from Core/Inc/presets.h
+NUM_PRESETS = 16
+PRESET_NAME_LEN = 12
+PRESET_FORMAT = struct.Struct("<BBB12sihBB")
+
+# from Core/Inc/outputs.h and Core/Inc/serial.h
+BIAS_TABLE_MAX_STEPS = 256
+BIAS_TABLE_MAX_CODES = 2048
+BIAS_TABLE_CHUNK = 16
+
+# from Core/Inc/dac_cal.h
+DAC_CAL_MAX_POINTS = 16
+DAC_CAL_MAX_MV = 3300  # the same as the bias setting range
+DAC_CAL_MAX_CODE = 4095
+DAC_CAL_HOLD_OFF = 0xFFFF
+DAC_CAL_FORMAT = struct.Struct("<BBBB{}H".format(2 * DAC_CAL_MAX_POINTS))
+
+# limits of the settings table in main_task.c
+FREQ_MIN_HZ = 1
+FREQ_MAX_HZ = 125000
+BIAS_MIN_V = -3.3
+BIAS_MAX_V = 3.3
+MAX_TELEMETRY_RATE_HZ = 1000
+
+# keeps the queued frames well inside the 250 byte receive queue on the device
+DEFAULT_MAX_IN_FLIGHT = 8
+DEFAULT_ACK_TIMEOUT = 1.0
+
+TELEMETRY_FORMAT = struct.Struct("<BBBBIIIII4BHHIhh")
+TELEMETRY_FIELDS = ("type", "seq", "run_state", "vcom_depth", "timestamp_ms", "pulses", "period_100ns",
+                    "reconfig_max_cycles", "irq_off_max_cycles", "cpu_total", "cpu_main", "cpu_display",
+                    "cpu_serial", "reconfig_count", "dropped", "trigger_last_cycles", "out4_sense_mv", "out4_trim")
+TELEMETRY_STATE_SENSE = 0x40  # out4_sense_mv is a reading of the bias now on output 4
+
+# from Core/Inc/diagnostics.h and trace.h
+DIAG_HEADER_FORMAT = struct.Struct("<BBBBHBI")
+DIAG_TASK_FORMAT = struct.Struct("<8sHHI")
+DIAG_ISR_FORMAT = struct.Struct("<HIII")
+ISR_NAMES = ("usb", "output_dma", "uart", "encoder", "tick", "neopixel")
+DIAG_BOOT_FORMAT = struct.Struct("<I")
+BOOT_STEP_NAMES = ("clocks", "first_edge", "display", "usb")
+
+
+class AckTimeout(Exception):
+    pass
+
+
+@dataclass(frozen=True)
+class Config:
+    freq_hz: int = 1000
+    long_on_time: bool = False
+    out_5v: bool = False
+    bias_mv: int = 0
+    running: bool = False
+
+    @property
+    def bias_v(self):
+        return self.bias_mv / 1000
+
+    def encode(self):
+        # Host to device layout. The device reports the voltage and running
+        # bytes the other way round, see decode_config()
+        return struct.pack("<IBBHB", self.freq_hz, int(self.long_on_time), int(self.out_5v),
+                           self.bias_mv + 5000, int(self.running))
+
+    def check(self):
+        if not FREQ_MIN_HZ <= self.freq_hz <= FREQ_MAX_HZ:
+            raise ValueError("frequency must be {} to {} Hz".format(FREQ_MIN_HZ, FREQ_MAX_HZ))
+        if not round(BIAS_MIN_V * 1000) <= self.bias_mv <= round(BIAS_MAX_V * 1000):
+            raise ValueError("bias must be {} to {} V".format(BIAS_MIN_V, BIAS_MAX_V))
+
+
+def decode_config(frame):
+    freq, on_time, out_voltage, bias, running = struct.unpack("<IBBHB", frame)
+    return Config(freq_hz=freq, long_on_time=on_time != 0, out_5v=out_voltage == 0,
+                  bias_mv=bias - 5000, running=running == 0)
+
+
+def decode_telemetry(frame):
+    if len(frame) != TELEMETRY_FORMAT.size or frame[0] != TELEMETRY_RECORD_TYPE:
+        return None
+    return dict(zip(TELEMETRY_FIELDS, TELEMETRY_FORMAT.unpack(frame)))
+
+
+def decode_diagnostics(frame):
+    # Percentages are over the device's measurement window, stack is the least
+    # free stack each task has had, in words. Boot times are microseconds
+    # since reset, None for a step that has not happened yet. relay_ops is
+    # how many times each output voltage relay has switched, across resets
+    if len(frame) < DIAG_HEADER_FORMAT.size or frame[0] != DIAGNOSTICS_RECORD_TYPE:
+        return None
+    (_, num_tasks, num_isrs, window_10ms, cpu_permille, num_boot_steps,
+     relay_ops) = DIAG_HEADER_FORMAT.unpack_from(frame)
+    if len(frame) != (DIAG_HEADER_FORMAT.size + num_tasks * DIAG_TASK_FORMAT.size + num_isrs * DIAG_ISR_FORMAT.size +
+                      num_boot_steps * DIAG_BOOT_FORMAT.size):
+        return None
+
+    offset = DIAG_HEADER_FORMAT.size
+    tasks = []
+    for _ in range(num_tasks):
+        name, task_permille, stack_free, switches = DIAG_TASK_FORMAT.unpack_from(frame, offset)
+        tasks.append({"name": name.rstrip(b"\0").decode(errors="replace"), "cpu_percent": task_permille / 10,
+                      "stack_free_words": stack_free, "switches": switches})
+        offset += DIAG_TASK_FORMAT.size
+    isrs = {}
+    for index in range(num_isrs):
+        isr_permille, count, mean_cycles, max_cycles = DIAG_ISR_FORMAT.unpack_from(frame, offset)
+        name = ISR_NAMES[index] if index < len(ISR_NAMES) else "isr{}".format(index)
+        isrs[name] = {"cpu_percent": isr_permille / 10, "count": count, "mean_cycles": mean_cycles,
+                      "max_cycles": max_cycles}
+        offset += DIAG_ISR_FORMAT.size
+    boot_us = {}
+    for index in range(num_boot_steps):
+        (us,) = DIAG_BOOT_FORMAT.unpack_from(frame, offset)
+        name = BOOT_STEP_NAMES[index] if index < len(BOOT_STEP_NAMES) else "step{}".format(index)
+        boot_us[name] = us or None
+        offset += DIAG_BOOT_FORMAT.size
+    return {"window_ms": window_10ms * 10, "cpu_percent": cpu_permille / 10, "tasks": tasks, "isrs": isrs,
+            "boot_us": boot_us, "relay_ops": relay_ops}
+
+
+def decode_preset(frame):
+    # Returns (slot, name, Config) with running left False, or (slot, None,
+    # None) for an empty slot
+    if len(frame) != PRESET_FORMAT.size or frame[0] != PRESET_RECORD_TYPE:
+        return None
+    _, slot, used, name, freq, bias, out_mode, out_voltage = PRESET_FORMAT.unpack(frame)
+    if not used:
+        return slot, None, None
+    config = Config(freq_hz=freq, long_on_time=out_mode == 0, out_5v=out_voltage != 0, bias_mv=bias)
+    return slot, name.rstrip(b"\0").decode(errors="replace"), config
+
+
+def decode_dac_cal(frame):
+    # Returns (sign, [(mV, code), ...], stored). stored is False while the
+    # device is on its nominal calibration
+    if len(frame) != DAC_CAL_FORMAT.size or frame[0] != DAC_CAL_RECORD_TYPE:
+        return None
+    values = DAC_CAL_FORMAT.unpack(frame)
+    _, polarity, num_points, stored = values[:4]
+    pairs = values[4:]
+    points = [(pairs[2 * p], pairs[2 * p + 1]) for p in range(min(num_points, DAC_CAL_MAX_POINTS))]
+    return (1 if polarity else -1), points, stored != 0
+
+
+def discover():
+    # Returns the ports that enumerate as the function generator
+    ports = []
+    for port in sorted(serial.tools.list_ports.comports()):
+        if (port.vid == USB_VID and port.pid == USB_PID) or USB_PRODUCT in (port.product or ""):
+            ports.append(port.device)
+    return ports
+
+
+class FunctionGenerator:
+    def __init__(self, ser, loop, max_in_flight=DEFAULT_MAX_IN_FLIGHT, ack_timeout=DEFAULT_ACK_TIMEOUT):
+        self.ser = ser
+        self.port = ser.port
+        self.loop = loop
+        self.ack_timeout = ack_timeout
+        self.config = None
+
+        # called from the event loop as callback(gen, config, seq) for every
+        # config the device reports. seq is the sequence number of the change
+        # it acknowledges, or None for a query reply or a front panel change
+        self.config_callbacks = []
+        self.telemetry_callbacks = []
+
+        # (sequence number or None for a query, future) in the order they were sent
+        self.pending = []
+        self.pending_diagnostics = []
+        self.pending_presets = []
+        self.pending_dac_cal = []
+        self.next_seq = 0
+        self.last_seq = None
+        self.in_flight = asyncio.Semaphore(max_in_flight)
+        self.write_lock = threading.Lock()
+
+        self.running = True
+        self.reader = threading.Thread(target=self._read_loop, daemon=True)
+
+    @classmethod
+    async def connect(cls, port=None, baudrate=1000000, **kwargs):
+        # Opens the port (the first discovered device if none is given) and
+        # waits for the current configuration
+        if port is None:
+            ports = discover()
+            if not ports:
+                raise ConnectionError("No function generator found")
+            port = ports[0]
+
+        ser = serial.Serial(port, baudrate=baudrate, timeout=0.1)
+        gen = cls(ser, asyncio.get_running_loop(), **kwargs)
+        gen.reader.start()
+        try:
+            await gen.query()
+        except AckTimeout:
+            await gen.close()
+            raise ConnectionError("{} did not answer the configuration query".format(port))
+        return gen
+
+    async def close(self):
+        self.running = False
+        await self.loop.run_in_executor(None, self.reader.join)
+        self.ser.close()
+        for _, future in self.pending:
+            if not future.done():
+                future.cancel()
+        self.pending.clear()
+
+    # the serial port is read in its own thread, blocking in chunks, and whole
+    # frames are handed to the event loop
+    def _read_loop(self):
+        decoder = FrameDecoder()
+        while self.running:
+            try:
+                data = self.ser.read(max(1, self.ser.in_waiting))
+            except serial.SerialException:
+                break
+            if data:
+                frames = decoder.feed(data)
+                if frames:
+                    self.loop.call_soon_threadsafe(self._handle_frames, frames)
+
+    def _handle_frames(self, frames):
+        for frame in frames:
+            if len(frame) == CONFIG_FRAME_SIZE:
+                self._handle_config(decode_config(frame), None)
+            elif len(frame) == CONFIG_SEQ_FRAME_SIZE:
+                self._handle_config(decode_config(frame[:CONFIG_FRAME_SIZE]), frame[CONFIG_FRAME_SIZE])
+            elif frame and frame[0] == DIAGNOSTICS_RECORD_TYPE:
+                diagnostics = decode_diagnostics(frame)
+                if diagnostics is not None and self.pending_diagnostics:
+                    future = self.pending_diagnostics.pop(0)
+                    if not future.done():
+                        future.set_result(diagnostics)
+            elif frame and frame[0] == PRESET_RECORD_TYPE:
+                preset = decode_preset(frame)
+                if preset is not None and self.pending_presets:
+                    future = self.pending_presets.pop(0)
+                    if not future.done():
+                        future.set_result(preset)
+            elif frame and frame[0] == DAC_CAL_RECORD_TYPE:
+                cal = decode_dac_cal(frame)
+                if cal is not None and self.pending_dac_cal:
+                    future = self.pending_dac_cal.pop(0)
+                    if not future.done():
+                        future.set_result(cal)
+            else:
+                record = decode_telemetry(frame)
+                if record is not None:
+                    for callback in self.telemetry_callbacks:
+                        callback(self, record)
+
+    def _handle_config(self, config, seq):
+        self.config = config
+
+        for index, (pending_seq, future) in enumerate(self.pending):
+            # The device applies changes in order and only echoes the newest
+            # one when several arrive together, so an echo also acknowledges
+            # every change sent before it
+            if seq is not None and pending_seq == seq:
+                for _, earlier in self.pending[:index + 1]:
+                    if not earlier.done():
+                        earlier.set_result(config)
+                del self.pending[:index + 1]
+                break
+
+            # a query takes the next config without a sequence number
+            if seq is None and pending_seq is None:
+                future.set_result(config)
+                del self.pending[index]
+                break
+
+        for callback in self.config_callbacks:
+            callback(self, config, seq)
+
+    def _write(self, data):
+        with self.write_lock:
+            self.ser.write(data)
+
+    async def _command(self, message, seq):
+        # Sends the message and waits for the echo of seq, or for the next
+        # config reply if seq is None
+        async with self.in_flight:
+            return await self._wait(self._send(message, seq))
+
+    def _send(self, message, seq):
+        future = self.loop.create_future()
+        self.pending.append((seq, future))
+        self._write(message)
+        return future
+
+    async def _wait(self, future):
+        try:
+            return await asyncio.wait_for(future, self.ack_timeout)
+        except asyncio.TimeoutError:
+            self.pending = [entry for entry in self.pending if entry[1] is not future]
+            raise AckTimeout("no acknowledgement from {}".format(self.port))
+
+    def _config_message(self, config):
+        config.check()
+        seq = self.next_seq
+        self.next_seq = (seq + 1) & 0xFF
+        self.last_seq = seq
+        return seq, escape_data(config.encode() + bytes([seq]))
+
+    async def query(self):
+        return await self._command(escape_data([CMD_QUERY_CONFIG]), None)
+
+    async def apply(self, config):
+        # Sends a whole configuration and returns what the device reports once
+        # its outputs have been updated
+        seq, message = self._config_message(config)
+        return await self._command(message, seq)
+
+    def submit(self, config):
+        # Pipelined version of apply(), returns a task so many changes can be
+        # queued without waiting for each acknowledgement in turn
+        return self.loop.create_task(self.apply(config))
+
+    async def update(self, **changes):
+        # Changes some fields of the last reported configuration
+        return await self.apply(replace(self.config, **changes))
+
+    async def set_frequency(self, hz):
+        return await self.update(freq_hz=int(hz))
+
+    async def set_bias(self, volts):
+        return await self.update(bias_mv=int(round(volts * 1000)))
+
+    async def set_on_time(self, long_on_time):
+        return await self.update(long_on_time=bool(long_on_time))
+
+    async def set_output_voltage(self, out_5v):
+        return await self.update(out_5v=bool(out_5v))
+
+    async def run(self, running=True):
+        return await self.update(running=bool(running))
+
+    async def stop(self):
+        return await self.run(False)
+
+    async def sweep(self, field, values, dwell=0.0, callback=None):
+        # Steps one Config field through values, leaving the rest as they are.
+        # Each step is held for dwell seconds after the device acknowledges it.
+        # Steps are not pipelined, the device would only apply the last of the
+        # changes that arrive together
+        base = self.config
+        configs = [replace(base, **{field: value}) for value in values]
+        for config in configs:
+            config.check()
+
+        results = []
+        for config in configs:
+            results.append(await self.apply(config))
+            if callback:
+                callback(results[-1])
+            if dwell > 0:
+                await asyncio.sleep(dwell)
+        return results
+
+    def coalescer(self, min_interval=0.0):
+        return CoalescingSender(self, min_interval)
+
+    async def arm(self):
+        # Loads the configuration with the outputs held until trigger()
+        self._write(escape_data([CMD_ARM]))
+
+    async def trigger(self):
+        # Sent on its own so the device can fire straight from the USB interrupt
+        self._write(escape_data([CMD_TRIGGER]))
+
+    async def diagnostics(self):
+        # Per task cpu use, stack high water marks and context switches, and
+        # the time spent in each group of interrupts
+        future = self.loop.create_future()
+        self.pending_diagnostics.append(future)
+        self._write(escape_data([CMD_DIAGNOSTICS]))
+        try:
+            return await asyncio.wait_for(future, self.ack_timeout)
+        except asyncio.TimeoutError:
+            if future in self.pending_diagnostics:
+                self.pending_diagnostics.remove(future)
+            raise AckTimeout("no diagnostics from {}".format(self.port))
+
+    async def select_preset(self, slot):
+        # Switches to a stored preset, keeping the running state, and returns
+        # the configuration. Times out if the slot is empty
+        if not 0 <= slot < NUM_PRESETS:
+            raise ValueError("preset must be 0 to {}".format(NUM_PRESETS - 1))
+        return await self._command(escape_data([CMD_PRESET_SELECT, slot]), None)
+
+    async def get_preset(self, slot):
+        # (slot, name, Config) of a stored preset, name and Config are None
+        # if the slot is empty
+        if not 0 <= slot < NUM_PRESETS:
+            raise ValueError("preset must be 0 to {}".format(NUM_PRESETS - 1))
+        future = self.loop.create_future()
+        self.pending_presets.append(future)
+        self._write(escape_data([CMD_PRESET_GET, slot]))
+        try:
+            return await asyncio.wait_for(future, self.ack_timeout)
+        except asyncio.TimeoutError:
+            if future in self.pending_presets:
+                self.pending_presets.remove(future)
+            raise AckTimeout("no preset from {}".format(self.port))
+
+    async def list_presets(self):
+        # {slot: (name, Config)} of the stored presets
+        presets = {}
+        for slot in range(NUM_PRESETS):
+            _, name, config = await self.get_preset(slot)
+            if config is not None:
+                presets[slot] = (name, config)
+        return presets
+
+    async def save_preset(self, slot, name=""):
+        # Stores the current configuration of the device in the slot. The
+        # device writes it to flash in the background, so this polls until
+        # the slot holds it
+        if not 0 <= slot < NUM_PRESETS:
+            raise ValueError("preset must be 0 to {}".format(NUM_PRESETS - 1))
+        encoded = name.encode()[:PRESET_NAME_LEN]
+        if not encoded:
+            encoded = "Preset {}".format(slot + 1).encode()
+        self._write(escape_data(bytes([CMD_PRESET_SAVE, slot]) + encoded.ljust(PRESET_NAME_LEN, b"\0")))
+
+        deadline = self.loop.time() + self.ack_timeout
+        while self.loop.time() < deadline:
+            await asyncio.sleep(0.05)
+            _, saved_name, config = await self.get_preset(slot)
+            if (config is not None and saved_name == encoded.decode(errors="replace") and
+                    (self.config is None or config == replace(self.config, running=False))):
+                return config
+        raise AckTimeout("preset {} was not saved on {}".format(slot, self.port))
+
+    async def load_bias_table(self, steps_v):
+        # Sends the bias of each step of a table, in volts. Steps of the other
+        # sign from the configured bias swap output 4 between its MOSFETs,
+        # which restarts the outputs when the table starts. A step of 0 is 0V
+        if not 0 < len(steps_v) <= BIAS_TABLE_MAX_STEPS:
+            raise ValueError("a bias table has 1 to {} steps".format(BIAS_TABLE_MAX_STEPS))
+        steps_mv = [round(max(BIAS_MIN_V, min(v, BIAS_MAX_V)) * 1000) for v in steps_v]
+        for first in range(0, len(steps_mv), BIAS_TABLE_CHUNK):
+            chunk = steps_mv[first:first + BIAS_TABLE_CHUNK]
+            chunk += [0] * (BIAS_TABLE_CHUNK - len(chunk))
+            self._write(escape_data(struct.pack("<BH{}h".format(BIAS_TABLE_CHUNK), CMD_BIAS_TABLE_LOAD,
+                                                first, *chunk)))
+
+    async def start_bias_table(self, num_steps, pulses_per_step=1, repeat=True):
+        # Steps the bias through the loaded table, one step every
+        # pulses_per_step pulses, starting on the next pulse. The outputs have
+        # to be running and any configuration change stops the table
+        if num_steps * pulses_per_step > BIAS_TABLE_MAX_CODES:
+            raise ValueError("a bias table covers at most {} pulses".format(BIAS_TABLE_MAX_CODES))
+        self._write(escape_data(struct.pack("<BHHB", CMD_BIAS_TABLE_START, num_steps, pulses_per_step,
+                                            int(repeat))))
+
+    async def alternate_bias(self, volts, every=1):
+        # Alternates output 4 between +volts and -volts every few pulses until
+        # stop_bias_table() or a configuration change
+        await self.load_bias_table([abs(volts), -abs(volts)])
+        await self.start_bias_table(2, every, repeat=True)
+
+    async def stop_bias_table(self):
+        self._write(escape_data([CMD_BIAS_TABLE_STOP]))
+
+    async def hold_dac_code(self, sign, code):
+        # Sets every bias of the sign to a raw DAC code so it can be measured,
+        # None goes back to the calibration. The device only has a MOSFET on
+        # for the configured sign, so the bias has to be set to that sign
+        if code is None:
+            code = DAC_CAL_HOLD_OFF
+        elif not 0 <= code <= DAC_CAL_MAX_CODE:
+            raise ValueError("DAC codes are 0 to {}".format(DAC_CAL_MAX_CODE))
+        self._write(escape_data(struct.pack("<BBH", CMD_DAC_CAL_HOLD, int(sign > 0), code)))
+
+    async def get_dac_cal(self, sign):
+        # (sign, [(mV, code), ...], stored) of the calibration in use
+        future = self.loop.create_future()
+        self.pending_dac_cal.append(future)
+        self._write(escape_data([CMD_DAC_CAL_GET, int(sign > 0)]))
+        try:
+            return await asyncio.wait_for(future, self.ack_timeout)
+        except asyncio.TimeoutError:
+            if future in self.pending_dac_cal:
+                self.pending_dac_cal.remove(future)
+            raise AckTimeout("no calibration from {}".format(self.port))
+
+    async def save_dac_cal(self, tables):
+        # Loads {sign: [(mV, code), ...]} and writes it to the device's flash.
+        # The mV are bias magnitudes going up and the codes have to go one
+        # way, an empty list is the nominal calibration for that sign. The
+        # device checks the points and skips a table it does not take, so
+        # this reads the tables back until they are in use
+        for sign, points in tables.items():
+            if len(points) > DAC_CAL_MAX_POINTS:
+                raise ValueError("a calibration has at most {} points".format(DAC_CAL_MAX_POINTS))
+            pairs = [value for point in points for value in point]
+            pairs += [0] * (2 * DAC_CAL_MAX_POINTS - len(pairs))
+            self._write(escape_data(struct.pack("<BBB{}H".format(2 * DAC_CAL_MAX_POINTS), CMD_DAC_CAL_LOAD,
+                                                int(sign > 0), len(points), *pairs)))
+        self._write(escape_data([CMD_DAC_CAL_SAVE]))
+
+        deadline = self.loop.time() + self.ack_timeout
+        while self.loop.time() < deadline:
+            await asyncio.sleep(0.05)
+            done = True
+            for sign, points in tables.items():
+                _, saved, stored = await self.get_dac_cal(sign)
+                if not stored or (points and saved != [tuple(point) for point in points]):
+                    done = False
+            if done:
+                return
+        raise AckTimeout("the calibration was not saved on {}".format(self.port))
+
+    async def set_telemetry_rate(self, rate_hz):
+        rate_hz = max(0, min(int(rate_hz), MAX_TELEMETRY_RATE_HZ))
+        self._write(escape_data(struct.pack("<BH", CMD_TELEMETRY, rate_hz)))
+
+
+class GeneratorGroup:
+    # Several generators driven from one event loop. Each keeps its own reader
+    # and pending commands, the group adds commands that go to all of them
+    def __init__(self, generators, failed=None):
+        self.generators = list(generators)
+        # port -> exception for the ones that did not connect
+        self.failed = failed or {}
+
+    @classmethod
+    async def connect(cls, ports=None, **kwargs):
+        # Connects to every port (every discovered device if none are given)
+        # at the same time. Ports that fail are left out and listed in failed
+        if ports is None:
+            ports = discover()
+        results = await asyncio.gather(*(FunctionGenerator.connect(port, **kwargs) for port in ports),
+                                       return_exceptions=True)
+        generators = [result for result in results if isinstance(result, FunctionGenerator)]
+        failed = {port: result for port, result in zip(ports, results) if isinstance(result, Exception)}
+        return cls(generators, failed)
+
+    async def close(self):
+        await asyncio.gather(*(gen.close() for gen in self.generators))
+
+    async def broadcast(self, **changes):
+        # Applies the same changes to every generator, keeping the rest of each
+        # one's configuration. The frames are all built first and then written
+        # back to back without yielding to the loop, so they leave the host
+        # within one scheduling tick. Returns a report with the skew between
+        # the writes and between the acknowledgements
+        messages = [(gen,) + gen._config_message(replace(gen.config, **changes)) for gen in self.generators]
+
+        futures = []
+        sent = []
+        for gen, seq, message in messages:
+            futures.append(gen._send(message, seq))
+            sent.append(time.perf_counter())
+
+        acked = [None] * len(futures)
+        for index, future in enumerate(futures):
+            future.add_done_callback(lambda _, index=index: acked.__setitem__(index, time.perf_counter()))
+
+        results = await asyncio.gather(*(gen._wait(future) for (gen, _, _), future in zip(messages, futures)),
+                                       return_exceptions=True)
+        return skew_report(self.generators, sent, acked, results)
+
+    async def start_all(self):
+        return await self.broadcast(running=True)
+
+    async def stop_all(self):
+        return await self.broadcast(running=False)
+
+    async def arm_all(self):
+        # The main task of each device arms the outputs within its 10 ms loop,
+        # there is no acknowledgement for it so this just waits that out
+        for gen in self.generators:
+            await gen.arm()
+        await asyncio.sleep(0.05)
+
+    async def trigger_all(self):
+        # Starts outputs armed by arm_all(). The devices fire from the USB
+        # interrupt, so the write skew is close to the skew of the outputs
+        sent = []
+        for gen in self.generators:
+            gen._write(escape_data([CMD_TRIGGER]))
+            sent.append(time.perf_counter())
+        return skew_report(self.generators, sent, [None] * len(sent), [None] * len(sent))
+
+
+def skew_report(generators, sent, acked, results):
+    def spread_us(times):
+        times = [t for t in times if t is not None]
+        return (max(times) - min(times)) * 1e6 if times else None
+
+    return {
+        "ports": [gen.port for gen in generators],
+        "send_skew_us": spread_us(sent),
+        "ack_skew_us": spread_us(acked),
+        "errors": {gen.port: str(result) for gen, result in zip(generators, results)
+                   if isinstance(result, Exception)},
+    }
+
+
+class CoalescingSender:
+    # Latest wins sender for interactive edits. Only the newest configuration
+    # waiting is kept, and it is sent once the device has applied the one
+    # before it, so sends follow the rate the device can apply them.
+    # min_interval spaces them out further. Everything runs on the client loop,
+    # use set_threadsafe() from other threads
+    def __init__(self, gen, min_interval=0.0):
+        self.gen = gen
+        self.min_interval = min_interval
+        self.latest = None
+        self.wakeup = asyncio.Event()
+        self.last_error = None
+
+        # edits handed in against frames actually sent, to see how much was coalesced
+        self.submitted = 0
+        self.sent = 0
+
+        self.task = gen.loop.create_task(self._run())
+
+    def set(self, config):
+        self.latest = config
+        self.submitted += 1
+        self.wakeup.set()
+
+    def set_threadsafe(self, config):
+        self.gen.loop.call_soon_threadsafe(self.set, config)
+
+    def has_pending(self):
+        return self.latest is not None
+
+    async def _run(self):
+        last_send = 0.0
+        while True:
+            await self.wakeup.wait()
+            self.wakeup.clear()
+
+            wait = last_send + self.min_interval - self.gen.loop.time()
+            if wait > 0:
+                await asyncio.sleep(wait)
+
+            # take whatever is newest after the wait
+            config = self.latest
+            self.latest = None
+            if config is None or config == self.gen.config:
+                continue
+
+            last_send = self.gen.loop.time()
+            self.sent += 1
+            try:
+                await self.gen.apply(config)
+            except (AckTimeout, ValueError) as error:
+                self.last_error = error
+
+            if self.latest is not None:
+                self.wakeup.set()
+
+    async def close(self):
+        self.task.cancel()
@@ -1,293 +1,308 @@
 import tkinter as tk
 from tkinter import ttk
 
-import serial
-import serial.tools.list_ports
-
-import time
+import argparse
 
-import struct
+import asyncio
 
 import threading
 
-# Add a global variable to keep track of the last update time
-time_last_updated = 0
-update_threshold = 0.1  # seconds
+from function_generator import GeneratorGroup, Config, discover, BIAS_MIN_V, BIAS_MAX_V, FREQ_MIN_HZ, FREQ_MAX_HZ
 
-def config_serial():
-    # Get a list of available COM ports and print them out for the user to select
-    ports = list(serial.tools.list_ports.comports())
+from experiment_log import ExperimentLogger
+
+import serial.tools.list_ports
+
+# Edits are sent no faster than this even if the device keeps up
+min_send_interval = 0.02  # seconds
+
+def select_ports():
+    # Every function generator that was found is used. If none enumerate as one, list the COM ports for the user to pick
+    ports = discover()
+    if ports:
+        print("Function generators:", ", ".join(ports))
+        return ports
+    ports = [port.device for port in sorted(serial.tools.list_ports.comports())]
     if not ports:
         print("No Virtual COM ports found!")
-        return None
+        return []
     print("Available COM Ports:")
-    for index, (port, desc, hwid) in enumerate(sorted(ports), start=1):
-        print("{}: {} - {}".format(index, desc, port))
-    com_port_index = int(input("Select a COM port (1, 2, 3...) ")) - 1
-
-    # Print the selected COM port and return a `serial.Serial` object with a baud rate of 1000000 and timeout of 1s
-    selected_port_desc = sorted(ports)[com_port_index][1]
-    print(f"You have selected: {selected_port_desc}")
-    selected_port_name = sorted(ports)[com_port_index][0]
-    return serial.Serial(selected_port_name, baudrate=1000000, timeout=1)
-
-def escape_data(bytestring):
-    # Define constants
-    FRAME_DELIMITER = 0x7E
-    ESCAPE = 0x7D
-    XOR_VALUE = 0x20
-    ESCAPE_BYTES = {FRAME_DELIMITER, ESCAPE}
-
-    # Escape data bytes
-    escaped_data = bytearray()
-    for byte in bytestring:
-        if byte in ESCAPE_BYTES:
-            escaped_data.append(ESCAPE)
-            escaped_data.append(byte ^ XOR_VALUE)
-        else:
-            escaped_data.append(byte)
-
-    # Assemble the final escaped frame
-    escaped_frame = bytearray([FRAME_DELIMITER])
-    escaped_frame.extend(escaped_data)
-    escaped_frame.extend(bytearray([FRAME_DELIMITER]))
-
-    return escaped_frame
-
-def unescape_data(escaped_frame):
-    # Define constants
-    FRAME_DELIMITER = 0x7E
-    ESCAPE = 0x7D
-    XOR_VALUE = 0x20
-
-    # Check and remove frame delimiters
-    if escaped_frame[0] != FRAME_DELIMITER or escaped_frame[-1] != FRAME_DELIMITER:
-        raise ValueError("Invalid frame delimiters")
-
-    escaped_data = escaped_frame[1:-1]
-
-    # Unescape data bytes
-    unescaped_data = bytearray()
-    i = 0
-    while i < len(escaped_data):
-        byte = escaped_data[i]
-
-        if byte == ESCAPE:
-            i += 1
-            unescaped_data.append(escaped_data[i] ^ XOR_VALUE)
-        else:
-            unescaped_data.append(byte)
-        i += 1
-
-    return unescaped_data
-
-
-def unpack_bytestream(bytestream):
-    # Unpack the frequency bytes (4 bytes)
-    freq, = struct.unpack("<I", bytestream[:4])
-
-    # Unpack the on_time_byte (1 byte)
-    on_time_raw, = struct.unpack("<B", bytestream[4:5])
-    on_time = "Long" if on_time_raw == 1 else "Short"
-
-    # Unpack the out_voltage_byte (1 byte)
-    out_voltage_raw, = struct.unpack("<B", bytestream[5:6])
-    out_voltage = "5V" if out_voltage_raw == 0 else "0.45V"
-
-    # Unpack the bias_v_bytes (2 bytes)
-    bias_v_fixed, = struct.unpack("<H", bytestream[6:8])
-    bias_v = (bias_v_fixed - 5000) / 1000  # Convert back to floating-point
-
-    # Unpack the running_byte (1 byte)
-    running_raw, = struct.unpack("<B", bytestream[8:9])
-    running = "ON" if running_raw == 0 else "OFF"
-
-    return freq, on_time, out_voltage, bias_v, running
-
-# Initialize the serial 
-ser = config_serial()
-# Initial handshake to get current settings from function generator
-start = b'\xAA'
-ser.write(escape_data(start))
-time.sleep(0.5)
-
-# Read in return valued from function generator
-data_str = ser.read(ser.inWaiting())
-print(data_str)
-decodedBytestream = unescape_data(data_str)
-print(decodedBytestream)
-initFreq, initOnTime, initOutVoltage, initBiasV, initRunning = unpack_bytestream(decodedBytestream)
-print("Freq:", initFreq, "On Time:", initOnTime, "Out Voltage:", initOutVoltage, "Bias V:", initBiasV, "Running:", initRunning)
-
-def on_value_change(*args):
-    # In the event that we received an updated configuration from the function generator and we update the GUI, the GUI elements will call a
-    # callback function to update the function generator. However in this instance we do not need to update the function generator, as it was the
-    #device that requested the update. If the time_last_updated is within the last update_threshold, then do not update/send new data
-    global time_last_updated
-    elapsed_time = time.time() - time_last_updated
-
-    if elapsed_time > update_threshold:
-        freq = freq_var.get()
-        on_time = on_time_var.get()
-        out_voltage = out_voltage_var.get()
-        bias_v = float(bias_v_entry.get())
-        running = running_var.get()
-
-        # Pack values into a bytestream
-        freq_bytes = struct.pack("<I", freq)  # 4 bytes for unsigned 32-bit frequency
-        on_time_byte = b'\x01' if on_time == "Long" else b'\x00'  # 1 byte for on_time
-        out_voltage_byte = b'\x01' if out_voltage == "5V" else b'\x00'  # 1 byte for out_voltage
-        bias_v_fixed = int((bias_v * 1000) + 5000)  # Convert to fixed-point with 1mV steps and 5000mV offset
-        bias_v_bytes = struct.pack("<H", bias_v_fixed)  # 2 bytes for BiasV
-        running_byte = b'\x01' if running == "ON" else b'\x00'  # 1 byte for running
-
-        bytestream = freq_bytes + on_time_byte + out_voltage_byte + bias_v_bytes + running_byte
-
-        print("Freq:", freq, "On Time:", on_time, "Out Voltage:", out_voltage, "Bias V:", bias_v, "Running:", running)
-        print("Bytestream:", bytestream.hex())
-        msg = escape_data(bytestream)
-        ser.write(msg)
-
-app = tk.Tk()
-app.title("MTJ Function Generator Control")
-
-def update_freq_spinbox(event):
-    try:
-        new_value = int(freq_spinbox.get())
-        clamped_value = min(max(new_value, 0), 1000000)
-        if new_value != clamped_value:
-            freq_spinbox.delete(0, tk.END)
-            freq_spinbox.insert(0, clamped_value)
-        on_value_change()
-    except ValueError:
-        pass
-
-# Freq
-freq_label = ttk.Label(app, text="Freq (0-125000):")
-freq_label.grid(column=0, row=0)
-freq_var = tk.IntVar(value=initFreq)
-# Uncomment this line if you want it to update as soon as you type stuff in
-# freq_var.trace_add('write', on_value_change)
-freq_spinbox = ttk.Spinbox(app, from_=0, to=125000, textvariable=freq_var)
-freq_spinbox.grid(column=1, row=0)
-freq_spinbox.bind('<Return>', update_freq_spinbox)
-
-
-# On Time
-on_time_label = ttk.Label(app, text="On Time:")
-on_time_label.grid(column=0, row=1)
-on_time_var = tk.StringVar(value=initOnTime)
-on_time_var.trace_add('write', on_value_change)
-on_time_long = ttk.Radiobutton(app, text="Long", variable=on_time_var, value="Long", command=on_value_change)
-on_time_short = ttk.Radiobutton(app, text="Short", variable=on_time_var, value="Short", command=on_value_change)
-on_time_long.grid(column=1, row=1)
-on_time_short.grid(column=2, row=1)
-
-# Out Voltage
-out_voltage_label = ttk.Label(app, text="Out Voltage:")
-out_voltage_label.grid(column=0, row=2)
-out_voltage_var = tk.StringVar(value=initOutVoltage)
-out_voltage_var.trace_add('write', on_value_change)
-out_voltage_045 = ttk.Radiobutton(app, text="0.45V", variable=out_voltage_var, value="0.45V", command=on_value_change)
-out_voltage_5 = ttk.Radiobutton(app, text="5V", variable=out_voltage_var, value="5V", command=on_value_change)
-out_voltage_045.grid(column=1, row=2)
-out_voltage_5.grid(column=2, row=2)
-
-
-def update_bias_v_entry(event):
-    try:
-        new_value = float(bias_v_entry.get())
-        clamped_value = min(max(new_value, -5), 5)
-        if new_value != clamped_value:
-            bias_v_entry.delete(0, tk.END)
-            bias_v_entry.insert(0, clamped_value)
-        on_value_change()
-    except ValueError:
-        pass
-
-# Bias V
-bias_v_label = ttk.Label(app, text="Bias V (-5V to 5V):")
-bias_v_label.grid(column=0, row=3)
-bias_v_entry = ttk.Entry(app, width=8)
-bias_v_entry.grid(column=2, row=3)
-bias_v_entry.insert(0, initBiasV)
-bias_v_entry.bind('<Return>', update_bias_v_entry)
-
-
-# Running
-running_label = ttk.Label(app, text="Running:")
-running_label.grid(column=0, row=4)
-running_var = tk.StringVar(value=initRunning)
-running_var.trace_add('write', on_value_change)
-running_off = ttk.Radiobutton(app, text="OFF", variable=running_var, value="OFF", command=on_value_change)
-running_on = ttk.Radiobutton(app, text="ON", variable=running_var, value="ON", command=on_value_change)
-running_off.grid(column=1, row=4)
-running_on.grid(column=2, row=4)
-
-
-# Function to run in a separate thread
-def read_serial_data():
-    buffer = bytearray()
-    frame_delimiter = 0x7E
-
-    while True:
-        if ser.inWaiting() > 0:
-            # Read one byte
-            byte = ser.read(1)
-
-            # Check for frame delimiter
-            if byte[0] == frame_delimiter:
-                if len(buffer) > 0:
-                    # Unpack the bytestream
-                    freq, on_time, out_voltage, bias_v, running = unpack_bytestream(buffer)
-
-                    # Update the GUI
-                    app.after(0, update_gui, freq, on_time, out_voltage, bias_v, running)
-
-                    # Clear the buffer
-                    buffer.clear()
+    for index, port in enumerate(ports, start=1):
+        print("{}: {}".format(index, port))
+    selection = input("Select COM ports (1, 2, 3... separated by commas) ")
+    return [ports[int(index) - 1] for index in selection.split(",")]
+
+def start_event_loop():
+    # The client library runs on an asyncio loop in its own thread so Tk keeps the main thread
+    loop = asyncio.new_event_loop()
+    threading.Thread(target=loop.run_forever, daemon=True).start()
+    return loop
+
+
+class GeneratorPanel:
+    # The controls for one function generator. Changes are sent through the client library, and whatever the device
+    # reports back (including front panel changes) is shown
+    def __init__(self, parent, gen, loop):
+        self.parent = parent
+        self.gen = gen
+        self.loop = loop
+        self.updating = False
+
+        # created on the client loop since it starts a task there
+        self.sender = asyncio.run_coroutine_threadsafe(self.make_sender(), loop).result()
+
+        self.build(gen.config)
+        gen.config_callbacks.append(self.on_device_config)
+
+    async def make_sender(self):
+        return self.gen.coalescer(min_send_interval)
+
+    def build(self, config):
+        parent = self.parent
+
+        # Freq
+        freq_label = ttk.Label(parent, text="Freq ({}-{}):".format(FREQ_MIN_HZ, FREQ_MAX_HZ))
+        freq_label.grid(column=0, row=0)
+        self.freq_var = tk.IntVar(value=config.freq_hz)
+        # Uncomment this line if you want it to update as soon as you type stuff in
+        # self.freq_var.trace_add('write', self.on_value_change)
+        self.freq_spinbox = ttk.Spinbox(parent, from_=FREQ_MIN_HZ, to=FREQ_MAX_HZ, textvariable=self.freq_var)
+        self.freq_spinbox.grid(column=1, row=0)
+        self.freq_spinbox.bind('<Return>', self.update_freq_spinbox)
+
+        # On Time
+        on_time_label = ttk.Label(parent, text="On Time:")
+        on_time_label.grid(column=0, row=1)
+        self.on_time_var = tk.StringVar(value="Long" if config.long_on_time else "Short")
+        self.on_time_var.trace_add('write', self.on_value_change)
+        on_time_long = ttk.Radiobutton(parent, text="Long", variable=self.on_time_var, value="Long")
+        on_time_short = ttk.Radiobutton(parent, text="Short", variable=self.on_time_var, value="Short")
+        on_time_long.grid(column=1, row=1)
+        on_time_short.grid(column=2, row=1)
+
+        # Out Voltage
+        out_voltage_label = ttk.Label(parent, text="Out Voltage:")
+        out_voltage_label.grid(column=0, row=2)
+        self.out_voltage_var = tk.StringVar(value="5V" if config.out_5v else "0.45V")
+        self.out_voltage_var.trace_add('write', self.on_value_change)
+        out_voltage_045 = ttk.Radiobutton(parent, text="0.45V", variable=self.out_voltage_var, value="0.45V")
+        out_voltage_5 = ttk.Radiobutton(parent, text="5V", variable=self.out_voltage_var, value="5V")
+        out_voltage_045.grid(column=1, row=2)
+        out_voltage_5.grid(column=2, row=2)
+
+        # Bias V
+        bias_v_label = ttk.Label(parent, text="Bias V ({}V to {}V):".format(BIAS_MIN_V, BIAS_MAX_V))
+        bias_v_label.grid(column=0, row=3)
+        self.bias_v_entry = ttk.Entry(parent, width=8)
+        self.bias_v_entry.grid(column=2, row=3)
+        self.bias_v_entry.insert(0, config.bias_v)
+        self.bias_v_entry.bind('<Return>', self.update_bias_v_entry)
+
+        # Running
+        running_label = ttk.Label(parent, text="Running:")
+        running_label.grid(column=0, row=4)
+        self.running_var = tk.StringVar(value="ON" if config.running else "OFF")
+        self.running_var.trace_add('write', self.on_value_change)
+        running_off = ttk.Radiobutton(parent, text="OFF", variable=self.running_var, value="OFF")
+        running_on = ttk.Radiobutton(parent, text="ON", variable=self.running_var, value="ON")
+        running_off.grid(column=1, row=4)
+        running_on.grid(column=2, row=4)
+
+    def update_freq_spinbox(self, event):
+        try:
+            new_value = int(self.freq_spinbox.get())
+            clamped_value = min(max(new_value, FREQ_MIN_HZ), FREQ_MAX_HZ)
+            if new_value != clamped_value:
+                self.freq_spinbox.delete(0, tk.END)
+                self.freq_spinbox.insert(0, clamped_value)
+            self.on_value_change()
+        except ValueError:
+            pass
+
+    def update_bias_v_entry(self, event):
+        try:
+            new_value = float(self.bias_v_entry.get())
+            clamped_value = min(max(new_value, BIAS_MIN_V), BIAS_MAX_V)
+            if new_value != clamped_value:
+                self.bias_v_entry.delete(0, tk.END)
+                self.bias_v_entry.insert(0, clamped_value)
+            self.on_value_change()
+        except ValueError:
+            pass
+
+    def current_config(self):
+        return Config(freq_hz=int(self.freq_var.get()),
+                      long_on_time=self.on_time_var.get() == "Long",
+                      out_5v=self.out_voltage_var.get() == "5V",
+                      bias_mv=int(round(float(self.bias_v_entry.get()) * 1000)),
+                      running=self.running_var.get() == "ON")
+
+    def on_value_change(self, *args):
+        # Setting the widgets from a device update fires the same callbacks as the user does, those are not sent back
+        if self.updating:
+            return
+
+        try:
+            config = self.current_config()
+        except ValueError:
+            return
+        self.send(config)
+
+    def send(self, config):
+        # Only the newest edit is kept, it is sent once the device has applied the previous one
+        self.sender.set_threadsafe(config)
+
+    def on_device_config(self, gen, config, seq):
+        # Called on the client loop. An echo of a change older than the last one sent, or any update while an edit is
+        # still waiting to go out, would jump the widgets back to a stale value, so those are skipped
+        if self.sender.has_pending():
+            return
+        if seq is not None and seq != gen.last_seq:
+            return
+        self.parent.after(0, self.update_gui, config)
+
+    # Function to update the GUI
+    def update_gui(self, config):
+        self.updating = True
+        try:
+            self.show_config(config)
+        finally:
+            self.updating = False
+
+    def show_config(self, config):
+        self.freq_var.set(config.freq_hz)
+        self.on_time_var.set("Long" if config.long_on_time else "Short")
+        self.out_voltage_var.set("5V" if config.out_5v else "0.45V")
+        self.bias_v_entry.delete(0, tk.END)
+        self.bias_v_entry.insert(0, round(config.bias_v, 3))
+        self.running_var.set("ON" if config.running else "OFF")
+
+    # Use this function to update the GUI and function generator from a python script (optional)
+    def update_settings(self, config):
+        self.send(config)
+        self.update_gui(config)
+
+
+class DeviceTable:
+    # One row per generator with the configuration it last reported, and the buttons that act on all of them at once.
+    # Selecting a row shows that generator's controls
+    COLUMNS = ("freq", "on_time", "out_voltage", "bias_v", "running")
+
+    def __init__(self, app, group, loop):
+        self.app = app
+        self.group = group
+        self.loop = loop
+
+        self.table = ttk.Treeview(app, columns=self.COLUMNS, height=max(1, len(group.generators)))
+        self.table.heading("#0", text="Port")
+        for column, title in zip(self.COLUMNS, ("Freq", "On Time", "Out V", "Bias V", "Running")):
+            self.table.heading(column, text=title)
+            self.table.column(column, width=80, anchor=tk.CENTER)
+        self.table.grid(column=0, row=0, columnspan=4)
+        self.table.bind('<<TreeviewSelect>>', self.on_select)
+
+        start_all = ttk.Button(app, text="Start all", command=lambda: self.run_all(group.start_all()))
+        stop_all = ttk.Button(app, text="Stop all", command=lambda: self.run_all(group.stop_all()))
+        trigger_all = ttk.Button(app, text="Trigger all", command=lambda: self.run_all(self.arm_and_trigger()))
+        start_all.grid(column=0, row=1)
+        stop_all.grid(column=1, row=1)
+        trigger_all.grid(column=2, row=1)
+        self.skew_label = ttk.Label(app, text="")
+        self.skew_label.grid(column=3, row=1)
+
+        # A frame of controls per generator, only the selected one is shown
+        self.panels = {}
+        for gen in group.generators:
+            frame = ttk.Frame(app)
+            frame.grid(column=0, row=2, columnspan=4)
+            frame.grid_remove()
+            self.panels[gen.port] = GeneratorPanel(frame, gen, loop)
+            self.table.insert("", tk.END, iid=gen.port, text=gen.port, values=self.row(gen.config))
+            gen.config_callbacks.append(self.on_device_config)
+
+        if group.generators:
+            self.table.selection_set(group.generators[0].port)
+
+    def row(self, config):
+        return (config.freq_hz, "Long" if config.long_on_time else "Short", "5V" if config.out_5v else "0.45V",
+                round(config.bias_v, 3), "ON" if config.running else "OFF")
+
+    def on_select(self, event):
+        for port, panel in self.panels.items():
+            if port in self.table.selection():
+                panel.parent.grid()
             else:
-                # Add the byte to the buffer
-                buffer.extend(byte)
-
-
-# Function to update the GUI
-def update_gui(freq, on_time, out_voltage, bias_v, running):
-    global time_last_updated
-    freq_var.set(freq)
-    on_time_var.set(on_time)
-    out_voltage_var.set(out_voltage)
-    bias_v_entry.delete(0, tk.END)
-    bias_v_entry.insert(0, round(bias_v, 3))
-    running_var.set(running)
-
-    # Set the time when the GUI was last updated
-    time_last_updated = time.time()
-
-# Use this function to update the GUI and function generator from a python script (optional)
-def update_settings(freq, on_time, out_voltage, bias_v, running):
-    # Pack values into a bytestream
-    freq_bytes = struct.pack("<I", freq)  # 4 bytes for unsigned 32-bit frequency
-    on_time_byte = b'\x01' if on_time == "Long" else b'\x00'  # 1 byte for on_time
-    out_voltage_byte = b'\x01' if out_voltage == "5V" else b'\x00'  # 1 byte for out_voltage
-    bias_v_fixed = int((bias_v * 1000) + 5000)  # Convert to fixed-point with 1mV steps and 5000mV offset
-    bias_v_bytes = struct.pack("<H", bias_v_fixed)  # 2 bytes for BiasV
-    running_byte = b'\x01' if running == "ON" else b'\x00'  # 1 byte for running
-
-    bytestream = freq_bytes + on_time_byte + out_voltage_byte + bias_v_bytes + running_byte
-
-    print("Freq:", freq, "On Time:", on_time, "Out Voltage:", out_voltage, "Bias V:", bias_v, "Running:", running)
-    print("Bytestream:", bytestream.hex())
-    msg = escape_data(bytestream)
-    ser.write(msg)
-
-    # Update the GUI with the desired settings
-    update_gui(freq, on_time, out_voltage, bias_v, running)
-
-
-# Start the thread for serial communication
-thread = threading.Thread(target=read_serial_data, daemon=True)
-thread.start()
-
-# Start the main loop
-app.mainloop()
+                panel.parent.grid_remove()
+
+    def on_device_config(self, gen, config, seq):
+        # Called on the client loop
+        self.app.after(0, lambda: self.table.item(gen.port, values=self.row(config)))
+
+    async def arm_and_trigger(self):
+        await self.group.arm_all()
+        return await self.group.trigger_all()
+
+    def run_all(self, coroutine):
+        future = asyncio.run_coroutine_threadsafe(coroutine, self.loop)
+        future.add_done_callback(lambda done: self.app.after(0, self.show_report, done))
+
+    def show_report(self, future):
+        if future.exception() is not None:
+            self.skew_label.config(text=str(future.exception()))
+            return
+        report = future.result()
+        print(report)
+        text = "send skew {:.0f} us".format(report["send_skew_us"] or 0)
+        if report["ack_skew_us"] is not None:
+            text += ", ack skew {:.0f} us".format(report["ack_skew_us"])
+        if report["errors"]:
+            text += ", {} failed".format(len(report["errors"]))
+        self.skew_label.config(text=text)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="MTJ function generator control")
+    parser.add_argument("--log", help="log every configuration and telemetry record to this file")
+    parser.add_argument("--telemetry", type=int, default=0, help="telemetry rate in Hz to ask the devices for")
+    args = parser.parse_args()
+
+    ports = select_ports()
+    if not ports:
+        return
+
+    loop = start_event_loop()
+    # The initial handshake waits for every device to report its current settings
+    group = asyncio.run_coroutine_threadsafe(GeneratorGroup.connect(ports), loop).result()
+    for port, error in group.failed.items():
+        print("{}: {}".format(port, error))
+    if not group.generators:
+        return
+
+    logger = None
+    if args.log:
+        # The logger only queues records from the client loop, its own thread does the disk writes
+        logger = ExperimentLogger(args.log)
+        for gen in group.generators:
+            logger.attach(gen)
+            logger.log_config(gen.port, gen.config)
+    if args.telemetry:
+        for gen in group.generators:
+            asyncio.run_coroutine_threadsafe(gen.set_telemetry_rate(args.telemetry), loop).result()
+
+    app = tk.Tk()
+    app.title("MTJ Function Generator Control")
+    table = DeviceTable(app, group, loop)
+
+    # Start the main loop
+    app.mainloop()
+    for panel in table.panels.values():
+        print("{}: {} edits, {} sent to the device".format(panel.gen.port, panel.sender.submitted, panel.sender.sent))
+        asyncio.run_coroutine_threadsafe(panel.sender.close(), loop).result()
+    asyncio.run_coroutine_threadsafe(group.close(), loop).result()
+    if logger:
+        logger.close()
+        print("Logged {} records to {}, {} dropped".format(logger.written, args.log, logger.dropped))
+
+
+if __name__ == "__main__":
+    main()
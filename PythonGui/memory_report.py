@@ -0,0 +1,333 @@
+"""
+memory_report.py
+ Per module flash and RAM use of a firmware build, from the linker map and
+ the .su files gcc writes with -fstack-usage (on by default in STM32CubeIDE).
+
+ Run it on the build directory after building, e.g.
+   python memory_report.py ../Debug
+   python memory_report.py ../Debug --json memory.json
+   python memory_report.py ../Debug --tasks
+
+ For every object file (or library) it lists .text (code and constants),
+ .data (initialized RAM, also stored in flash), .bss (zeroed RAM) and the
+ largest stack frame of any one function in it. The FreeRTOS task stacks are
+ static arrays, so they show up in the .bss of main.o and freertos.o. The
+ live high water marks of the task stacks are on the diagnostics page and in
+ the CMD_DIAGNOSTICS reply (cpu_monitor.py).
+
+ With --tasks it also works out the deepest stack each task can reach from
+ the call graph gcc writes with -fcallgraph-info=su (the .ci files, add it to
+ the compiler's other flags) and the frame sizes in it, and compares that
+ with the stack the task is given. Calls through function pointers are
+ filled in from INDIRECT_CALLS, and library functions, which have no .ci
+ file, from LIBRARY_FRAMES. The high water marks only show the paths a run
+ happened to take, this is the worst case of every path, so the stack sizes
+ in main.c and FreeRTOSConfig.h are set from it.
+"""
+
+import argparse
+import glob
+import json
+import os
+import re
+import sys
+
+FLASH_SIZE = 512 * 1024  # the last six 256K sectors are the DAC calibration, preset and configuration journals
+RAM_SIZE = 512 * 1024
+ITCM_SIZE = 16 * 1024  # .itcm_text, the linker script asserts it fits
+
+# output sections counted under each column, anything else (debug info) is skipped
+TEXT_SECTIONS = (".isr_vector", ".itcm_text", ".text", ".rodata", ".ARM.extab", ".ARM", ".preinit_array",
+                 ".init_array", ".fini_array")
+DATA_SECTIONS = (".data",)
+BSS_SECTIONS = (".bss", ".dma_buffer")
+RESERVED_SECTIONS = ("._user_heap_stack",)  # the heap and the stack main() and the interrupts run on
+
+INPUT_SECTION = re.compile(r"^ (\S+)\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)\s+(\S.*)$")
+INPUT_SECTION_NAME = re.compile(r"^ (\S+)$")
+INPUT_SECTION_CONTINUED = re.compile(r"^\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)\s+(\S.*)$")
+OUTPUT_SECTION = re.compile(r"^(\.\S+)")
+OUTPUT_SECTION_SIZE = re.compile(r"^(\.\S+)\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)")
+ARCHIVE_MEMBER = re.compile(r"^(.*\.a)\((.*)\)$")
+
+# task name: (entry function, stack in words as created in main.c and freertos.c)
+TASKS = {
+    "mainTask": ("mainTask_entry", 512),
+    "displayTask": ("displayTask_entry", 320),
+    "serial": ("start_serial", 512),
+    "Tmr Svc": ("prvTimerTask", 320),
+    "IDLE": ("prvIdleTask", 256),
+}
+# what a task has on its stack besides its calls: the exception frame with the
+# FPU registers (26 words) and what PendSV saves for a context switch, r4-r11,
+# the exception return and s16-s31 (25 words)
+SWITCH_FRAME = (26 + 25) * 4
+# caller: the functions its calls through pointers can reach
+INDIRECT_CALLS = {
+    "flushTxBuffer": ("CDC_Transmit_FS", "uartSerialTransmit"),
+    "relay_settle_done": ("start_prepared_outputs",),
+    "prvTimerTask": ("relay_settle_done",),
+    "prvProcessReceivedCommands": ("relay_settle_done",),
+    "prvSwitchTimerLists": ("relay_settle_done",),
+    "prvSampleTimeNow": ("relay_settle_done",),
+    "USBD_RegisterClass": ("USBD_CDC_GetFSCfgDesc", "USBD_CDC_GetHSCfgDesc"),
+    "prvProcessExpiredTimer": ("relay_settle_done",),
+}
+# frames of the library and port functions, bytes. Estimates for the newlib
+# nano versions, which are built without -fstack-usage
+LIBRARY_FRAMES = {"snprintf": 400, "vsprintf": 400, "pow": 96, "malloc": 64, "free": 32}
+DEFAULT_LIBRARY_FRAME = 16
+
+CI_NODE = re.compile(r'^node: \{ title: "([^"]+)" label: "([^"]*)"')
+CI_EDGE = re.compile(r'^edge: \{ sourcename: "([^"]+)" targetname: "([^"]+)"')
+CI_FRAME = re.compile(r"(\d+) bytes \((\w+)")
+
+
+def module_name(path, split_archives):
+    member = ARCHIVE_MEMBER.match(path)
+    if member:
+        if split_archives:
+            return "{}({})".format(os.path.basename(member.group(1)), member.group(2))
+        return os.path.basename(member.group(1))
+    return os.path.splitext(os.path.basename(path))[0]
+
+
+def column(output_section):
+    if output_section is None:
+        return None
+    if output_section in TEXT_SECTIONS:
+        return "text"
+    if output_section in DATA_SECTIONS:
+        return "data"
+    if output_section in BSS_SECTIONS:
+        return "bss"
+    if output_section in RESERVED_SECTIONS:
+        return "reserved"
+    return None
+
+
+def parse_map(path, split_archives=False):
+    # {module: {"text": bytes, "data": bytes, "bss": bytes, "reserved": bytes}}
+    modules = {}
+    in_memory_map = False
+    output_section = None
+    pending_name = None
+
+    with open(path) as f:
+        for line in f:
+            line = line.rstrip("\n")
+            if not in_memory_map:
+                in_memory_map = line.startswith("Linker script and memory map")
+                continue
+
+            output = OUTPUT_SECTION.match(line)
+            if output:
+                output_section = output.group(1)
+                pending_name = None
+                continue
+
+            # long input section names are on a line of their own and the
+            # address, size and file follow on the next line
+            match = INPUT_SECTION.match(line)
+            if match:
+                name, size, source = match.group(1), int(match.group(3), 16), match.group(4)
+            elif pending_name is not None and INPUT_SECTION_CONTINUED.match(line):
+                match = INPUT_SECTION_CONTINUED.match(line)
+                name, size, source = pending_name, int(match.group(2), 16), match.group(3)
+            else:
+                match = INPUT_SECTION_NAME.match(line)
+                pending_name = match.group(1) if match else None
+                continue
+            pending_name = None
+
+            kind = column(output_section)
+            if kind is None or size == 0:
+                continue
+            module = "*fill*" if name == "*fill*" else module_name(source.strip(), split_archives)
+            sizes = modules.setdefault(module, {"text": 0, "data": 0, "bss": 0, "reserved": 0})
+            sizes[kind] += size
+    return modules
+
+
+def output_section_size(path, section):
+    # the size of one output section, 0 if the map does not have it
+    with open(path) as f:
+        for line in f:
+            match = OUTPUT_SECTION_SIZE.match(line)
+            if match and match.group(1) == section:
+                return int(match.group(3), 16)
+    return 0
+
+
+def parse_stack_usage(build_dir):
+    # {module: (largest frame in bytes, function, True if any frame in the module is dynamic)}
+    stacks = {}
+    for path in glob.glob(os.path.join(build_dir, "**", "*.su"), recursive=True):
+        module = os.path.splitext(os.path.basename(path))[0]
+        largest, function, dynamic = 0, "", False
+        with open(path) as f:
+            for line in f:
+                fields = line.rstrip("\n").split("\t")
+                if len(fields) != 3:
+                    continue
+                size = int(fields[1])
+                dynamic |= "dynamic" in fields[2]
+                if size > largest:
+                    largest, function = size, fields[0].rsplit(":", 1)[-1]
+        stacks[module] = (largest, function, dynamic)
+    return stacks
+
+
+def parse_call_graph(build_dir):
+    # {function: frame bytes or None if not defined in the build}, {function: set of callees}.
+    # Static functions are "file:name" in the .ci files, they are keyed by name
+    # here and a clash of two static functions keeps the larger frame
+    frames = {}
+    calls = {}
+    for path in glob.glob(os.path.join(build_dir, "**", "*.ci"), recursive=True):
+        with open(path) as f:
+            for line in f:
+                node = CI_NODE.match(line)
+                if node:
+                    name = node.group(1).rsplit(":", 1)[-1]
+                    frame = CI_FRAME.search(node.group(2))
+                    if frame:
+                        frames[name] = max(frames.get(name) or 0, int(frame.group(1)))
+                    else:
+                        frames.setdefault(name, None)
+                    continue
+                edge = CI_EDGE.match(line)
+                if edge:
+                    source = edge.group(1).rsplit(":", 1)[-1]
+                    target = edge.group(2).rsplit(":", 1)[-1]
+                    calls.setdefault(source, set()).add(target)
+    for caller, targets in INDIRECT_CALLS.items():
+        if caller in calls:
+            calls[caller].update(targets)
+    return frames, calls
+
+
+def deepest_stack(entry, frames, calls):
+    # (bytes, [functions on the deepest path], set of unresolved pointer calls,
+    # set of recursive functions). A recursive call is counted once
+    memo = {}
+    unresolved = set()
+    recursive = set()
+
+    def visit(function, on_path):
+        if function in memo:
+            return memo[function]
+        frame = frames.get(function)
+        if frame is None:
+            frame = LIBRARY_FRAMES.get(function, DEFAULT_LIBRARY_FRAME)
+        best, best_path = 0, []
+        on_path.add(function)
+        for callee in calls.get(function, ()):
+            if callee == "__indirect_call":
+                if function not in INDIRECT_CALLS:
+                    unresolved.add(function)
+                continue
+            if callee in on_path:
+                recursive.add(callee)
+                continue
+            depth, path = visit(callee, on_path)
+            if depth > best:
+                best, best_path = depth, path
+        on_path.discard(function)
+        memo[function] = (frame + best, [function] + best_path)
+        return memo[function]
+
+    depth, path = visit(entry, set())
+    return depth, path, unresolved, recursive
+
+
+def task_stacks(build_dir):
+    frames, calls = parse_call_graph(build_dir)
+    if not frames:
+        raise FileNotFoundError("no .ci files in {}, build with -fcallgraph-info=su".format(build_dir))
+    rows = []
+    for task, (entry, words) in TASKS.items():
+        depth, path, unresolved, recursive = deepest_stack(entry, frames, calls)
+        need = depth + SWITCH_FRAME
+        rows.append({"task": task, "entry": entry, "stack_words": words, "need_bytes": need,
+                     "need_words": (need + 3) // 4, "path": path, "unresolved": sorted(unresolved),
+                     "recursive": sorted(recursive)})
+    return rows
+
+
+def print_task_stacks(rows, out=sys.stdout):
+    out.write("\n{:<14}{:>8}{:>8}{:>8}  {}\n".format("task", "stack", "worst", "spare", "deepest path"))
+    for row in rows:
+        spare = row["stack_words"] - row["need_words"]
+        out.write("{:<14}{:>8}{:>8}{:>8}  {}\n".format(row["task"], row["stack_words"], row["need_words"], spare,
+                                                      " > ".join(row["path"])))
+        if row["unresolved"]:
+            out.write("  calls through pointers not followed: {}\n".format(", ".join(row["unresolved"])))
+        if row["recursive"]:
+            out.write("  recursion counted once: {}\n".format(", ".join(row["recursive"])))
+    out.write("words, including {} bytes for a context switch\n".format(SWITCH_FRAME))
+
+
+def find_map(build_dir):
+    maps = glob.glob(os.path.join(build_dir, "*.map"))
+    if not maps:
+        raise FileNotFoundError("no .map file in {}, is the build directory right?".format(build_dir))
+    return max(maps, key=os.path.getmtime)
+
+
+def report(build_dir, split_archives=False):
+    map_path = find_map(build_dir)
+    modules = parse_map(map_path, split_archives)
+    stacks = parse_stack_usage(build_dir)
+    rows = []
+    for module, sizes in modules.items():
+        largest, function, dynamic = stacks.get(module, (None, "", False))
+        rows.append({"module": module, **sizes, "stack": largest, "stack_function": function,
+                     "stack_dynamic": dynamic})
+    rows.sort(key=lambda row: row["data"] + row["bss"], reverse=True)
+
+    totals = {kind: sum(row[kind] for row in rows) for kind in ("text", "data", "bss", "reserved")}
+    totals["flash"] = totals["text"] + totals["data"]
+    totals["ram"] = totals["data"] + totals["bss"] + totals["reserved"]
+    totals["itcm"] = output_section_size(map_path, ".itcm_text")
+    return {"map": map_path, "modules": rows, "totals": totals}
+
+
+def print_report(result, out=sys.stdout):
+    out.write("{:<28}{:>9}{:>8}{:>8}{:>8}  {}\n".format("module", "text", "data", "bss", "stack", "largest frame"))
+    for row in result["modules"]:
+        if row["data"] + row["bss"] + row["text"] + row["reserved"] == 0:
+            continue
+        stack = "" if row["stack"] is None else str(row["stack"]) + ("+" if row["stack_dynamic"] else "")
+        out.write("{:<28}{:>9}{:>8}{:>8}{:>8}  {}\n".format(row["module"][:27], row["text"], row["data"],
+                                                              row["bss"], stack, row["stack_function"]))
+    totals = result["totals"]
+    out.write("\nflash {} of {} bytes ({:.1f}%)\n".format(totals["flash"], FLASH_SIZE,
+                                                          100 * totals["flash"] / FLASH_SIZE))
+    out.write("ram   {} of {} bytes ({:.1f}%): .data {}, .bss {}, heap and main stack {}\n".format(
+        totals["ram"], RAM_SIZE, 100 * totals["ram"] / RAM_SIZE, totals["data"], totals["bss"], totals["reserved"]))
+    out.write("itcm  {} of {} bytes ({:.1f}%), counted in flash as well\n".format(
+        totals["itcm"], ITCM_SIZE, 100 * totals["itcm"] / ITCM_SIZE))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Per module memory use of a firmware build")
+    parser.add_argument("build_dir", help="the build directory holding the .map and .su files, e.g. ../Debug")
+    parser.add_argument("--split-archives", action="store_true", help="list every library member on its own")
+    parser.add_argument("--json", help="also write the report to this file")
+    parser.add_argument("--tasks", action="store_true", help="also work out the worst case stack of each task")
+    args = parser.parse_args()
+
+    result = report(args.build_dir, args.split_archives)
+    print_report(result)
+    if args.tasks:
+        result["tasks"] = task_stacks(args.build_dir)
+        print_task_stacks(result["tasks"])
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump(result, f, indent=2)
+            f.write("\n")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,300 @@
+"""
+out4_handover_sim.py
+ Checks that the output 4 MOSFETs are never on together while a bias table
+ hands output 4 between them, see start_bias_table() in Core/Src/outputs.c.
+
+ Tim2 channel 3 drives the negative MOSFET and is on when high, channel 4
+ drives the positive one and is on when low. The simulator models the two
+ channels the way the firmware runs them: both compare registers walk
+ through the output 4 rise and fall times, a channel in toggle mode flips at
+ every match and a forced one holds the level that keeps its MOSFET off. The
+ modes are written by DMA on the tim5 channel 4 compare, half way to the
+ rise, and the DAC takes a code at every update. The buffers are laid out the
+ way start_bias_table() and start_handover() fill them.
+
+ It runs in two parts:
+   - the edge times of every period from 125 kHz down to 1 Hz, to check the
+     handover always lands in the gap between pulses with some margin
+   - a pulse by pulse run of many tables at a spread of periods, with the
+     DMA write late by anything up to the margin, checking for shoot-through,
+     the dead time and that each pulse has the MOSFET and code of its step
+
+ The modes of both channels go out in one register write, so a channel only
+ ever starts toggling from its off level and the other is forced off in the
+ same write. Two broken versions are run at the end and have to fail, one
+ with the forced levels of the channels swapped and one with the handover in
+ the middle of the pulse, so the check is known to catch both.
+
+ Examples:
+   python out4_handover_sim.py
+   python out4_handover_sim.py --tables 500 --seed 3
+"""
+
+import argparse
+import random
+import struct
+import sys
+
+# from Core/Src/outputs.c
+TIMER_FREQ_HZ = 10000000
+CHANGE_OUT4_DUTY_CUTOFF_100NS = 500
+CHANGE_TIME_STEP_100NS = 350
+MAX_TIME_STEP_100NS = 50
+OUT4_LOW_TIME_STEPS = 3
+OUT4_HANDOVER_MIN_100NS = 5
+
+# from Core/Inc/outputs.h
+BIAS_TABLE_MAX_CODES = 2048
+
+FREQ_MIN_HZ = 1
+FREQ_MAX_HZ = 125000
+
+NEG = 3     # tim2 channel 3, on when high
+POS = 4     # tim2 channel 4, on when low
+OFF_LEVEL = {NEG: 0, POS: 1}
+
+
+def f32(x):
+    return struct.unpack("<f", struct.pack("<f", x))[0]
+
+
+def out4_edges(period):
+    # output 4 rise and fall and the handover time for a period, the same
+    # math as plan_output_waveform() and start_handover()
+    if period < CHANGE_TIME_STEP_100NS:
+        step = int(f32(MAX_TIME_STEP_100NS * f32(f32(period) / CHANGE_TIME_STEP_100NS)))
+        fall_time = period - OUT4_LOW_TIME_STEPS * step
+    elif period < CHANGE_OUT4_DUTY_CUTOFF_100NS:
+        step = MAX_TIME_STEP_100NS
+        fall_time = period - OUT4_LOW_TIME_STEPS * step
+    else:
+        step = MAX_TIME_STEP_100NS
+        fall_time = period // 2 - 1 if period % 2 else period // 2
+    rise = 2 * step
+    fall = fall_time + 2 * step
+    return rise, fall, rise // 2
+
+
+def sign(x):
+    return (x > 0) - (x < 0)
+
+
+def channel_for(s):
+    return POS if s > 0 else NEG if s < 0 else None
+
+
+def check_timing():
+    # every period the firmware can be set to. Returns the smallest margin of
+    # the handover from the gap edges and the smallest dead time
+    worst_margin = None
+    worst_dead = None
+    for period in range(TIMER_FREQ_HZ // FREQ_MAX_HZ, TIMER_FREQ_HZ // FREQ_MIN_HZ + 1):
+        rise, fall, handover = out4_edges(period)
+        if not 0 < handover < rise < fall < period:
+            raise AssertionError("period {}: handover {} rise {} fall {} out of order".format(
+                period, handover, rise, fall))
+        margin = min(handover, rise - handover)
+        dead = period - fall + rise
+        if worst_margin is None or margin < worst_margin[0]:
+            worst_margin = (margin, period)
+        if worst_dead is None or dead < worst_dead[0]:
+            worst_dead = (dead, period)
+    return worst_margin, worst_dead
+
+
+def build_table(steps_mv, pulses_per_step, circular, configured):
+    # the buffers start_bias_table() fills. Codes are kept as labels, the
+    # step index or "configured", since only which code goes out matters
+    signs = []
+    codes = []
+    for s, mv in enumerate(steps_mv):
+        step_sign = sign(mv) or configured
+        signs += [step_sign] * pulses_per_step
+        codes += [s] * pulses_per_step
+    n = len(codes)
+    codes_tail = codes + [codes[0] if circular else "configured"]
+    codes_tail.append(codes_tail[1])
+    modes = signs + [configured]
+    return signs, codes, codes_tail, modes, n
+
+
+def simulate(period, steps_mv, pulses_per_step, circular, configured, num_periods, latency, handover=None,
+             forced=OFF_LEVEL):
+    # forced is the level each channel is held at when it is not in use, and
+    # handover the tick the modes are written, both only changed to check the
+    # simulation catches the faults they cause
+    rise, fall, default_handover = out4_edges(period)
+    if handover is None:
+        handover = default_handover
+    signs, codes, codes_tail, modes, n = build_table(steps_mv, pulses_per_step, circular, configured)
+    first = sign(steps_mv[0]) or configured
+
+    # stop_outputs() leaves both channels forced off, commit_output_regs()
+    # forces the first channel to the level it toggles from
+    level = {NEG: OFF_LEVEL[NEG], POS: OFF_LEVEL[POS]}
+    mode = {NEG: "forced", POS: "forced"}
+    if first:
+        level[channel_for(first)] = 1 - OFF_LEVEL[channel_for(first)]
+        mode[channel_for(first)] = "toggle"
+
+    # the DAC: the first code is latched by the update in the commit, the
+    # second is in the holding register and the stream runs from the third
+    dac_out = codes_tail[0]
+    dac_hold = codes_tail[1]
+    dac_stream = codes_tail[2:2 + (n if circular else n - 1)]
+    dac_index = 0
+    mode_stream = modes[:n if circular else n + 1]
+    mode_index = 0
+
+    on_since = {}
+    last_off = {}
+    min_dead = None
+    faults = []
+
+    def is_on(ch):
+        return level[ch] != OFF_LEVEL[ch]
+
+    def settle(t):
+        nonlocal min_dead
+        if is_on(NEG) and is_on(POS):
+            faults.append("both MOSFETs on at tick {}".format(t))
+        for ch in (NEG, POS):
+            if is_on(ch) and ch not in on_since:
+                on_since[ch] = t
+                other = POS if ch == NEG else NEG
+                if other in last_off:
+                    gap = t - last_off[other]
+                    if min_dead is None or gap < min_dead:
+                        min_dead = gap
+            elif not is_on(ch) and ch in on_since:
+                del on_since[ch]
+                last_off[ch] = t
+
+    def match(ch):
+        if mode[ch] == "toggle":
+            level[ch] ^= 1
+
+    settle(-1)
+    for k in range(num_periods):
+        base = k * period
+        if k > 0:
+            # the update, the DAC takes the code from its holding register
+            # and asks for the next one
+            dac_out = dac_hold
+            if circular and dac_stream:
+                dac_hold = dac_stream[dac_index % len(dac_stream)]
+                dac_index += 1
+            elif dac_index < len(dac_stream):
+                dac_hold = dac_stream[dac_index]
+                dac_index += 1
+
+        events = []
+        if k == 0:
+            events.append((0, 0, "start"))
+        events.append((handover + latency, 1, "modes"))
+        events.append((rise, 2, "rise"))
+        events.append((fall, 2, "fall"))
+        for t, _, what in sorted(events):
+            if t >= period:
+                faults.append("period {} event {} past the end of the period".format(k, what))
+                continue
+            if what in ("start", "rise", "fall"):
+                match(NEG)
+                match(POS)
+            elif what == "modes":
+                if circular or mode_index < len(mode_stream):
+                    s = mode_stream[mode_index % len(mode_stream)]
+                    mode_index += 1
+                    for ch in (NEG, POS):
+                        if ch == channel_for(s):
+                            mode[ch] = "toggle"
+                        else:
+                            mode[ch] = "forced"
+                            level[ch] = forced[ch]
+            settle(base + t)
+
+            if what == "rise":
+                # the pulse: which MOSFET is on and which code is out
+                if circular:
+                    want_sign, want_code = signs[k % n], codes[k % n]
+                elif k < n:
+                    want_sign, want_code = signs[k], codes[k]
+                else:
+                    want_sign, want_code = configured, "configured"
+                got = POS if is_on(POS) else NEG if is_on(NEG) else None
+                if got != channel_for(want_sign):
+                    faults.append("pulse {} on channel {} instead of {}".format(k, got, channel_for(want_sign)))
+                if want_sign and dac_out != want_code:
+                    faults.append("pulse {} has code {} instead of {}".format(k, dac_out, want_code))
+
+    return faults, min_dead
+
+
+def random_table(rng):
+    num_steps = rng.randint(1, 12)
+    steps = [rng.choice((-1, 0, 1)) * rng.randint(1, 3300) for _ in range(num_steps)]
+    pulses_per_step = rng.randint(1, max(1, min(6, BIAS_TABLE_MAX_CODES // num_steps)))
+    circular = rng.random() < 0.5
+    if not circular and num_steps * pulses_per_step < 2:
+        pulses_per_step = 2
+    return steps, pulses_per_step, circular
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Output 4 handover shoot-through check")
+    parser.add_argument("--tables", type=int, default=200, help="random tables to run at each period")
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+    rng = random.Random(args.seed)
+
+    print("checking the edge times of every period...")
+    (margin, margin_period), (dead, dead_period) = check_timing()
+    print("  smallest handover margin {} ticks at period {}".format(margin, margin_period))
+    print("  smallest dead time {} ticks at period {}".format(dead, dead_period))
+    if margin < OUT4_HANDOVER_MIN_100NS:
+        print("FAIL: the margin is under OUT4_HANDOVER_MIN_100ns")
+        return 1
+
+    periods = sorted(set([80, 81, 99, 100, 349, 350, 351, 499, 500, 501, 1000, 9999, 100000] +
+                         [rng.randint(80, 2000) for _ in range(20)]))
+    tables = [([3300, -3300], n, True) for n in range(1, 6)]
+    tables += [([1000, -500, 0, 2000], 2, False), ([0, -100], 3, True)]
+    tables += [random_table(rng) for _ in range(args.tables)]
+
+    runs = 0
+    worst_dead = None
+    for period in periods:
+        rise, fall, handover = out4_edges(period)
+        for steps, pulses_per_step, circular in tables:
+            num_periods = 2 * len(steps) * pulses_per_step + 3
+            for configured in (-1, 0, 1):
+                for latency in (0, rise - handover - 1):
+                    faults, min_dead = simulate(period, steps, pulses_per_step, circular, configured,
+                                                num_periods, latency)
+                    runs += 1
+                    if faults:
+                        print("FAIL: period {} table {} x{} {} configured {} latency {}: {}".format(
+                            period, steps, pulses_per_step, "circular" if circular else "one-pass",
+                            configured, latency, faults[0]))
+                        return 1
+                    if min_dead is not None and (worst_dead is None or min_dead < worst_dead):
+                        worst_dead = min_dead
+    print("{} runs with no shoot-through, smallest dead time seen {} ticks".format(runs, worst_dead))
+
+    # the broken versions have to be caught
+    faults, _ = simulate(1000, [3300, -3300], 1, True, 1, 6, 0, forced={NEG: 1, POS: 0})
+    if not any("both" in f for f in faults):
+        print("FAIL: swapped forced levels were not caught")
+        return 1
+    print("swapped forced levels are caught: {}".format(faults[0]))
+    rise, fall, _ = out4_edges(1000)
+    faults, _ = simulate(1000, [3300, -3300], 1, True, 1, 6, 0, handover=(rise + fall) // 2)
+    if not faults:
+        print("FAIL: a handover inside the pulse was not caught")
+        return 1
+    print("a handover inside the pulse is caught: {}".format(faults[0]))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
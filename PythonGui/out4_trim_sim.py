@@ -0,0 +1,309 @@
+"""
+out4_trim_sim.py
+ Checks the output 4 readback trim against a model of the output, see
+ Core/Src/out4_sense.c.
+
+ The firmware side is run the way the main task runs it: every 10 ms it
+ takes the ADC samples the DMA has written since the last pass, one per
+ pulse, only the newest ones once the pulse count says the ring may have
+ wrapped, averages them over blocks and moves the trim at the end of each
+ block. The integer maths of the average and the trim step are copied from
+ the firmware, as is the lookup table the nominal calibration builds.
+
+ The output is a DAC code turned into a bias with a gain and offset error
+ against the calibration, a slow drift on top, and an ADC with noise and
+ 12 bit steps reading it. For every period from 1 Hz to 125 kHz, a spread of
+ biases of both signs and a few of those models it checks that:
+   - the output ends up within the deadband, plus what the ADC noise and the
+     size of a DAC code add, wherever the trim can get it there
+   - where it can not, the code sits at the end of the trim or DAC range
+     nearest the target
+   - once settled the trim does not keep moving back and forth
+ Two broken versions are run at the end and have to fail, one that moves
+ by twice the error every step instead of half, which rings, and one that
+ ignores the sign of the bias, which runs away on the negative side.
+
+ Examples:
+   python out4_trim_sim.py
+   python out4_trim_sim.py --seed 3 --noise 2
+"""
+
+import argparse
+import math
+import random
+import sys
+
+# from Core/Inc/out4_sense.h
+OUT4_SENSE_RING_SIZE = 256
+OUT4_SENSE_BLOCK_MS = 250
+OUT4_SENSE_MIN_SAMPLES = 4
+OUT4_SENSE_SETTLE_MS = 50
+OUT4_TRIM_DEADBAND_MV = 2
+OUT4_TRIM_MAX_STEP = 16
+OUT4_TRIM_MAX_CODES = 120
+
+# from Core/Src/out4_sense.c
+SENSE_ZERO_COUNTS = 2048
+SENSE_HALF_RANGE_COUNTS = 2048
+SENSE_FULL_SCALE_MV = 5000
+
+# from Core/Inc/dac_cal.h and the nominal tables in Core/Src/dac_cal.c
+DAC_CAL_MAX_MV = 3300
+DAC_CAL_MAX_CODE = 4095
+NOMINAL_POINTS = {-1: [(0, 0), (3300, DAC_CAL_MAX_CODE)], 1: [(0, DAC_CAL_MAX_CODE), (3300, 0)]}
+
+# from Core/Src/outputs.c, get_pulses_emitted() moves in these steps
+BUFFER_REPEATS = 10
+
+MAIN_TASK_MS = 10
+WANDER_PERIOD_S = 300
+MV_PER_CODE = 3300 / DAC_CAL_MAX_CODE
+ADC_MAX_COUNTS = 4095
+
+FREQS_HZ = [1, 3, 10, 100, 1000, 6400, 25600, 125000]
+BIASES_MV = [-3300, -2500, -1000, -200, -50, 50, 200, 1000, 2500, 3300]
+
+
+def cdiv(a, b):
+    # C integer division, which rounds towards 0
+    q = abs(a) // abs(b)
+    return q if (a >= 0) == (b >= 0) else -q
+
+
+def build_lut(points):
+    # build_lut() in dac_cal.c
+    last = len(points) - 1
+    lut = []
+    seg = 0
+    slope_q16 = None
+    for mv in range(DAC_CAL_MAX_MV + 1):
+        if mv <= points[0][0]:
+            lut.append(points[0][1])
+            continue
+        if mv >= points[last][0]:
+            lut.append(points[last][1])
+            continue
+        while mv > points[seg + 1][0]:
+            seg += 1
+            slope_q16 = None
+        if slope_q16 is None:
+            slope_q16 = cdiv((points[seg + 1][1] - points[seg][1]) * 65536, points[seg + 1][0] - points[seg][0])
+        code = points[seg][1] + ((slope_q16 * (mv - points[seg][0]) + 32768) >> 16)
+        lut.append(max(0, min(DAC_CAL_MAX_CODE, code)))
+    return lut
+
+
+LUTS = {s: build_lut(p) for s, p in NOMINAL_POINTS.items()}
+
+
+def dac_cal_code(bias_mv, sign):
+    lut = LUTS[-1 if sign < 0 else 1]
+    return lut[min(abs(bias_mv), DAC_CAL_MAX_MV)]
+
+
+class Plant:
+    # the bias a code really gives: the nominal line with a gain and offset
+    # error, and a drift that creeps one way and wanders over a few minutes
+    def __init__(self, gain, offset_mv, drift_mv_per_min, wander_mv, noise_counts, rng):
+        self.gain = gain
+        self.offset_mv = offset_mv
+        self.drift_mv_per_min = drift_mv_per_min
+        self.wander_mv = wander_mv
+        self.noise_counts = noise_counts
+        self.rng = rng
+
+    def output_mv(self, code, sign, t_s):
+        # the MOSFET of the sign, 0 to 3.3V over the DAC range
+        nominal = (code if sign < 0 else DAC_CAL_MAX_CODE - code) * 3300 / DAC_CAL_MAX_CODE
+        drift = self.drift_mv_per_min * t_s / 60 + self.wander_mv * math.sin(2 * math.pi * t_s / WANDER_PERIOD_S)
+        return (-1 if sign < 0 else 1) * (self.gain * nominal + self.offset_mv) + drift
+
+    def adc(self, mv):
+        counts = SENSE_ZERO_COUNTS + mv * SENSE_HALF_RANGE_COUNTS / SENSE_FULL_SCALE_MV
+        counts = round(counts + self.rng.gauss(0, self.noise_counts))
+        return max(0, min(ADC_MAX_COUNTS, counts))
+
+
+class Loop:
+    # run_out4_sense() and trim_step() for one steady bias
+    def __init__(self, bias_mv, gain=1, ignore_sign=False):
+        self.set_mv = bias_mv
+        self.code = dac_cal_code(bias_mv, bias_mv)
+        self.trim = 0
+        self.gain = gain
+        self.ignore_sign = ignore_sign
+        self.settle_until_ms = 0
+        self.skip = 0
+        self.block_sum = 0
+        self.block_samples = 0
+        self.sense_mv = None
+
+    def dac_code(self):
+        return max(0, min(DAC_CAL_MAX_CODE, self.code + self.trim))
+
+    def restart_block(self, now_ms, settle):
+        self.settle_until_ms = now_ms + (OUT4_SENSE_SETTLE_MS if settle else 0)
+        self.skip = 1 if settle else 0
+        self.block_sum = 0
+        self.block_samples = 0
+
+    def run(self, now_ms, samples):
+        # returns True at the end of a block
+        if self.skip:
+            drop = min(self.skip, len(samples))
+            samples = samples[drop:]
+            self.skip -= drop
+        if now_ms < self.settle_until_ms:
+            return False
+        self.block_sum += sum(samples)
+        self.block_samples += len(samples)
+        if now_ms - self.settle_until_ms < OUT4_SENSE_BLOCK_MS or self.block_samples < OUT4_SENSE_MIN_SAMPLES:
+            return False
+
+        mean_q4 = (self.block_sum << 4) // self.block_samples
+        self.sense_mv = cdiv((mean_q4 - SENSE_ZERO_COUNTS * 16) * SENSE_FULL_SCALE_MV, SENSE_HALF_RANGE_COUNTS * 16)
+        last_trim = self.trim
+        self.trim_step()
+        self.restart_block(now_ms, self.trim != last_trim)
+        return True
+
+    def trim_step(self):
+        sign = (self.set_mv > 0) - (self.set_mv < 0)
+        target = abs(self.set_mv)
+        error = target - (1 if self.ignore_sign else sign) * self.sense_mv
+        if -OUT4_TRIM_DEADBAND_MV <= error <= OUT4_TRIM_DEADBAND_MV:
+            return
+        slope = dac_cal_code(target + 100, sign) - dac_cal_code(target, sign)
+        if slope == 0 and target >= 100:
+            slope = dac_cal_code(target, sign) - dac_cal_code(target - 100, sign)
+        if slope == 0:
+            return
+        step = cdiv(error * slope * self.gain, 200)
+        if step == 0:
+            step = 1 if (error > 0) == (slope > 0) else -1
+        step = max(-OUT4_TRIM_MAX_STEP, min(OUT4_TRIM_MAX_STEP, step))
+        self.trim = max(-OUT4_TRIM_MAX_CODES, min(OUT4_TRIM_MAX_CODES, self.trim + step))
+
+
+def simulate(freq_hz, bias_mv, plant, num_blocks, **broken):
+    # runs the main task until num_blocks blocks are done and returns the
+    # loop, the trim at the end of each block and the time
+    loop = Loop(bias_mv, **broken)
+    sign = -1 if bias_mv < 0 else 1
+    loop.restart_block(0, True)
+    trims = []
+    pulses = 0
+    reported = 0
+    now_ms = 0
+    while len(trims) < num_blocks:
+        now_ms += MAIN_TASK_MS
+        # the pulses since the last pass, one ADC sample each
+        total = freq_hz * now_ms // 1000
+        new = total - pulses
+        pulses = total
+        counted = pulses // BUFFER_REPEATS * BUFFER_REPEATS
+        new_counted = counted - reported
+        reported = counted
+        take = new
+        if new_counted >= OUT4_SENSE_RING_SIZE // 4:
+            take = min(new, new_counted, OUT4_SENSE_RING_SIZE // 2)
+        mv = plant.output_mv(loop.dac_code(), sign, now_ms / 1000)
+        samples = [plant.adc(mv) for _ in range(take)]
+        if loop.run(now_ms, samples):
+            trims.append(loop.trim)
+    return loop, trims, now_ms / 1000
+
+
+def reachable(loop, plant, sign, t_s):
+    # the codes the trim can reach and the one nearest the target
+    low = max(0, loop.code - OUT4_TRIM_MAX_CODES)
+    high = min(DAC_CAL_MAX_CODE, loop.code + OUT4_TRIM_MAX_CODES)
+    target = loop.set_mv
+    out = {c: plant.output_mv(c, sign, t_s) for c in (low, high)}
+    inside = min(out.values()) <= target <= max(out.values())
+    nearest = min(out, key=lambda c: abs(out[c] - target))
+    return inside, nearest
+
+
+def check_run(freq_hz, bias_mv, plant, num_blocks, tolerance_mv, **broken):
+    loop, trims, t_s = simulate(freq_hz, bias_mv, plant, num_blocks, **broken)
+    sign = -1 if bias_mv < 0 else 1
+    inside, nearest = reachable(loop, plant, sign, t_s)
+    out = plant.output_mv(loop.dac_code(), sign, t_s)
+    if inside:
+        if abs(out - bias_mv) > tolerance_mv:
+            return "off by {:.1f} mV after {:.0f} s, trim {}".format(out - bias_mv, t_s, loop.trim), trims
+    elif loop.dac_code() != nearest:
+        return "out of reach but the code is {} not {}".format(loop.dac_code(), nearest), trims
+
+    # over the last quarter of the blocks, long after it settled, the trim
+    # follows the drift and the noise turns it back by a code or two, but it
+    # must never swing back and forth by more than the tolerance
+    tail = trims[-max(4, num_blocks // 4):]
+    steps = [b - a for a, b in zip(tail, tail[1:]) if b != a]
+    swing = max([abs(a) + abs(b) for a, b in zip(steps, steps[1:]) if (a > 0) != (b > 0)], default=0)
+    if swing * MV_PER_CODE > tolerance_mv:
+        return "the trim keeps swinging: {}".format(tail), trims
+    return None, trims
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Output 4 readback trim check")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--noise", type=float, default=1.5, help="ADC noise, counts rms")
+    parser.add_argument("--blocks", type=int, default=48, help="blocks to run each case for")
+    args = parser.parse_args()
+    rng = random.Random(args.seed)
+
+    # a DAC code is 0.8mV and an ADC count 2.4mV. The average of a block at
+    # 1 Hz is of only 4 samples, so the noise on it is half the ADC noise
+    adc_mv = SENSE_FULL_SCALE_MV / SENSE_HALF_RANGE_COUNTS
+    tolerance_mv = OUT4_TRIM_DEADBAND_MV + 1 + 2 * adc_mv * max(0.5, args.noise / 2)
+
+    # gain, offset mV, drift mV a minute and wander mV. The last one is more
+    # than the trim can take out at the ends of the range
+    plants = [(1.0, 0, 0, 0), (1.03, -25, 3, 4), (0.97, 40, -3, 4), (1.08, 150, 0, 0)]
+    plants += [(rng.uniform(0.95, 1.05), rng.uniform(-60, 60), rng.uniform(-5, 5), rng.uniform(0, 5))
+               for _ in range(2)]
+
+    runs = 0
+    at_limit = 0
+    for freq in FREQS_HZ:
+        for gain, offset, drift, wander in plants:
+            for bias in BIASES_MV:
+                plant = Plant(gain, offset, drift, wander, args.noise, rng)
+                fault, trims = check_run(freq, bias, plant, args.blocks, tolerance_mv)
+                runs += 1
+                if fault:
+                    print("FAIL: {} Hz bias {} mV gain {:.3f} offset {:.0f} mV drift {:.0f} mV/min: {}".format(
+                        freq, bias, gain, offset, drift, fault))
+                    return 1
+                if abs(trims[-1]) == OUT4_TRIM_MAX_CODES:
+                    at_limit += 1
+        print("  {} Hz ok".format(freq))
+    print("{} runs settled within {:.1f} mV or at the nearest limit, {} with the trim at its limit".format(
+        runs, tolerance_mv, at_limit))
+
+    # the broken versions have to be caught
+    plant = Plant(1.03, -25, 0, 0, args.noise, rng)
+    fault, trims = check_run(1000, 1000, plant, args.blocks, tolerance_mv)
+    if fault:
+        print("FAIL: the working loop failed the case the broken ones are run on: {}".format(fault))
+        return 1
+    fault, _ = check_run(1000, 1000, Plant(1.03, -25, 0, 0, args.noise, rng), args.blocks, tolerance_mv,
+                         gain=4)
+    if not fault:
+        print("FAIL: too much gain was not caught")
+        return 1
+    print("too much gain is caught: {}".format(fault))
+    fault, _ = check_run(1000, -1000, Plant(1.03, -25, 0, 0, args.noise, rng), args.blocks, tolerance_mv,
+                         ignore_sign=True)
+    if not fault:
+        print("FAIL: ignoring the sign was not caught")
+        return 1
+    print("ignoring the sign is caught: {}".format(fault))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
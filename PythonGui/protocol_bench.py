@@ -0,0 +1,284 @@
+"""
+protocol_bench.py
+ Round trip latency and throughput benchmark for the function generator's
+ serial control protocol. Works against the real device over USB or UART, or
+ against anything that speaks the protocol behind a pty.
+
+ Tests:
+   query   - 0xAA configuration query, time until the 9 byte config comes back
+   config  - legacy 9 byte config frame followed by a query, time until the
+             echoed config shows the new frequency
+   rate    - pipelined queries with a fixed number in flight, gives the
+             sustained command rate and how many replies never came back
+
+ The config test turns the outputs off and leaves the frequency at the last
+ value it sent.
+
+ The results are written as JSON so runs against different firmware versions
+ can be compared.
+
+ Examples:
+   python protocol_bench.py --port /dev/ttyACM0 --label fw-1.4 --out fw14.json
+   python protocol_bench.py --simulate
+"""
+
+import argparse
+import json
+import os
+import platform
+import struct
+import threading
+import time
+
+import serial
+
+from framing import escape_data, FrameDecoder
+
+CMD_QUERY_CONFIG = 0xAA
+CONFIG_FRAME_SIZE = 9
+
+# frequencies the config test cycles through, all within the device limits
+BENCH_FREQS = [1000, 2000, 5000, 10000, 20000, 50000, 100000, 125000]
+
+
+class FrameReader:
+    # Collects whole frames out of the serial stream. Reads in chunks with a
+    # short timeout so waiting for a reply does not spin the host CPU
+    def __init__(self, ser):
+        self.ser = ser
+        self.decoder = FrameDecoder()
+        self.frames = []
+
+    def feed(self, data):
+        self.frames.extend(self.decoder.feed(data))
+
+    def poll(self):
+        data = self.ser.read(max(1, self.ser.in_waiting))
+        if data:
+            self.feed(data)
+        frames = self.frames
+        self.frames = []
+        return frames
+
+    def wait_for(self, match, deadline):
+        # Returns the first frame match() accepts, or None at the deadline
+        while time.perf_counter() < deadline:
+            for frame in self.poll():
+                if match(frame):
+                    return frame
+        return None
+
+
+def is_config(frame):
+    # telemetry records and anything else on the link are skipped
+    return len(frame) == CONFIG_FRAME_SIZE
+
+
+def config_frame(freq):
+    # Long on time, 0.45V, 0V bias, outputs off, so the bench never drives
+    # anything connected to the outputs
+    return struct.pack("<IBBHB", freq, 0x01, 0x00, 5000, 0x00)
+
+
+def config_freq(frame):
+    return struct.unpack("<I", frame[:4])[0]
+
+
+def percentile(samples, pct):
+    if not samples:
+        return None
+    ordered = sorted(samples)
+    index = min(len(ordered) - 1, int(round(pct / 100.0 * (len(ordered) - 1))))
+    return ordered[index]
+
+
+def summarize(rtts, sent, timeouts):
+    rtts_us = [rtt * 1e6 for rtt in rtts]
+    return {
+        "sent": sent,
+        "received": len(rtts),
+        "timeouts": timeouts,
+        "loss": timeouts / sent if sent else 0.0,
+        "rtt_us": {
+            "min": min(rtts_us) if rtts_us else None,
+            "p50": percentile(rtts_us, 50),
+            "p90": percentile(rtts_us, 90),
+            "p99": percentile(rtts_us, 99),
+            "max": max(rtts_us) if rtts_us else None,
+            "mean": sum(rtts_us) / len(rtts_us) if rtts_us else None,
+        },
+    }
+
+
+def drain(ser, quiet_time=0.05):
+    # Throw away anything left over from earlier commands or a telemetry stream
+    ser.reset_input_buffer()
+    end = time.perf_counter() + quiet_time
+    while time.perf_counter() < end:
+        if ser.read(max(1, ser.in_waiting)):
+            end = time.perf_counter() + quiet_time
+
+
+def bench_query(ser, count, timeout):
+    reader = FrameReader(ser)
+    query = escape_data([CMD_QUERY_CONFIG])
+    rtts = []
+    timeouts = 0
+    drain(ser)
+    for _ in range(count):
+        start = time.perf_counter()
+        ser.write(query)
+        if reader.wait_for(is_config, start + timeout) is None:
+            timeouts += 1
+            drain(ser)
+        else:
+            rtts.append(time.perf_counter() - start)
+    return summarize(rtts, count, timeouts)
+
+
+def bench_config(ser, count, timeout):
+    reader = FrameReader(ser)
+    query = escape_data([CMD_QUERY_CONFIG])
+    rtts = []
+    timeouts = 0
+    drain(ser)
+    for i in range(count):
+        freq = BENCH_FREQS[i % len(BENCH_FREQS)]
+        start = time.perf_counter()
+        ser.write(escape_data(config_frame(freq)) + query)
+        match = lambda frame: is_config(frame) and config_freq(frame) == freq
+        if reader.wait_for(match, start + timeout) is None:
+            timeouts += 1
+            drain(ser)
+        else:
+            rtts.append(time.perf_counter() - start)
+    return summarize(rtts, count, timeouts)
+
+
+def bench_rate(ser, duration, window, timeout):
+    # Keeps `window` queries in flight. Replies carry no sequence number so
+    # they are matched to requests in order
+    reader = FrameReader(ser)
+    query = escape_data([CMD_QUERY_CONFIG])
+    in_flight = []
+    rtts = []
+    sent = 0
+    drain(ser)
+
+    start = time.perf_counter()
+    end = start + duration
+    while time.perf_counter() < end:
+        while len(in_flight) < window:
+            in_flight.append(time.perf_counter())
+            ser.write(query)
+            sent += 1
+        for frame in reader.poll():
+            if is_config(frame) and in_flight:
+                rtts.append(time.perf_counter() - in_flight.pop(0))
+        # a reply that never came frees its slot after the timeout
+        now = time.perf_counter()
+        while in_flight and now - in_flight[0] > timeout:
+            in_flight.pop(0)
+    elapsed = time.perf_counter() - start
+
+    # let the last replies arrive before counting what was lost
+    deadline = time.perf_counter() + timeout
+    while in_flight and time.perf_counter() < deadline:
+        for frame in reader.poll():
+            if is_config(frame) and in_flight:
+                rtts.append(time.perf_counter() - in_flight.pop(0))
+
+    result = summarize(rtts, sent, sent - len(rtts))
+    result["window"] = window
+    result["duration_s"] = elapsed
+    result["commands_per_s"] = len(rtts) / elapsed if elapsed > 0 else 0.0
+    return result
+
+
+def simulated_device():
+    # Minimal model of the firmware command handling on a pty, for checking
+    # the bench itself without hardware. Returns the path to open
+    master, slave = os.openpty()
+    config = bytearray(config_frame(1000))
+
+    def store(frame):
+        # the device echoes the voltage and running bytes inverted
+        config[:] = frame
+        config[5] = int(frame[5] == 0)
+        config[8] = int(frame[8] == 0)
+
+    store(config_frame(1000))
+
+    def run():
+        reader = FrameReader(None)
+        while True:
+            try:
+                data = os.read(master, 4096)
+            except OSError:
+                return
+            reader.feed(data)
+            for frame in reader.frames:
+                if len(frame) == 1 and frame[0] == CMD_QUERY_CONFIG:
+                    os.write(master, escape_data(config))
+                elif len(frame) == CONFIG_FRAME_SIZE:
+                    store(frame)
+                elif len(frame) == CONFIG_FRAME_SIZE + 1:
+                    # a sequence numbered change is echoed with its number
+                    store(frame[:CONFIG_FRAME_SIZE])
+                    os.write(master, escape_data(config + frame[CONFIG_FRAME_SIZE:]))
+            reader.frames = []
+
+    threading.Thread(target=run, daemon=True).start()
+    return os.ttyname(slave)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Benchmark the function generator control protocol")
+    parser.add_argument("--port", help="serial port or pty to use")
+    parser.add_argument("--simulate", action="store_true", help="run against a simulated device on a pty")
+    parser.add_argument("--baud", type=int, default=1000000)
+    parser.add_argument("--count", type=int, default=1000, help="round trips per latency test")
+    parser.add_argument("--duration", type=float, default=5.0, help="seconds for the rate test")
+    parser.add_argument("--window", type=int, default=8, help="commands in flight for the rate test")
+    parser.add_argument("--timeout", type=float, default=0.5, help="seconds to wait for a reply")
+    parser.add_argument("--tests", default="query,config,rate")
+    parser.add_argument("--label", default="", help="firmware version or other tag stored in the report")
+    parser.add_argument("--out", help="write the JSON report here instead of stdout")
+    args = parser.parse_args()
+
+    if args.simulate:
+        port = simulated_device()
+    elif args.port:
+        port = args.port
+    else:
+        parser.error("either --port or --simulate is needed")
+
+    ser = serial.Serial(port, baudrate=args.baud, timeout=0.001)
+
+    report = {
+        "label": args.label,
+        "port": "simulated" if args.simulate else port,
+        "time": time.strftime("%Y-%m-%dT%H:%M:%S%z"),
+        "host": platform.platform(),
+        "python": platform.python_version(),
+        "tests": {},
+    }
+
+    tests = args.tests.split(",")
+    if "query" in tests:
+        report["tests"]["query"] = bench_query(ser, args.count, args.timeout)
+    if "config" in tests:
+        report["tests"]["config"] = bench_config(ser, args.count, args.timeout)
+    if "rate" in tests:
+        report["tests"]["rate"] = bench_rate(ser, args.duration, args.window, args.timeout)
+    ser.close()
+
+    text = json.dumps(report, indent=2)
+    if args.out:
+        with open(args.out, "w") as f:
+            f.write(text + "\n")
+    print(text)
+
+
+if __name__ == "__main__":
+    main()
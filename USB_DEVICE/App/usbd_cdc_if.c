@@ -22,7 +22,11 @@
 #include "usbd_cdc_if.h"
 
 /* USER CODE BEGIN INCLUDE */
+#include <string.h>
 #include "cmsis_os.h"
+#include "serial.h"
+#include "outputs.h"
+#include "trace.h"
 /* USER CODE END INCLUDE */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -32,6 +36,12 @@
 /* USER CODE BEGIN PV */
 /* Private variables ---------------------------------------------------------*/
 extern osMessageQId vComHandle;
+extern osThreadId serialHandle;
+extern volatile bool trigger_fired;
+
+/* The trigger frame is handled right here instead of going through the
+   serial task, so the latency is just this interrupt */
+static const uint8_t trigger_frame[] = {0x7E, CMD_TRIGGER, 0x7E};
 
 /* USER CODE END PV */
 
@@ -95,6 +105,11 @@ uint8_t UserRxBufferFS[APP_RX_DATA_SIZE];
 uint8_t UserTxBufferFS[APP_TX_DATA_SIZE];
 
 /* USER CODE BEGIN PRIVATE_VARIABLES */
+/* Set while the OUT endpoint is left NAKing because vCom is too full to
+   take another packet. The serial task re-arms it once there is room */
+volatile uint8_t cdc_rx_paused = 0;
+/* Bytes lost because vCom was full, should stay at zero */
+volatile uint32_t cdc_rx_overflows = 0;
 
 /* USER CODE END PRIVATE_VARIABLES */
 
@@ -262,13 +277,43 @@ static int8_t CDC_Control_FS(uint8_t cmd, uint8_t* pbuf, uint16_t length)
 static int8_t CDC_Receive_FS(uint8_t* Buf, uint32_t *Len)
 {
   /* USER CODE BEGIN 6 */
-	USBD_CDC_SetRxBuffer(&hUsbDeviceFS, &Buf[0]);
-	USBD_CDC_ReceivePacket(&hUsbDeviceFS);
+	if (*Len == sizeof(trigger_frame) && memcmp(Buf, trigger_frame, sizeof(trigger_frame)) == 0)
+	{
+		if (fire_output_waveform())
+		{
+			trace_record(TRACE_TRIGGER, usb_irq_cycles);
+			trigger_fired = true;
+		}
+		USBD_CDC_SetRxBuffer(&hUsbDeviceFS, &Buf[0]);
+		USBD_CDC_ReceivePacket(&hUsbDeviceFS);
+		return (USBD_OK);
+	}
+
 	for (int i = 0; i < *Len; i++)
 	{
-		xQueueSendToBackFromISR(vComHandle, &Buf[i], NULL);
+		if (xQueueSendToBackFromISR(vComHandle, &Buf[i], NULL) != pdPASS)
+		{
+			cdc_rx_overflows++;
+		}
+	}
+
+	// only accept the next packet if it is guaranteed to fit. Otherwise the
+	// endpoint keeps NAKing and the host waits until the serial task catches up
+	USBD_CDC_SetRxBuffer(&hUsbDeviceFS, &Buf[0]);
+	if (VCOM_QUEUE_LENGTH - uxQueueMessagesWaitingFromISR(vComHandle) >= CDC_DATA_FS_OUT_PACKET_SIZE)
+	{
+		USBD_CDC_ReceivePacket(&hUsbDeviceFS);
+	}
+	else
+	{
+		cdc_rx_paused = 1;
 	}
 
+	// wake the serial task now instead of on its next poll
+	BaseType_t woken = pdFALSE;
+	vTaskNotifyGiveFromISR(serialHandle, &woken);
+	portYIELD_FROM_ISR(woken);
+
 	return (USBD_OK);
   /* USER CODE END 6 */
 }
@@ -289,6 +334,9 @@ uint8_t CDC_Transmit_FS(uint8_t* Buf, uint16_t Len)
   uint8_t result = USBD_OK;
   /* USER CODE BEGIN 7 */
   USBD_CDC_HandleTypeDef *hcdc = (USBD_CDC_HandleTypeDef*)hUsbDeviceFS.pClassData;
+  if (hcdc == NULL){
+    return USBD_FAIL; // not enumerated yet
+  }
   if (hcdc->TxState != 0){
     return USBD_BUSY;
   }
@@ -323,6 +371,25 @@ static int8_t CDC_TransmitCplt_FS(uint8_t *Buf, uint32_t *Len, uint8_t epnum)
 
 /* USER CODE BEGIN PRIVATE_FUNCTIONS_IMPLEMENTATION */
 
+/**
+  * @brief  CDC_ResumeReceive_FS
+  *         Re-arms the OUT endpoint after CDC_Receive_FS paused it. Called
+  *         from the serial task once vCom has room for a full packet.
+  * @retval None
+  */
+void CDC_ResumeReceive_FS(void)
+{
+  if (!cdc_rx_paused || uxQueueSpacesAvailable(vComHandle) < CDC_DATA_FS_OUT_PACKET_SIZE)
+  {
+    return;
+  }
+
+  taskENTER_CRITICAL();
+  cdc_rx_paused = 0;
+  USBD_CDC_ReceivePacket(&hUsbDeviceFS);
+  taskEXIT_CRITICAL();
+}
+
 /* USER CODE END PRIVATE_FUNCTIONS_IMPLEMENTATION */
 
 /**
@@ -48,9 +48,11 @@
   * @{
   */
 /* Define size for the receive and transmit buffer over CDC */
-#define APP_RX_DATA_SIZE  2048
-#define APP_TX_DATA_SIZE  2048
+#define APP_RX_DATA_SIZE  64
+#define APP_TX_DATA_SIZE  64
 /* USER CODE BEGIN EXPORTED_DEFINES */
+/* Length of the vCom byte queue, must match the queue set up in the .ioc */
+#define VCOM_QUEUE_LENGTH 250U
 
 /* USER CODE END EXPORTED_DEFINES */
 
@@ -93,6 +95,8 @@
 extern USBD_CDC_ItfTypeDef USBD_Interface_fops_FS;
 
 /* USER CODE BEGIN EXPORTED_VARIABLES */
+extern volatile uint8_t cdc_rx_paused;
+extern volatile uint32_t cdc_rx_overflows;
 
 /* USER CODE END EXPORTED_VARIABLES */
 
@@ -108,6 +112,7 @@ extern USBD_CDC_ItfTypeDef USBD_Interface_fops_FS;
 uint8_t CDC_Transmit_FS(uint8_t* Buf, uint16_t Len);
 
 /* USER CODE BEGIN EXPORTED_FUNCTIONS */
+void CDC_ResumeReceive_FS(void);
 
 /* USER CODE END EXPORTED_FUNCTIONS */
 